@@ -0,0 +1,174 @@
+#include "batch.h"
+#include "bmp_io.h"
+#include "pipeline.h"
+#include "profile.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <glob.h>
+#include <iomanip>
+#include <map>
+#include <stdexcept>
+
+namespace {
+
+bool IsBmpFile(const std::filesystem::path &path) {
+    std::string extension = path.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    return extension == ".bmp";
+}
+
+double Percentile(const std::vector<double> &sorted, std::size_t percent) {
+    return sorted[std::min(sorted.size() - 1, sorted.size() * percent / 100)];
+}
+
+}  // namespace
+
+BatchRunner::BatchRunner(const std::vector<Filter *> &filters, ThreadPool *pool, bool streaming,
+                         ResultCache *cache, PixelFormat format)
+        : filters_(filters), pool_(pool), streaming_(streaming), cache_(cache), format_(format) {
+}
+
+std::vector<std::string> BatchRunner::ListInputs(const std::string &source) {
+    std::vector<std::string> inputs;
+    if (source.find_first_of("*?[") != std::string::npos) {
+        glob_t matches;
+        if (glob(source.c_str(), 0, nullptr, &matches) == 0) {
+            for (std::size_t i = 0; i < matches.gl_pathc; ++i) {
+                inputs.emplace_back(matches.gl_pathv[i]);
+            }
+        }
+        globfree(&matches);
+    } else if (std::filesystem::is_directory(source)) {
+        for (const auto &entry : std::filesystem::directory_iterator(source)) {
+            if (entry.is_regular_file() && IsBmpFile(entry.path())) {
+                inputs.push_back(entry.path().string());
+            }
+        }
+        std::sort(inputs.begin(), inputs.end());
+    } else {
+        std::ifstream manifest(source);
+        if (!manifest) {
+            throw std::runtime_error("Could not open the batch manifest");
+        }
+        std::string line;
+        while (std::getline(manifest, line)) {
+            line.erase(line.find_last_not_of(" \t\r") + 1);
+            if (!line.empty() && line[0] != '#') {
+                inputs.push_back(line);
+            }
+        }
+    }
+    if (inputs.empty()) {
+        throw std::runtime_error("No input files found for the batch");
+    }
+    return inputs;
+}
+
+std::size_t BatchRunner::Run(const std::vector<std::string> &inputs, const std::string &output_directory,
+                             std::ostream &report) {
+    std::filesystem::create_directories(output_directory);
+    std::vector<Result> results(inputs.size());
+    // Inputs from different directories may share a file name. The first of them gets the output,
+    // the others fail rather than race for it; the same file listed twice writes the same output.
+    std::vector<std::string> outputs(inputs.size());
+    std::map<std::string, std::size_t> writers;
+    for (std::size_t k = 0; k < inputs.size(); ++k) {
+        outputs[k] = (std::filesystem::path(output_directory) / std::filesystem::path(inputs[k]).filename()).string();
+        auto [it, inserted] = writers.emplace(outputs[k], k);
+        std::error_code error;
+        if (!inserted && !std::filesystem::equivalent(inputs[it->second], inputs[k], error)) {
+            results[k].error = "the output file " + outputs[k] + " is also written for " + inputs[it->second];
+        }
+    }
+    auto start = std::chrono::steady_clock::now();
+    auto job = [&](std::size_t k) {
+        if (results[k].error.empty()) {
+            Process(inputs[k], outputs[k], results[k]);
+        }
+    };
+    if (pool_ != nullptr) {
+        pool_->ParallelFor(inputs.size(), job);
+    } else {
+        for (std::size_t k = 0; k < inputs.size(); ++k) {
+            job(k);
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::size_t failed = 0;
+    double megapixels = 0;
+    std::vector<double> latencies;
+    report << std::fixed;
+    for (std::size_t k = 0; k < inputs.size(); ++k) {
+        const Result &result = results[k];
+        if (!result.error.empty()) {
+            report << inputs[k] << "\tFAILED: " << result.error << '\n';
+            ++failed;
+            continue;
+        }
+        report << inputs[k] << '\t' << result.width << 'x' << result.height << '\t' << std::setprecision(2)
+               << result.seconds * 1e3 << " ms\n";
+        megapixels += static_cast<double>(result.width) * result.height / 1e6;
+        latencies.push_back(result.seconds * 1e3);
+    }
+    std::sort(latencies.begin(), latencies.end());
+    report << inputs.size() - failed << " files, " << failed << " failed, " << std::setprecision(3) << seconds
+           << " s, " << std::setprecision(1) << megapixels / seconds << " MP/s, "
+           << (inputs.size() - failed) / seconds << " files/s";
+    if (!latencies.empty()) {
+        report << "; latency ms p50 " << std::setprecision(2) << Percentile(latencies, 50) << ", p95 "
+               << Percentile(latencies, 95) << ", max " << latencies.back();
+    }
+    report << "; buffers " << buffers_.GetAllocated() << " allocated, " << buffers_.GetReused() << " reused";
+    if (cache_ != nullptr) {
+        report << "; cache ";
+        cache_->Report(report);
+    }
+    report << std::endl;
+    return failed;
+}
+
+void BatchRunner::Process(const std::string &input, const std::string &output, Result &result) {
+    BufferPool::Scope scope(&buffers_);
+    Profiler::Stage stage(input);
+    auto start = std::chrono::steady_clock::now();
+    try {
+        // The output directory may be the input one, with inputs still mapped.
+        std::unique_ptr<OutputFile> outfile;
+        if (streaming_) {
+            BmpRowReader reader(input.c_str());
+            result.width = reader.GetInfoHeader().biWidth;
+            result.height = reader.GetInfoHeader().biHeight;
+            stage.SetPixels(static_cast<std::int64_t>(result.width) * result.height);
+            outfile = std::make_unique<OutputFile>(output);
+            StreamingPipeline(filters_, pool_).Run(reader, outfile->GetStream(), format_);
+        } else {
+            std::unique_ptr<Bitmap> bitmap(BmpReader::Read(input.c_str()));
+            if (bitmap == nullptr) {
+                throw std::runtime_error("Could not read the input file");
+            }
+            result.width = bitmap->GetWidth();
+            result.height = bitmap->GetHeight();
+            stage.SetPixels(static_cast<std::int64_t>(result.width) * result.height);
+            Bitmap *image =
+                    filters_.empty() ? bitmap.get() : Pipeline(filters_, pool_, cache_).ApplyInPlace(bitmap.get());
+            std::unique_ptr<Bitmap> filtered(image != bitmap.get() ? image : nullptr);
+            outfile = std::make_unique<OutputFile>(output);
+            BitmapFileHeader file_header = image->GetFileHeader();
+            BitmapInfoHeader info_header = image->GetInfoHeader();
+            Bitmap::SetFormat(file_header, info_header, format_);
+            BmpRowWriter writer(outfile->GetStream(), file_header, info_header);
+            writer.WriteRows(image);
+            writer.Flush();
+        }
+        outfile->Commit();
+    } catch (const std::exception &e) {
+        result.error = e.what();
+        return;
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "buffer_pool.h"
+#include "filter.h"
+#include "result_cache.h"
+#include "thread_pool.h"
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Runs one parsed filter chain over many files in a single process. Files are processed
+// concurrently, one per pool worker, so at most GetThreadCount() images are in flight at a time;
+// the filters of each file then run inline on its worker. Pixel buffers are recycled through a
+// BufferPool, and the filter objects are shared by all files, so they must not keep per-image state.
+// With a cache every file goes through it, which also skips work for files repeated in the batch.
+class BatchRunner {
+public:
+    // Outputs are written in `format`.
+    BatchRunner(const std::vector<Filter *> &filters, ThreadPool *pool, bool streaming,
+                ResultCache *cache = nullptr, PixelFormat format = PixelFormat::Bgr);
+
+    // A directory (its .bmp files), a glob pattern, or a manifest file listing one path per line.
+    static std::vector<std::string> ListInputs(const std::string &source);
+
+    // Writes every input into `output_directory` under its own file name, then prints the input
+    // size and latency of each file and the totals to `report`. A file that fails is reported and skipped,
+    // as is one whose name an earlier, different input already writes. Returns the number of failed files.
+    std::size_t Run(const std::vector<std::string> &inputs, const std::string &output_directory,
+                    std::ostream &report);
+
+private:
+    struct Result {
+        std::int32_t width = 0;
+        std::int32_t height = 0;
+        double seconds = 0;
+        std::string error;
+    };
+
+    void Process(const std::string &input, const std::string &output, Result &result);
+
+    std::vector<Filter *> filters_;
+    ThreadPool *pool_;
+    bool streaming_;
+    ResultCache *cache_;
+    PixelFormat format_;
+    BufferPool buffers_;
+};
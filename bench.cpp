@@ -0,0 +1,1132 @@
+// Benchmarks BMP reading and writing and every filter on synthetic images.
+//
+// finale_bench [--sizes 1,10,100] [--repeat N] [--threads N] [--case SUBSTRING] [--json FILE] [--dir DIR]
+//
+// Every size (in megapixels, 4:3) is run with an unpadded width (a multiple of 4) and a padded
+// one. Each case is timed --repeat times and the best run is kept. Progress goes to stderr,
+// results go to stdout (or --json FILE) as JSON. Every case also reports the heap allocations
+// and the image buffers of its last run. The in-place chain takes its buffers from a pool that
+// recycles them, so that it can be checked to allocate no image buffer and nothing per stage
+// once warmed up.
+//
+// finale_bench --check FILE [--budget-scale X] [--threads N] [--case SUBSTRING]
+// finale_bench --update FILE
+//
+// Regression mode, on the 1 MP reference images only. BMPs of awkward sizes in every format are
+// round-tripped through Bitmap::Write, BmpRowWriter, Bitmap::Read and BmpReader first, the row
+// kernels of every instruction set the CPU has are compared with the scalar ones, the nearest seeds
+// of the voronoi grid with a scan over all seeds, chains sharing a prefix must load it from a
+// result cache, and ImageProcessor must write into strided views what Pipeline returns. Then every
+// case that produces an image is hashed and compared with the golden hash in FILE, and every case
+// must reach its throughput budget in FILE, scaled by --budget-scale (0 turns budgets off, < 1
+// suits slower machines). Hashes do not depend on the thread count or the instruction set. Exits
+// with 1 on any failure. --update rewrites FILE from the current build; budgets are set to
+// kBudgetFraction of the measured throughput, or kept if they were lower already: some cases vary
+// by several times between runs, with the page faults of their output buffers, so running --update
+// a few times settles on budgets every run reaches. They catch large regressions, such as a kernel
+// that no longer vectorizes or a filter whose cost grows with its radius, rather than a few
+// percent.
+
+#include "bitmap.h"
+#include "bmp_io.h"
+#include "buffer_pool.h"
+#include "filter.h"
+#include "image_view.h"
+#include "kernels.h"
+#include "pipeline.h"
+#include "pyramid.h"
+#include "result_cache.h"
+#include "static_pipeline.h"
+#include "thread_pool.h"
+#include "voronoi.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <malloc.h>
+#include <map>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+std::atomic<std::uint64_t> heap_allocations = 0;
+
+void *Allocate(std::size_t size, std::size_t alignment) {
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    size = std::max<std::size_t>(size, 1);
+    if (alignment <= alignof(std::max_align_t)) {
+        return std::malloc(size);
+    }
+    // aligned_alloc wants a multiple of the alignment; its memory is released by free as well.
+    return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+void *AllocateOrThrow(std::size_t size, std::size_t alignment) {
+    if (void *pointer = Allocate(size, alignment)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+}  // namespace
+
+// Counts every allocation made through new, including the ones in the standard containers. Every
+// form of new and delete is replaced, so that all of them agree on malloc and free.
+void *operator new(std::size_t size) {
+    return AllocateOrThrow(size, 0);
+}
+
+void *operator new[](std::size_t size) {
+    return AllocateOrThrow(size, 0);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment) {
+    return AllocateOrThrow(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+    return AllocateOrThrow(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    return Allocate(size, 0);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+    return Allocate(size, 0);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return Allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return Allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void *pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, std::size_t) noexcept {
+    std::free(pointer);
+}
+
+void operator delete[](void *pointer, std::size_t) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, std::align_val_t) noexcept {
+    std::free(pointer);
+}
+
+void operator delete[](void *pointer, std::align_val_t) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, std::size_t, std::align_val_t) noexcept {
+    std::free(pointer);
+}
+
+void operator delete[](void *pointer, std::size_t, std::align_val_t) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, const std::nothrow_t &) noexcept {
+    std::free(pointer);
+}
+
+void operator delete[](void *pointer, const std::nothrow_t &) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, std::align_val_t, const std::nothrow_t &) noexcept {
+    std::free(pointer);
+}
+
+void operator delete[](void *pointer, std::align_val_t, const std::nothrow_t &) noexcept {
+    std::free(pointer);
+}
+
+namespace {
+
+constexpr double kCheckMegapixels = 1;
+constexpr double kBudgetFraction = 0.25;
+// Heap allocations a warmed-up in-place run of a chain may make: the bitmaps it returns or views
+// into and the owners of their buffers, whatever the number of stages and bands.
+constexpr std::uint64_t kMaxSteadyAllocations = 8;
+
+struct Options {
+    std::vector<double> sizes = {1, 10, 100};
+    int repeat = 3;
+    std::size_t thread_count = 1;
+    std::string filter;
+    std::string json;
+    std::string directory = std::filesystem::temp_directory_path().string();
+    std::string check;
+    std::string update;
+    double budget_scale = 1;
+};
+
+struct Measurement {
+    std::string name;
+    std::int32_t width;
+    std::int32_t height;
+    double seconds;
+    double peak_rss_mb;
+    std::uint64_t allocations;
+    std::size_t buffers;
+    // The case must run in the steady state: allocating no image buffer and at most
+    // kMaxSteadyAllocations on the heap.
+    bool steady;
+    // Of the resulting image, in regression mode; empty for cases that produce none.
+    std::string hash;
+};
+
+// Golden hash and throughput budget of a case; cases are keyed by name and size, see Key.
+struct Golden {
+    std::string hash;
+    double budget;
+};
+
+// Peak resident set size since the last ResetPeakRss(), in megabytes.
+double PeakRssMb() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("VmHWM:", 0) == 0) {
+            return std::strtod(line.c_str() + 6, nullptr) / 1024.0;
+        }
+    }
+    return 0;
+}
+
+// Returns freed heap memory to the system first, so that what earlier cases left behind does not count.
+void ResetPeakRss() {
+    malloc_trim(0);
+    std::ofstream("/proc/self/clear_refs") << "5";
+}
+
+Bitmap MakeImage(std::int32_t width, std::int32_t height) {
+    BitmapFileHeader file_header = {};
+    BitmapInfoHeader info_header = {};
+    file_header.bfType = 0x4D42;
+    info_header.biWidth = width;
+    info_header.biHeight = height;
+    info_header.biPlanes = 1;
+    info_header.biBitCount = 24;
+    info_header.biSizeImage = static_cast<std::uint32_t>(height * Bitmap::PaddedRowSize(width));
+    file_header.bfSize = sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader) + info_header.biSizeImage;
+    file_header.bfOffBits = sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader);
+    Bitmap bitmap(file_header, info_header);
+
+    // Smooth gradients with noise on top, so that neither the blurs nor the edge detector see a flat image.
+    std::uint32_t state = 12345;
+    for (std::int32_t i = 0; i < height; ++i) {
+        Color *row = bitmap.GetRow(i);
+        for (std::int32_t j = 0; j < width; ++j) {
+            state = state * 1664525u + 1013904223u;
+            std::uint8_t noise = state >> 24;
+            row[j] = {static_cast<std::uint8_t>((j * 255 / width + noise) / 2),
+                      static_cast<std::uint8_t>((i * 255 / height + noise) / 2), static_cast<std::uint8_t>(noise)};
+        }
+    }
+    return bitmap;
+}
+
+// FNV-1a over the format, the size and the pixels of every row, leaving the padding out.
+std::string Hash(const Bitmap &bitmap) {
+    std::uint64_t hash = 14695981039346656037ull;
+    auto add = [&hash](const std::uint8_t *bytes, std::size_t size) {
+        for (std::size_t k = 0; k < size; ++k) {
+            hash = (hash ^ bytes[k]) * 1099511628211ull;
+        }
+    };
+    std::int32_t header[3] = {static_cast<std::int32_t>(bitmap.GetFormat()), bitmap.GetWidth(), bitmap.GetHeight()};
+    add(reinterpret_cast<const std::uint8_t *>(header), sizeof(header));
+    std::size_t row_size = bitmap.GetWidth() * Bitmap::PixelSize(bitmap.GetFormat());
+    for (std::int32_t i = 0; i < bitmap.GetHeight(); ++i) {
+        add(bitmap.GetPixels() + i * bitmap.GetRowStride(), row_size);
+    }
+    std::ostringstream hex;
+    hex << std::hex << std::setw(16) << std::setfill('0') << hash;
+    return hex.str();
+}
+
+bool SamePixels(const Bitmap &a, const Bitmap &b) {
+    if (a.GetFormat() != b.GetFormat() || a.GetWidth() != b.GetWidth() || a.GetHeight() != b.GetHeight()) {
+        return false;
+    }
+    std::size_t row_size = a.GetWidth() * Bitmap::PixelSize(a.GetFormat());
+    for (std::int32_t i = 0; i < a.GetHeight(); ++i) {
+        if (std::memcmp(a.GetPixels() + i * a.GetRowStride(), b.GetPixels() + i * b.GetRowStride(), row_size) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Writes images of every format with widths of every remainder modulo 4, a single pixel and very
+// tall and very wide ones. Bitmap::Write and BmpRowWriter must produce the same file, of the size
+// its headers give, and Bitmap::Read and BmpReader must read back the same pixels. Returns the
+// number of failures.
+int CheckRoundTrips(const std::string &directory) {
+    const std::pair<std::int32_t, std::int32_t> sizes[] = {{1, 1},  {4, 3},    {5, 3},    {6, 3},
+                                                           {7, 3}, {1, 3000}, {3000, 1}, {3, 2000}};
+    const PixelFormat formats[] = {PixelFormat::Bgr, PixelFormat::Gray, PixelFormat::Bgrx};
+    const char *format_names[] = {"bgr", "gray", "bgrx"};
+    std::string path = (std::filesystem::path(directory) / "finale_bench_check.bmp").string();
+    int failures = 0;
+    for (auto [width, height] : sizes) {
+        Bitmap bgr = MakeImage(width, height);
+        for (std::size_t f = 0; f < std::size(formats); ++f) {
+            std::unique_ptr<Bitmap> source(bgr.Convert(formats[f]));
+            {
+                std::ofstream outstream(path, std::ios::out | std::ios::binary);
+                source->Write(outstream);
+            }
+            std::ostringstream streamed;
+            BmpRowWriter writer(streamed, source->GetFileHeader(), source->GetInfoHeader());
+            writer.WriteRows(source.get());
+            writer.Flush();
+
+            std::ifstream instream(path, std::ios::in | std::ios::binary);
+            std::string written((std::istreambuf_iterator<char>(instream)), std::istreambuf_iterator<char>());
+            instream.seekg(0, std::ios::beg);
+            std::unique_ptr<Bitmap> read(Bitmap::Read(instream));
+            std::unique_ptr<Bitmap> mapped(BmpReader::FromMemory(streamed.str()));
+            std::size_t expected_size = sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader) +
+                                        (formats[f] == PixelFormat::Gray ? Bitmap::kPaletteSize : 0) +
+                                        height * Bitmap::PaddedRowSize(width, formats[f]);
+            BitmapFileHeader file_header;
+            std::memcpy(&file_header, written.data(), std::min(written.size(), sizeof(file_header)));
+
+            std::string failure;
+            if (written.size() != expected_size || file_header.bfSize != expected_size) {
+                failure = "Bitmap::Write wrote " + std::to_string(written.size()) + " bytes, headers give " +
+                          std::to_string(file_header.bfSize) + ", expected " + std::to_string(expected_size);
+            } else if (streamed.str() != written) {
+                failure = "BmpRowWriter and Bitmap::Write differ";
+            } else if (!read || !SamePixels(*source, *read)) {
+                failure = "Bitmap::Read does not read back the pixels";
+            } else if (!mapped || !SamePixels(*source, *mapped)) {
+                failure = "BmpReader does not read back the pixels";
+            }
+            if (!failure.empty()) {
+                std::cerr << "FAIL round trip " << width << 'x' << height << ' ' << format_names[f] << ": "
+                          << failure << std::endl;
+                ++failures;
+            }
+        }
+    }
+    std::filesystem::remove(path);
+    return failures;
+}
+
+// Runs every row kernel of the SSE2 and AVX2 levels on the same random rows as the scalar one, at
+// every width up to 70 and a few longer ones, so that each vector loop and its tail are covered,
+// and in place where the kernel allows it. Outputs must match byte for byte. A level the CPU
+// lacks falls back to a lower one and is reported as skipped. Returns the number of failures.
+int CheckKernels() {
+    std::uint32_t state = 54321;
+    auto next = [&state] {
+        state = state * 1664525u + 1013904223u;
+        return state >> 8;
+    };
+    auto random_row = [&](std::int32_t width) {
+        std::vector<Color> row(width);
+        for (Color &pixel : row) {
+            pixel = {static_cast<std::uint8_t>(next()), static_cast<std::uint8_t>(next()),
+                     static_cast<std::uint8_t>(next())};
+        }
+        return row;
+    };
+    auto same = [](const std::vector<Color> &a, const std::vector<Color> &b) {
+        return std::memcmp(a.data(), b.data(), a.size() * sizeof(Color)) == 0;
+    };
+
+    std::vector<float> binomial;
+    for (float y : {1.0f, 4.0f, 6.0f, 4.0f, 1.0f}) {
+        for (float x : {1.0f, 4.0f, 6.0f, 4.0f, 1.0f}) {
+            binomial.push_back(x * y / 256.0f);
+        }
+    }
+    std::vector<float> fractions(49, 1.0f / 49.0f);
+    fractions[24] = 2.0f;
+    std::vector<std::pair<std::string, convolution::Kernel>> convolutions;
+    convolutions.emplace_back("sharp", convolution::Kernel({0, -1, 0, -1, 5, -1, 0, -1, 0}, convolution::Border::Clamp));
+    convolutions.emplace_back("edge", convolution::Kernel({0, -1, 0, -1, 4, -1, 0, -1, 0}, convolution::Border::Clamp, 30));
+    convolutions.emplace_back("binomial", convolution::Kernel(binomial, convolution::Border::Mirror));
+    convolutions.emplace_back("float 7x7", convolution::Kernel(fractions, convolution::Border::Wrap));
+
+    std::vector<std::int32_t> widths;
+    for (std::int32_t width = 1; width <= 70; ++width) {
+        widths.push_back(width);
+    }
+    for (std::int32_t width : {127, 128, 129, 1000, 1003}) {
+        widths.push_back(width);
+    }
+    const Kernels &scalar = GetKernels(KernelLevel::Scalar);
+    int failures = 0;
+    for (KernelLevel level : {KernelLevel::SSE2, KernelLevel::AVX2}) {
+        const Kernels &vector = GetKernels(level);
+        if (&vector == &scalar || (level == KernelLevel::AVX2 && &vector == &GetKernels(KernelLevel::SSE2))) {
+            std::cerr << "kernels: level " << (level == KernelLevel::SSE2 ? "sse2" : "avx2")
+                      << " not supported here, skipped" << std::endl;
+            continue;
+        }
+        auto fail = [&](const char *kernel, std::int32_t width) {
+            std::cerr << "FAIL kernel " << kernel << ' ' << vector.name << " width " << width
+                      << " differs from scalar" << std::endl;
+            ++failures;
+        };
+        for (std::int32_t width : widths) {
+            std::vector<Color> src = random_row(width);
+            std::vector<Color> expected(width);
+            std::vector<Color> actual(width);
+
+            scalar.grayscale(src.data(), expected.data(), width);
+            vector.grayscale(src.data(), actual.data(), width);
+            std::vector<Color> in_place = src;
+            vector.grayscale(in_place.data(), in_place.data(), width);
+            if (!same(expected, actual) || !same(expected, in_place)) {
+                fail("grayscale", width);
+            }
+
+            scalar.negative(src.data(), expected.data(), width);
+            vector.negative(src.data(), actual.data(), width);
+            in_place = src;
+            vector.negative(in_place.data(), in_place.data(), width);
+            if (!same(expected, actual) || !same(expected, in_place)) {
+                fail("negative", width);
+            }
+
+            std::vector<std::uint8_t> tables(768);
+            for (std::uint8_t &entry : tables) {
+                entry = static_cast<std::uint8_t>(next());
+            }
+            scalar.lookup(src.data(), expected.data(), width, tables.data());
+            vector.lookup(src.data(), actual.data(), width, tables.data());
+            in_place = src;
+            vector.lookup(in_place.data(), in_place.data(), width, tables.data());
+            if (!same(expected, actual) || !same(expected, in_place)) {
+                fail("lookup", width);
+            }
+
+            for (const auto &[name, kernel] : convolutions) {
+                convolution::Taps taps = kernel.GetTaps();
+                std::vector<std::vector<Color>> input;
+                std::vector<const Color *> rows;
+                for (std::int32_t k = 0; k < taps.size; ++k) {
+                    input.push_back(random_row(width));
+                    rows.push_back(input.back().data());
+                }
+                std::vector<float> sums(6 * static_cast<std::size_t>(width));
+                scalar.convolve(rows.data(), taps, expected.data(), width, sums.data());
+                vector.convolve(rows.data(), taps, actual.data(), width, sums.data());
+                if (!same(expected, actual)) {
+                    fail(("convolve " + name).c_str(), width);
+                }
+            }
+
+            std::vector<Color> top = random_row(2 * width);
+            std::vector<Color> bottom = random_row(2 * width);
+            for (std::int32_t rounding = 0; rounding < 4; ++rounding) {
+                scalar.downsample(top.data(), bottom.data(), expected.data(), width, rounding);
+                vector.downsample(top.data(), bottom.data(), actual.data(), width, rounding);
+                if (!same(expected, actual)) {
+                    fail("downsample", width);
+                }
+            }
+
+            // A few seeds in turn against the same row, so that both smaller and larger distances,
+            // and ties, occur.
+            std::vector<std::int32_t> expected_distance(width, 1 << 20);
+            std::vector<std::uint32_t> expected_nearest(width, 0);
+            std::vector<std::int32_t> actual_distance = expected_distance;
+            std::vector<std::uint32_t> actual_nearest = expected_nearest;
+            std::int32_t left = static_cast<std::int32_t>(next() % 64);
+            for (std::uint32_t seed = 1; seed <= 8; ++seed) {
+                std::int32_t dy = static_cast<std::int32_t>(next() % 8);
+                auto column = static_cast<std::int32_t>(next() % (width + 2 * 64));
+                scalar.nearest(dy * dy, column, left, width, seed, expected_distance.data(), expected_nearest.data());
+                vector.nearest(dy * dy, column, left, width, seed, actual_distance.data(), actual_nearest.data());
+            }
+            if (expected_distance != actual_distance || expected_nearest != actual_nearest) {
+                fail("nearest", width);
+            }
+        }
+    }
+    return failures;
+}
+
+// Nearest of points[first, size) to pixel (i, j) by a scan over all of them: the lowest index among
+// equally near ones, and 0 if there are none.
+std::uint32_t NearestSeed(const std::vector<voronoi::Point> &points, std::uint32_t first, std::int32_t i,
+                          std::int32_t j) {
+    std::int64_t best = std::numeric_limits<std::int64_t>::max();
+    std::uint32_t nearest = 0;
+    for (std::uint32_t k = first; k < points.size(); ++k) {
+        std::int64_t dy = i - points[k].first;
+        std::int64_t dx = j - points[k].second;
+        if (dy * dy + dx * dx < best) {
+            best = dy * dy + dx * dx;
+            nearest = k;
+        }
+    }
+    return nearest;
+}
+
+// Compares the nearest seed the grid finds with NearestSeed, first for SeedGrid itself on point
+// sets full of ties and duplicates, then for the whole VoronoiBlur in Seed mode, whose search leaves
+// seed 0 out. Its images run from one pixel to 640x480, one pixel wide and high among them, with
+// more seeds than pixels too; every pixel of the source has a colour of its own, so that the result
+// tells which seed coloured it. Returns the number of failures.
+int CheckVoronoi() {
+    int failures = 0;
+    auto fail = [&failures](const std::string &what, std::int32_t width, std::int32_t height, std::size_t count) {
+        std::cerr << "FAIL voronoi " << what << ' ' << width << 'x' << height << " with " << count
+                  << " seeds differs from a scan over all seeds" << std::endl;
+        ++failures;
+    };
+
+    // A lattice of step 2 puts many pixels at the same distance from several seeds, and every
+    // seed appears twice.
+    for (auto [width, height] : {std::pair{1, 1}, {1, 40}, {40, 1}, {33, 17}, {100, 75}}) {
+        std::vector<voronoi::Point> points;
+        for (std::int32_t pass = 0; pass < 2; ++pass) {
+            for (std::int32_t i = 0; i < height; i += 2) {
+                for (std::int32_t j = 0; j < width; j += 2) {
+                    points.emplace_back(i, j);
+                }
+            }
+        }
+        for (std::uint32_t first : {0u, 1u}) {
+            voronoi::SeedGrid grid(points, first, height, width);
+            std::int32_t cell_size = grid.GetCellSize();
+            std::vector<std::uint32_t> candidates;
+            bool same = true;
+            for (std::int32_t row = 0; row < grid.GetRows(); ++row) {
+                for (std::int32_t column = 0; column < grid.GetColumns(); ++column) {
+                    grid.Candidates(row, column, candidates);
+                    for (std::int32_t i = row * cell_size; i < std::min(height, (row + 1) * cell_size); ++i) {
+                        std::int32_t right = std::min(width, (column + 1) * cell_size);
+                        for (std::int32_t j = column * cell_size; j < right; ++j) {
+                            // The candidates in index order with a strict comparison, as VoronoiBlur scans them.
+                            std::int64_t best = std::numeric_limits<std::int64_t>::max();
+                            std::uint32_t nearest = 0;
+                            for (std::uint32_t c : candidates) {
+                                std::int64_t dy = i - points[c].first;
+                                std::int64_t dx = j - points[c].second;
+                                if (dy * dy + dx * dx < best) {
+                                    best = dy * dy + dx * dx;
+                                    nearest = c;
+                                }
+                            }
+                            same = same && nearest == NearestSeed(points, first, i, j);
+                        }
+                    }
+                }
+            }
+            if (!same) {
+                fail(first == 0 ? "grid" : "grid without seed 0", width, height, points.size());
+            }
+        }
+    }
+
+    ThreadPool pool(4);
+    const std::pair<std::int32_t, std::int32_t> sizes[] = {{1, 1},  {1, 7},   {7, 1},   {1, 300},  {300, 1},
+                                                           {5, 3},  {37, 23}, {64, 48}, {129, 67}, {640, 480}};
+    for (auto [width, height] : sizes) {
+        Bitmap source = MakeImage(width, height);
+        for (std::int32_t i = 0; i < height; ++i) {
+            for (std::int32_t j = 0; j < width; ++j) {
+                std::uint32_t index = static_cast<std::uint32_t>(i) * width + j;
+                source.GetRow(i)[j] = {static_cast<std::uint8_t>(index), static_cast<std::uint8_t>(index >> 8),
+                                       static_cast<std::uint8_t>(index >> 16)};
+            }
+        }
+        std::uint32_t pixels = static_cast<std::uint32_t>(width) * height;
+        for (std::uint32_t count : {1u, 2u, 3u, 10u, 100u, 5000u, pixels, pixels + 1, 4 * pixels}) {
+            // A scan over all seeds costs count times the pixels.
+            if (static_cast<std::uint64_t>(count) * pixels > 400'000'000) {
+                continue;
+            }
+            for (std::uint32_t seed : {1u, 2u}) {
+                VoronoiBlur blur(count, seed);
+                std::unique_ptr<Bitmap> result(blur.Apply(&source, &pool));
+                std::vector<voronoi::Point> points = voronoi::DrawPoints(count, seed, height, width);
+                bool same = true;
+                for (std::int32_t i = 0; i < height && same; ++i) {
+                    for (std::int32_t j = 0; j < width; ++j) {
+                        voronoi::Point point = points[NearestSeed(points, 1, i, j)];
+                        const Color &expected = source.GetRow(point.first)[point.second];
+                        const Color &actual = result->GetRow(i)[j];
+                        if (std::memcmp(&expected, &actual, sizeof(Color)) != 0) {
+                            same = false;
+                            break;
+                        }
+                    }
+                }
+                if (!same) {
+                    fail("seed " + std::to_string(seed), width, height, count);
+                }
+            }
+        }
+    }
+    return failures;
+}
+
+// Runs chains that share a prefix with the rest after it fused differently, one after another on
+// one cache: the later chain must load the result of the prefix the earlier one stored, even when
+// it ends inside a fused segment, and give the same image as without the cache. Returns the number
+// of failures.
+int CheckCache(const std::string &directory) {
+    std::filesystem::path path = std::filesystem::path(directory) / "finale_bench_cache";
+    std::filesystem::remove_all(path);
+    Bitmap source = MakeImage(301, 203);
+    ThreadPool pool(4);
+    Crop crop(300, 200);
+    GaussianBlur blur(2);
+    Grayscale grayscale;
+    Sharpening sharpening;
+    Negative negative;
+    EdgeDetection edge(30);
+    const std::vector<std::pair<std::vector<Filter *>, std::vector<Filter *>>> chains = {
+            {{&crop, &blur, &grayscale, &sharpening}, {&crop, &blur, &negative}},
+            {{&grayscale}, {&grayscale, &edge, &negative}},
+            {{&negative, &blur, &crop}, {&negative, &blur, &crop, &sharpening}},
+    };
+    int failures = 0;
+    for (const auto &[earlier, later] : chains) {
+        ResultCache cache(path.string());
+        for (const std::vector<Filter *> *filters : {&earlier, &later}) {
+            std::unique_ptr<Bitmap> copy(source.Convert(PixelFormat::Bgr));
+            std::unique_ptr<Bitmap> expected(Pipeline(*filters, &pool).Apply(&source));
+            Bitmap *result = Pipeline(*filters, &pool, &cache).ApplyInPlace(copy.get());
+            std::unique_ptr<Bitmap> owned(result != copy.get() ? result : nullptr);
+            std::unique_ptr<Bitmap> bgr(result->Convert(PixelFormat::Bgr));
+            std::string chain;
+            for (const Filter *filter : *filters) {
+                chain += std::string(chain.empty() ? "" : " ") + filter->GetName();
+            }
+            if (!SamePixels(*expected, *bgr)) {
+                std::cerr << "FAIL cache " << chain << " differs from the chain without a cache" << std::endl;
+                ++failures;
+            }
+            if (filters == &later && cache.GetHits() != 1) {
+                std::cerr << "FAIL cache " << chain << " does not load the prefix stored before it" << std::endl;
+                ++failures;
+            }
+        }
+        std::filesystem::remove_all(path);
+    }
+    return failures;
+}
+
+// Runs ImageProcessor::Apply on views into buffers of its own, with rows longer than the pixels,
+// from a Bgr input into Gray and Bgrx outputs, twice each so that the second run reuses the
+// stages of the first. The output must match Pipeline::Apply on the same chain converted to the
+// output format, and the bytes past the end of every row must stay untouched.
+int CheckImageProcessor() {
+    constexpr std::int32_t kWidth = 301;
+    constexpr std::int32_t kHeight = 203;
+    constexpr std::size_t kSlack = 13;
+    constexpr std::uint8_t kUntouched = 0xA5;
+    Bitmap source = MakeImage(kWidth, kHeight);
+    std::size_t input_stride = kWidth * Bitmap::PixelSize(PixelFormat::Bgr) + kSlack;
+    std::vector<std::uint8_t> input(kHeight * input_stride);
+    for (std::int32_t i = 0; i < kHeight; ++i) {
+        std::memcpy(input.data() + i * input_stride, source.GetRow(i), kWidth * sizeof(Color));
+    }
+    ConstImageView input_view(input.data(), kWidth, kHeight, input_stride, PixelFormat::Bgr);
+
+    // Fused segments ending in grey and in colour, a filter of the whole image before one, and a
+    // run of point filters.
+    using Chain = std::vector<std::unique_ptr<Filter>>;
+    std::vector<std::pair<std::string, std::function<Chain()>>> chains;
+    chains.emplace_back("crop grayscale sharpening", [] {
+        Chain chain;
+        chain.push_back(std::make_unique<Crop>(250, 180));
+        chain.push_back(std::make_unique<Grayscale>());
+        chain.push_back(std::make_unique<Sharpening>());
+        return chain;
+    });
+    chains.emplace_back("negative blur edge", [] {
+        Chain chain;
+        chain.push_back(std::make_unique<Negative>());
+        chain.push_back(std::make_unique<GaussianBlur>(2));
+        chain.push_back(std::make_unique<EdgeDetection>(30));
+        return chain;
+    });
+    chains.emplace_back("sharpening crop negative", [] {
+        Chain chain;
+        chain.push_back(std::make_unique<Sharpening>());
+        chain.push_back(std::make_unique<Crop>(100, 90));
+        chain.push_back(std::make_unique<Negative>());
+        return chain;
+    });
+
+    int failures = 0;
+    for (const auto &[name, make] : chains) {
+        for (std::size_t thread_count : {1u, 4u}) {
+            Chain filters = make();
+            std::vector<Filter *> raw;
+            for (const std::unique_ptr<Filter> &filter : filters) {
+                raw.push_back(filter.get());
+            }
+            std::unique_ptr<Bitmap> expected(Pipeline(raw).Apply(&source));
+            ImageProcessor processor(std::move(filters), thread_count);
+            ImageSize size = processor.GetOutputSize(kWidth, kHeight);
+            for (PixelFormat format : {PixelFormat::Gray, PixelFormat::Bgrx}) {
+                std::unique_ptr<Bitmap> converted(expected->Convert(format));
+                std::size_t row_size = size.width * Bitmap::PixelSize(format);
+                std::size_t stride = row_size + kSlack;
+                std::vector<std::uint8_t> output(size.height * stride);
+                ImageView output_view = {output.data(), size.width, size.height, stride, format};
+                for (int run = 1; run <= 2; ++run) {
+                    std::fill(output.begin(), output.end(), kUntouched);
+                    processor.Apply(input_view, output_view);
+                    std::string what = "image processor " + name + " on " + std::to_string(thread_count) +
+                                       " threads into " + (format == PixelFormat::Gray ? "gray" : "bgrx") +
+                                       ", run " + std::to_string(run);
+                    if (!SamePixels(*converted, *WrapView(output_view))) {
+                        std::cerr << "FAIL " << what << " differs from Pipeline::Apply" << std::endl;
+                        ++failures;
+                    }
+                    for (std::int32_t i = 0; i < size.height; ++i) {
+                        const std::uint8_t *slack = output.data() + i * stride + row_size;
+                        if (std::any_of(slack, slack + kSlack, [](std::uint8_t byte) { return byte != kUntouched; })) {
+                            std::cerr << "FAIL " << what << " writes past the end of row " << i << std::endl;
+                            ++failures;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return failures;
+}
+
+std::string Key(const std::string &name, std::int32_t width, std::int32_t height) {
+    return name + '\t' + std::to_string(width) + 'x' + std::to_string(height);
+}
+
+// One case per line: name, size, hash and budget in MP/s, separated by tabs. Lines starting with
+// '#' are comments.
+std::map<std::string, Golden> ReadGolden(const std::string &path) {
+    std::ifstream instream(path);
+    if (!instream) {
+        throw std::runtime_error("cannot read " + path);
+    }
+    std::map<std::string, Golden> golden;
+    std::string line;
+    while (std::getline(instream, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::stringstream fields(line);
+        std::string name;
+        std::string size;
+        std::string hash;
+        std::string budget;
+        if (!std::getline(fields, name, '\t') || !std::getline(fields, size, '\t') ||
+            !std::getline(fields, hash, '\t') || !std::getline(fields, budget)) {
+            throw std::runtime_error("malformed line in " + path + ": " + line);
+        }
+        golden[name + '\t' + size] = {hash, std::stod(budget)};
+    }
+    return golden;
+}
+
+double Time(int repeat, const std::function<void()> &run) {
+    double best = 0;
+    for (int k = 0; k < repeat; ++k) {
+        auto start = std::chrono::steady_clock::now();
+        run();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        best = k == 0 ? seconds : std::min(best, seconds);
+    }
+    return best;
+}
+
+class Bench {
+public:
+    explicit Bench(const Options &options)
+            : options_(options), pool_(options.thread_count), hashing_(!options.check.empty() || !options.update.empty()) {
+    }
+
+    void RunSize(std::int32_t width, std::int32_t height) {
+        Bitmap source = MakeImage(width, height);
+        std::string path = (std::filesystem::path(options_.directory) / "finale_bench.bmp").string();
+        {
+            std::ofstream outstream(path, std::ios::out | std::ios::binary);
+            source.Write(outstream);
+        }
+
+        Run("write/Bitmap::Write", width, height, [&] {
+            std::ofstream outstream(path, std::ios::out | std::ios::binary);
+            source.Write(outstream);
+        });
+        Run("write/BmpRowWriter", width, height, [&] {
+            std::ofstream outstream(path, std::ios::out | std::ios::binary);
+            BmpRowWriter writer(outstream, source.GetFileHeader(), source.GetInfoHeader());
+            writer.WriteRows(&source);
+            writer.Flush();
+        });
+        Run("read/Bitmap::Read", width, height, [&] {
+            std::ifstream instream(path, std::ios::in | std::ios::binary);
+            std::unique_ptr<Bitmap> bitmap(Bitmap::Read(instream));
+        });
+        Run("read/BmpReader", width, height, [&] {
+            // The file is mapped lazily, so every page is touched to pay for the actual read.
+            std::unique_ptr<Bitmap> bitmap(BmpReader::Read(path.c_str()));
+            std::size_t size = static_cast<std::size_t>(height) * bitmap->GetRowStride();
+            volatile std::uint8_t sink = 0;
+            for (std::size_t k = 0; k < size; k += 4096) {
+                sink = sink + bitmap->GetPixels()[k];
+            }
+        });
+        std::filesystem::remove(path);
+
+        std::vector<std::pair<std::string, std::unique_ptr<Filter>>> filters;
+        filters.emplace_back("crop", std::make_unique<Crop>(width / 2, height / 2));
+        filters.emplace_back("gs", std::make_unique<Grayscale>());
+        filters.emplace_back("neg", std::make_unique<Negative>());
+        filters.emplace_back("bc", std::make_unique<BrightnessContrast>(10, 1.2));
+        filters.emplace_back("gamma", std::make_unique<Gamma>(2.2));
+        filters.emplace_back("levels", std::make_unique<Levels>(16, 235, 0.9));
+        filters.emplace_back("threshold", std::make_unique<Threshold>(128));
+        filters.emplace_back("posterize", std::make_unique<Posterize>(4));
+        filters.emplace_back("sharp", std::make_unique<Sharpening>());
+        filters.emplace_back("edge 30", std::make_unique<EdgeDetection>(30));
+        filters.emplace_back("edge 30 adaptive 8", std::make_unique<EdgeDetection>(30, 8));
+        // Integral tables: the radius should not change the cost.
+        filters.emplace_back("box 2", std::make_unique<BoxBlur>(2));
+        filters.emplace_back("box 64", std::make_unique<BoxBlur>(64));
+        filters.emplace_back("mean 16", std::make_unique<LocalNormalization>(16));
+        // A binomial 5x5, which factors into two passes, and 7x7 kernels that do not.
+        std::vector<float> binomial;
+        for (float y : {1.0f, 4.0f, 6.0f, 4.0f, 1.0f}) {
+            for (float x : {1.0f, 4.0f, 6.0f, 4.0f, 1.0f}) {
+                binomial.push_back(x * y / 256.0f);
+            }
+        }
+        std::vector<float> ring(49, 0.0f);
+        for (int32_t k = 0; k < 7; ++k) {
+            ring[k] = ring[42 + k] = ring[7 * k] = ring[7 * k + 6] = -1.0f;
+        }
+        ring[24] = 25.0f;
+        std::vector<float> fractions(49, 1.0f / 49.0f);
+        fractions[24] = 2.0f;
+        filters.emplace_back("conv 5x5", std::make_unique<Convolution>(
+                                                 convolution::Kernel(binomial, convolution::Border::Clamp)));
+        filters.emplace_back("conv 7x7", std::make_unique<Convolution>(
+                                                 convolution::Kernel(ring, convolution::Border::Clamp)));
+        filters.emplace_back("conv 7x7 float", std::make_unique<Convolution>(
+                                                       convolution::Kernel(fractions, convolution::Border::Clamp)));
+        filters.emplace_back("conv 7x7 mirror", std::make_unique<Convolution>(
+                                                        convolution::Kernel(ring, convolution::Border::Mirror)));
+        filters.emplace_back("conv 7x7 wrap", std::make_unique<Convolution>(
+                                                      convolution::Kernel(ring, convolution::Border::Wrap)));
+        for (double sigma : {1.0, 3.0, 10.0}) {
+            std::ostringstream name;
+            name << "blur " << sigma;
+            filters.emplace_back(name.str(), std::make_unique<GaussianBlur>(sigma));
+            filters.emplace_back(name.str() + " fast",
+                                 std::make_unique<GaussianBlur>(sigma, GaussianBlur::Mode::Fast));
+        }
+        for (double sigma : {10.0, 40.0}) {
+            std::ostringstream name;
+            name << "blur " << sigma;
+            filters.emplace_back(name.str() + " box", std::make_unique<GaussianBlur>(sigma, GaussianBlur::Mode::Box));
+            filters.emplace_back(name.str() + " pyramid",
+                                 std::make_unique<GaussianBlur>(sigma, GaussianBlur::Mode::Pyramid));
+        }
+        for (std::uint32_t clusters : {100u, 1000u, 10000u}) {
+            filters.emplace_back("voronoi " + std::to_string(clusters), std::make_unique<VoronoiBlur>(clusters, 1));
+        }
+        for (std::uint32_t iterations : {0u, 5u}) {
+            filters.emplace_back("voronoi 1000 mean " + std::to_string(iterations),
+                                 std::make_unique<VoronoiBlur>(1000, 1, VoronoiBlur::Mode::Mean, iterations));
+        }
+        for (auto &[name, filter] : filters) {
+            RunImage(name, width, height, [&] { return filter->Apply(&source, &pool_); });
+        }
+        RunImage("downsample", width, height, [&] { return Pyramid::Downsample(&source, &pool_); });
+
+        // The same chain copying every stage and running in place on a scratch copy of the source.
+        Crop crop(width * 3 / 4, height * 3 / 4);
+        Grayscale grayscale;
+        Sharpening sharpening;
+        Negative negative;
+        GaussianBlur blur(2, GaussianBlur::Mode::Fast);
+        EdgeDetection edge(30);
+        Pipeline chain({&crop, &grayscale, &sharpening, &negative, &blur, &edge}, &pool_);
+        RunImage("chain copy", width, height, [&] { return chain.Apply(&source); });
+        Bitmap scratch(source.GetFileHeader(), source.GetInfoHeader());
+        std::memcpy(scratch.GetPixels(), source.GetPixels(), height * source.GetRowStride());
+        // The result may be Gray; it is hashed as Bgr, so that it matches the copying chain.
+        BufferPool buffers;
+        auto in_place = [&] {
+            Bitmap *result = chain.ApplyInPlace(&scratch);
+            return std::unique_ptr<Bitmap>(result != &scratch ? result : nullptr);
+        };
+        if (Run("chain in place", width, height, [&] { in_place(); }, &buffers) && hashing_) {
+            BufferPool::Scope scope(&buffers);
+            std::unique_ptr<Bitmap> result = in_place();
+            std::unique_ptr<Bitmap> bgr((result != nullptr ? result.get() : &scratch)->Convert(PixelFormat::Bgr));
+            measurements_.back().hash = Hash(*bgr);
+        }
+
+        // A run of point filters compiles into one set of tables, so it should cost about as much as
+        // a single one of them.
+        BrightnessContrast contrast(10, 1.2);
+        Gamma gamma(2.2);
+        Posterize posterize(8);
+        Pipeline points({&contrast, &gamma, &grayscale, &negative, &posterize}, &pool_);
+        RunImage("point chain", width, height, [&] { return points.Apply(&source); });
+
+        // Chains known at compile time: the virtual stages of Pipeline against a StaticPipeline,
+        // which calls the same row kernels from stages composed as types.
+        Pipeline sharpen_chain({&crop, &grayscale, &sharpening}, &pool_);
+        StaticPipeline static_sharpen_chain(crop, grayscale, sharpening);
+        RunImage("crop gs sharp", width, height, [&] { return sharpen_chain.Apply(&source); });
+        RunImage("crop gs sharp static", width, height, [&] { return static_sharpen_chain.Apply(&source, &pool_); });
+        Pipeline edge_chain({&negative, &edge, &negative}, &pool_);
+        StaticPipeline static_edge_chain(negative, edge, negative);
+        RunImage("neg edge neg", width, height, [&] { return edge_chain.Apply(&source); });
+        RunImage("neg edge neg static", width, height, [&] { return static_edge_chain.Apply(&source, &pool_); });
+        StaticPipeline static_points(contrast, gamma, grayscale, negative, posterize);
+        RunImage("point chain static", width, height, [&] { return static_points.Apply(&source, &pool_); });
+    }
+
+    void WriteJson(std::ostream &out) const {
+        out << "{\n  \"kernels\": \"" << GetKernels().name << "\",\n  \"threads\": " << pool_.GetThreadCount()
+            << ",\n  \"repeat\": " << options_.repeat << ",\n  \"results\": [";
+        for (std::size_t k = 0; k < measurements_.size(); ++k) {
+            const Measurement &m = measurements_[k];
+            double pixels = static_cast<double>(m.width) * m.height;
+            out << (k == 0 ? "\n" : ",\n") << "    {\"case\": \"" << m.name << "\", \"width\": " << m.width
+                << ", \"height\": " << m.height << ", \"padded\": " << (m.width % 4 != 0 ? "true" : "false")
+                << std::setprecision(6) << ", \"seconds\": " << m.seconds
+                << ", \"mp_per_s\": " << pixels / 1e6 / m.seconds << ", \"ns_per_pixel\": " << m.seconds * 1e9 / pixels
+                << ", \"peak_rss_mb\": " << m.peak_rss_mb << ", \"allocations\": " << m.allocations
+                << ", \"buffers\": " << m.buffers;
+            if (!m.hash.empty()) {
+                out << ", \"hash\": \"" << m.hash << '"';
+            }
+            out << "}";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+    // Compares the measurements with the golden file and reports every failure; returns their number.
+    int Check(const std::map<std::string, Golden> &golden) const {
+        int failures = 0;
+        for (const Measurement &m : measurements_) {
+            std::string key = Key(m.name, m.width, m.height);
+            auto it = golden.find(key);
+            double mp_per_s = static_cast<double>(m.width) * m.height / 1e6 / m.seconds;
+            std::string failure;
+            if (it == golden.end()) {
+                failure = "no golden entry";
+            } else if (it->second.hash != (m.hash.empty() ? "-" : m.hash)) {
+                failure = "hash " + (m.hash.empty() ? "-" : m.hash) + ", expected " + it->second.hash;
+            } else if (m.steady && (m.buffers != 0 || m.allocations > kMaxSteadyAllocations)) {
+                failure = std::to_string(m.buffers) + " buffers and " + std::to_string(m.allocations) +
+                          " allocations once warmed up, expected none and at most " +
+                          std::to_string(kMaxSteadyAllocations);
+            } else if (mp_per_s < it->second.budget * options_.budget_scale) {
+                std::ostringstream message;
+                message << std::setprecision(3) << mp_per_s << " MP/s, budget "
+                        << it->second.budget * options_.budget_scale;
+                failure = message.str();
+            }
+            if (!failure.empty()) {
+                std::cerr << "FAIL " << m.name << ' ' << m.width << 'x' << m.height << ": " << failure << std::endl;
+                ++failures;
+            }
+        }
+        return failures;
+    }
+
+    // Budgets already in `golden` that are lower than the new ones are kept.
+    void WriteGolden(std::ostream &out, const std::map<std::string, Golden> &golden) const {
+        out << "# Written by finale_bench --update: case, size, hash of the result (- for none) and\n"
+            << "# throughput budget in MP/s, measured with the " << GetKernels().name << " kernels on "
+            << pool_.GetThreadCount() << " thread(s).\n";
+        for (const Measurement &m : measurements_) {
+            std::string key = Key(m.name, m.width, m.height);
+            double budget = static_cast<double>(m.width) * m.height / 1e6 / m.seconds * kBudgetFraction;
+            if (auto it = golden.find(key); it != golden.end()) {
+                budget = std::min(budget, it->second.budget);
+            }
+            out << key << '\t' << (m.hash.empty() ? "-" : m.hash) << '\t' << std::fixed << std::setprecision(1)
+                << budget << std::defaultfloat << '\n';
+        }
+    }
+
+private:
+    // Also hashes the image in regression mode, from one more run.
+    void RunImage(const std::string &name, std::int32_t width, std::int32_t height,
+                  const std::function<Bitmap *()> &produce) {
+        if (Run(name, width, height, [&] { std::unique_ptr<Bitmap> result(produce()); }) && hashing_) {
+            std::unique_ptr<Bitmap> result(produce());
+            measurements_.back().hash = Hash(*result);
+        }
+    }
+
+    // Returns whether the case was run, that is not left out by --case. With `steady_buffers` every
+    // run takes its image buffers from that pool and the case must run in the steady state, see
+    // Measurement::steady.
+    bool Run(const std::string &name, std::int32_t width, std::int32_t height, const std::function<void()> &run,
+             BufferPool *steady_buffers = nullptr) {
+        if (name.find(options_.filter) == std::string::npos) {
+            return false;
+        }
+        ResetPeakRss();
+        double seconds;
+        {
+            BufferPool::Scope scope(steady_buffers);
+            seconds = Time(options_.repeat, run);
+        }
+        double peak_rss_mb = PeakRssMb();
+
+        // One more run that counts. A pool that keeps nothing idle sees every image buffer, a
+        // steady one only those it has to allocate.
+        BufferPool every_buffer(0);
+        BufferPool *buffers = steady_buffers != nullptr ? steady_buffers : &every_buffer;
+        std::size_t buffers_start = buffers->GetAllocated();
+        std::uint64_t allocations_start;
+        {
+            BufferPool::Scope scope(buffers);
+            allocations_start = heap_allocations.load();
+            run();
+        }
+        std::uint64_t allocations = heap_allocations.load() - allocations_start;
+        std::size_t allocated_buffers = buffers->GetAllocated() - buffers_start;
+        measurements_.push_back({name, width, height, seconds, peak_rss_mb, allocations, allocated_buffers,
+                                 steady_buffers != nullptr, ""});
+        double pixels = static_cast<double>(width) * height;
+        std::cerr << std::left << std::setw(24) << name << std::right << std::setw(6) << width << 'x' << std::left
+                  << std::setw(6) << height << std::right << std::fixed << std::setprecision(1) << std::setw(10)
+                  << pixels / 1e6 / seconds << " MP/s" << std::setprecision(2) << std::setw(10)
+                  << seconds * 1e9 / pixels << " ns/px" << std::setprecision(0) << std::setw(8) << peak_rss_mb
+                  << " MB" << std::setw(8) << allocations << " allocs" << std::setw(4) << allocated_buffers
+                  << " buffers" << std::defaultfloat << std::endl;
+        return true;
+    }
+
+    Options options_;
+    ThreadPool pool_;
+    bool hashing_;
+    std::vector<Measurement> measurements_;
+};
+
+Options Parse(int argc, char **argv) {
+    Options options;
+    for (int k = 1; k < argc; ++k) {
+        if (k + 1 >= argc) {
+            throw std::runtime_error(std::string("missing value for ") + argv[k]);
+        }
+        if (strcmp("--sizes", argv[k]) == 0) {
+            options.sizes.clear();
+            std::stringstream list(argv[++k]);
+            std::string size;
+            while (std::getline(list, size, ',')) {
+                options.sizes.push_back(std::stod(size));
+            }
+        } else if (strcmp("--repeat", argv[k]) == 0) {
+            options.repeat = std::max(1, std::stoi(argv[++k]));
+        } else if (strcmp("--threads", argv[k]) == 0) {
+            options.thread_count = std::max(1, std::stoi(argv[++k]));
+        } else if (strcmp("--case", argv[k]) == 0) {
+            options.filter = argv[++k];
+        } else if (strcmp("--json", argv[k]) == 0) {
+            options.json = argv[++k];
+        } else if (strcmp("--dir", argv[k]) == 0) {
+            options.directory = argv[++k];
+        } else if (strcmp("--check", argv[k]) == 0) {
+            options.check = argv[++k];
+        } else if (strcmp("--update", argv[k]) == 0) {
+            options.update = argv[++k];
+        } else if (strcmp("--budget-scale", argv[k]) == 0) {
+            options.budget_scale = std::max(0.0, std::stod(argv[++k]));
+        } else {
+            throw std::runtime_error(std::string("unknown option ") + argv[k]);
+        }
+    }
+    return options;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    try {
+        Options options = Parse(argc, argv);
+        int failures = 0;
+        if (!options.check.empty() || !options.update.empty()) {
+            options.sizes = {kCheckMegapixels};
+            failures += CheckRoundTrips(options.directory);
+            failures += CheckKernels();
+            failures += CheckVoronoi();
+            failures += CheckCache(options.directory);
+            failures += CheckImageProcessor();
+        }
+        // Read before running, so that a missing file does not cost a whole run.
+        std::map<std::string, Golden> golden;
+        if (!options.check.empty()) {
+            golden = ReadGolden(options.check);
+        }
+        Bench bench(options);
+        for (double size : options.sizes) {
+            // 4:3 images; the unpadded width is a multiple of 4, the padded one is not.
+            auto width = static_cast<std::int32_t>(std::lround(std::sqrt(size * 1e6 * 4 / 3) / 4) * 4);
+            auto height = static_cast<std::int32_t>(std::lround(size * 1e6 / width));
+            bench.RunSize(width, height);
+            bench.RunSize(width + 1, height);
+        }
+        if (options.json.empty()) {
+            bench.WriteJson(std::cout);
+        } else {
+            std::ofstream out(options.json);
+            bench.WriteJson(out);
+        }
+        if (!options.check.empty()) {
+            failures += bench.Check(golden);
+        }
+        if (!options.update.empty()) {
+            std::map<std::string, Golden> previous;
+            if (std::filesystem::exists(options.update)) {
+                previous = ReadGolden(options.update);
+            }
+            std::ofstream out(options.update);
+            bench.WriteGolden(out, previous);
+        }
+        if (failures > 0) {
+            std::cerr << failures << " check(s) failed" << std::endl;
+            return 1;
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -1,4 +1,177 @@
 #include "bitmap.h"
+#include "buffer_pool.h"
+#include "kernels.h"
+#include "profile.h"
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+Bitmap::Bitmap(const BitmapFileHeader &file_header, const BitmapInfoHeader &info_header, std::size_t row_stride)
+        : file_header_(file_header), info_header_(info_header) {
+    std::size_t width = static_cast<std::size_t>(info_header_.biWidth);
+    std::size_t height = static_cast<std::size_t>(info_header_.biHeight);
+    row_stride_ = std::max(row_stride, PaddedRowSize(info_header_.biWidth, GetFormat()));
+
+    std::size_t size = (height * row_stride_ + kAlignment - 1) / kAlignment * kAlignment;
+    Profiler::CountAllocation(size);
+    if (BufferPool *pool = BufferPool::Current()) {
+        pixels_ = pool->Acquire(size, kAlignment);
+    } else {
+        auto *pixels = static_cast<std::uint8_t *>(std::aligned_alloc(kAlignment, std::max(size, kAlignment)));
+        if (pixels == nullptr) {
+            throw std::bad_alloc();
+        }
+        pixels_.reset(pixels, std::free);
+    }
+
+    std::size_t row_size = width * PixelSize(GetFormat());
+    if (row_stride_ > row_size) {
+        for (std::size_t i = 0; i < height; ++i) {
+            std::memset(pixels_.get() + i * row_stride_ + row_size, 0, row_stride_ - row_size);
+        }
+    }
+}
+
+Bitmap::Bitmap(const BitmapFileHeader &file_header, const BitmapInfoHeader &info_header,
+               std::shared_ptr<std::uint8_t> pixels, std::size_t row_stride)
+        : file_header_(file_header), info_header_(info_header), row_stride_(row_stride), pixels_(std::move(pixels)) {
+}
+
+std::size_t Bitmap::PaddedRowSize(std::int32_t width, PixelFormat format) {
+    return (static_cast<std::size_t>(width) * PixelSize(format) + 3) / 4 * 4;
+}
+
+std::size_t Bitmap::PixelSize(PixelFormat format) {
+    switch (format) {
+        case PixelFormat::Gray:
+            return 1;
+        case PixelFormat::Bgrx:
+            return 4;
+        default:
+            return sizeof(Color);
+    }
+}
+
+PixelFormat Bitmap::FormatOf(const BitmapInfoHeader &info_header) {
+    switch (info_header.biBitCount) {
+        case 8:
+            return PixelFormat::Gray;
+        case 32:
+            return PixelFormat::Bgrx;
+        default:
+            return PixelFormat::Bgr;
+    }
+}
+
+bool Bitmap::CheckHeaders(const BitmapFileHeader &file_header, const BitmapInfoHeader &info_header,
+                          std::size_t length) {
+    if (length < file_header.bfSize || info_header.biWidth <= 0 || info_header.biHeight <= 0 ||
+        file_header.bfOffBits < sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader)) {
+        return false;
+    }
+    // 8 and 32 bits per pixel only without compression, 8 with a full palette.
+    if (info_header.biBitCount == 8) {
+        std::size_t palette_end = sizeof(BitmapFileHeader) + info_header.biSize + kPaletteSize;
+        if (info_header.biCompression != 0 || (info_header.biClrUsed != 0 && info_header.biClrUsed != 256) ||
+            palette_end > file_header.bfOffBits) {
+            return false;
+        }
+    } else if (info_header.biBitCount == 32) {
+        if (info_header.biCompression != 0) {
+            return false;
+        }
+    } else if (info_header.biBitCount != 24) {
+        return false;
+    }
+    std::size_t pixels_size =
+            static_cast<std::size_t>(info_header.biHeight) * PaddedRowSize(info_header.biWidth, FormatOf(info_header));
+    return file_header.bfOffBits <= length && pixels_size <= length - file_header.bfOffBits;
+}
+
+bool Bitmap::CheckPalette(const std::uint8_t *palette) {
+    for (std::size_t k = 0; k < 256; ++k) {
+        if (palette[4 * k] != k || palette[4 * k + 1] != k || palette[4 * k + 2] != k) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Bitmap::NormalizeHeaders(BitmapFileHeader &file_header, BitmapInfoHeader &info_header) {
+    bool palette = FormatOf(info_header) == PixelFormat::Gray;
+    file_header.bfOffBits = sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader) + (palette ? kPaletteSize : 0);
+    info_header.biSize = sizeof(BitmapInfoHeader);
+    if (palette) {
+        info_header.biClrUsed = 256;
+    }
+}
+
+void Bitmap::SetFormat(BitmapFileHeader &file_header, BitmapInfoHeader &info_header, PixelFormat format) {
+    info_header.biBitCount = static_cast<std::uint16_t>(8 * PixelSize(format));
+    info_header.biCompression = 0;
+    info_header.biClrUsed = format == PixelFormat::Gray ? 256 : 0;
+    info_header.biClrImportant = 0;
+    info_header.biSizeImage = info_header.biHeight * PaddedRowSize(info_header.biWidth, format);
+    NormalizeHeaders(file_header, info_header);
+    file_header.bfSize = file_header.bfOffBits + info_header.biSizeImage;
+}
+
+void Bitmap::ConvertRow(const std::uint8_t *src, PixelFormat from, std::uint8_t *dst, PixelFormat to,
+                        std::int32_t width) {
+    std::size_t src_size = PixelSize(from);
+    std::size_t dst_size = PixelSize(to);
+    if (from == to) {
+        std::memcpy(dst, src, static_cast<std::size_t>(width) * src_size);
+        return;
+    }
+    for (std::int32_t j = 0; j < width; ++j) {
+        const std::uint8_t *in = src + j * src_size;
+        std::uint8_t *out = dst + j * dst_size;
+        if (from == PixelFormat::Gray) {
+            out[0] = out[1] = out[2] = in[0];
+        } else if (to == PixelFormat::Gray) {
+            out[0] = in[0] == in[1] && in[1] == in[2] ? in[0] : kernels::GreyValue({in[0], in[1], in[2]});
+            continue;
+        } else {
+            out[0] = in[0];
+            out[1] = in[1];
+            out[2] = in[2];
+        }
+        if (to == PixelFormat::Bgrx) {
+            out[3] = 0;
+        }
+    }
+}
+
+Bitmap *Bitmap::Convert(PixelFormat format) const {
+    BitmapFileHeader file_header = file_header_;
+    BitmapInfoHeader info_header = info_header_;
+    SetFormat(file_header, info_header, format);
+    auto *result = new Bitmap(file_header, info_header);
+    for (std::int32_t i = 0; i < GetHeight(); ++i) {
+        ConvertRow(reinterpret_cast<const std::uint8_t *>(GetRow(i)), GetFormat(),
+                   reinterpret_cast<std::uint8_t *>(result->GetRow(i)), format, GetWidth());
+    }
+    return result;
+}
+
+void Bitmap::UnpackRow(std::size_t i, Color *dst, std::int32_t width) const {
+    ConvertRow(reinterpret_cast<const std::uint8_t *>(GetRow(i)), GetFormat(),
+               reinterpret_cast<std::uint8_t *>(dst), PixelFormat::Bgr, width);
+}
+
+void Bitmap::PackRow(std::size_t i, const Color *src, std::int32_t width) {
+    ConvertRow(reinterpret_cast<const std::uint8_t *>(src), PixelFormat::Bgr,
+               reinterpret_cast<std::uint8_t *>(GetRow(i)), GetFormat(), width);
+}
+
+void Bitmap::WritePalette(std::ostream &outstream) {
+    char palette[kPaletteSize] = {};
+    for (std::size_t k = 0; k < 256; ++k) {
+        palette[4 * k] = palette[4 * k + 1] = palette[4 * k + 2] = static_cast<char>(k);
+    }
+    outstream.write(palette, kPaletteSize);
+}
 
 Bitmap *Bitmap::Read(std::ifstream &instream) {
     instream.seekg(0, std::ios::end);
@@ -15,50 +188,52 @@ Bitmap *Bitmap::Read(std::ifstream &instream) {
     instream.read(reinterpret_cast<char *>(&file_header), sizeof(BitmapFileHeader));
     instream.read(reinterpret_cast<char *>(&info_header), sizeof(BitmapInfoHeader));
 
-    size_t height = info_header.biHeight;
-    size_t width = info_header.biWidth;
-
-    if (length < file_header.bfSize) {
+    if (!CheckHeaders(file_header, info_header, length)) {
         return nullptr;
     }
+    if (FormatOf(info_header) == PixelFormat::Gray) {
+        std::uint8_t palette[kPaletteSize];
+        instream.seekg(sizeof(BitmapFileHeader) + info_header.biSize, std::ios::beg);
+        instream.read(reinterpret_cast<char *>(palette), kPaletteSize);
+        if (!instream || !CheckPalette(palette)) {
+            return nullptr;
+        }
+    }
 
-    std::vector<std::vector<Color>> data(height, std::vector<Color>(width));
-    auto padding_size = static_cast<std::streamsize>(width * 3 % 4);
+    Bitmap *bitmap = new Bitmap(file_header, info_header);
+    std::size_t height = info_header.biHeight;
+    std::size_t row_size = info_header.biWidth * PixelSize(bitmap->GetFormat());
+    std::size_t row_stride = bitmap->GetRowStride();
 
-    for (size_t i = 0; i < height; ++i) {
-        for (size_t j = 0; j < width; ++j) {
-            instream.read(reinterpret_cast<char *>(&(data[i][j])), sizeof(Color));
-        }
-        if (padding_size) {
-            int32_t padding;
-            instream.read(reinterpret_cast<char *>(&padding), 4 - padding_size);
+    instream.seekg(file_header.bfOffBits, std::ios::beg);
+    instream.read(reinterpret_cast<char *>(bitmap->GetPixels()), static_cast<std::streamsize>(height * row_stride));
+    if (row_stride > row_size) {
+        for (std::size_t i = 0; i < height; ++i) {
+            std::memset(bitmap->GetPixels() + i * row_stride + row_size, 0, row_stride - row_size);
         }
     }
 
-    return new Bitmap(file_header, info_header, data);
+    return bitmap;
 }
 
 void Bitmap::Write(std::ofstream &outstream) const {
-    outstream.write((char *)(&file_header_), sizeof(BitmapFileHeader));
-    outstream.write((char *)(&info_header_), sizeof(BitmapInfoHeader));
-    if ((info_header_.biWidth * sizeof(Color)) % 4 != 0) {
-        std::int32_t x = 0;
-        for (std::size_t i = 0; i < static_cast<size_t>(info_header_.biHeight); i++) {
-            for (std::size_t j = 0; j < static_cast<size_t>(info_header_.biWidth); j++) {
-                outstream.write((char *)(&(data_[i][j])), sizeof(Color));
-            }
-            outstream.write(reinterpret_cast<char *>(&(x)), 4 - (info_header_.biWidth * sizeof(Color)) % 4);
-        }
-        for (std::size_t i = 0; i < static_cast<size_t>(info_header_.biHeight); i++) {
-            for (std::size_t j = 0; j < static_cast<size_t>(info_header_.biWidth); j++) {
-                outstream.write((char *)(&(data_[i][j])), sizeof(Color));
-            }
-        }
-    } else {
-        for (std::size_t i = 0; i < static_cast<size_t>(info_header_.biHeight); i++) {
-            for (std::size_t j = 0; j < static_cast<size_t>(info_header_.biWidth); j++) {
-                outstream.write((char *)(&(data_[i][j])), sizeof(Color));
-            }
+    BitmapFileHeader file_header = file_header_;
+    BitmapInfoHeader info_header = info_header_;
+    NormalizeHeaders(file_header, info_header);
+    outstream.write(reinterpret_cast<const char *>(&file_header), sizeof(BitmapFileHeader));
+    outstream.write(reinterpret_cast<const char *>(&info_header), sizeof(BitmapInfoHeader));
+    if (GetFormat() == PixelFormat::Gray) {
+        WritePalette(outstream);
+    }
+
+    auto row_size = static_cast<std::streamsize>(info_header_.biWidth * PixelSize(GetFormat()));
+    auto padding_size = static_cast<std::streamsize>(PaddedRowSize(info_header_.biWidth, GetFormat())) - row_size;
+    const char padding[4] = {};
+
+    for (std::size_t i = 0; i < static_cast<size_t>(info_header_.biHeight); i++) {
+        outstream.write(reinterpret_cast<const char *>(GetRow(i)), row_size);
+        if (padding_size) {
+            outstream.write(padding, padding_size);
         }
     }
 }
@@ -78,7 +253,3 @@ BitmapFileHeader Bitmap::GetFileHeader() const {
 BitmapInfoHeader Bitmap::GetInfoHeader() const {
     return info_header_;
 }
-
-Color Bitmap::GetData(size_t i, size_t j) const {
-    return data_[i][j];
-}
\ No newline at end of file
@@ -1,8 +1,11 @@
 #pragma once
 
 #include "stdint.h"
+#include <cstddef>
+#include <cstdlib>
 #include <fstream>
-#include <vector>
+#include <memory>
+#include <span>
 
 struct BitmapFileHeader {
     std::uint16_t bfType;
@@ -32,17 +35,70 @@ struct Color {
     std::uint8_t red;
 } __attribute__((__packed__));
 
+// Layout of a pixel, given by the bit count of the info header. Bgr is what the filters work on.
+// Gray holds one byte per pixel, for images whose channels are all equal, and is written as an
+// 8-bit BMP with a grey ramp palette; Bgrx pads every pixel to four bytes.
+enum class PixelFormat { Bgr, Gray, Bgrx };
+
+// Pixels are kept in one contiguous buffer aligned to kAlignment bytes. Row i starts at
+// GetPixels() + i * GetRowStride(); the default stride equals the padded BMP row size, so
+// a row in memory has the same layout as a row in the file.
 class Bitmap {
 public:
+    static constexpr std::size_t kAlignment = 64;
+    // Size in bytes of the palette of a Gray bitmap, 256 entries of blue, green, red and zero.
+    static constexpr std::size_t kPaletteSize = 256 * 4;
+
+    Bitmap(const BitmapFileHeader &file_header, const BitmapInfoHeader &info_header, std::size_t row_stride = 0);
+
+    // Wraps pixels owned by someone else (e.g. a memory-mapped file) without copying them.
+    // The buffer is kept alive by the shared pointer and is not guaranteed to be aligned.
     Bitmap(const BitmapFileHeader &file_header, const BitmapInfoHeader &info_header,
-           std::vector<std::vector<Color>> data)
-            : file_header_(file_header), info_header_(info_header), data_(data) {
-    }
+           std::shared_ptr<std::uint8_t> pixels, std::size_t row_stride);
 
     static Bitmap *Read(std::ifstream &instream);
 
+    static bool CheckHeaders(const BitmapFileHeader &file_header, const BitmapInfoHeader &info_header,
+                             std::size_t length);
+
+    // Whether the kPaletteSize bytes at `palette` are the grey ramp, the only palette read.
+    static bool CheckPalette(const std::uint8_t *palette);
+
+    // Writes the grey ramp.
+    static void WritePalette(std::ostream &outstream);
+
+    // Only BITMAPINFOHEADER is written, so the pixel offset and header size are fixed up to match.
+    static void NormalizeHeaders(BitmapFileHeader &file_header, BitmapInfoHeader &info_header);
+
+    // Sets the bit count, palette size and image sizes of the headers for the given format.
+    static void SetFormat(BitmapFileHeader &file_header, BitmapInfoHeader &info_header, PixelFormat format);
+
     void Write(std::ofstream &outstream) const;
 
+    static std::size_t PaddedRowSize(std::int32_t width, PixelFormat format = PixelFormat::Bgr);
+
+    static std::size_t PixelSize(PixelFormat format);
+
+    static PixelFormat FormatOf(const BitmapInfoHeader &info_header);
+
+    // Converts `width` pixels. Bgr to Gray keeps the value of pixels whose channels are equal and
+    // takes the grey value of the others.
+    static void ConvertRow(const std::uint8_t *src, PixelFormat from, std::uint8_t *dst, PixelFormat to,
+                           std::int32_t width);
+
+    // A copy of the bitmap in another format.
+    Bitmap *Convert(PixelFormat format) const;
+
+    PixelFormat GetFormat() const {
+        return FormatOf(info_header_);
+    }
+
+    // The first `width` pixels of row i as Bgr.
+    void UnpackRow(std::size_t i, Color *dst, std::int32_t width) const;
+
+    // Sets the first `width` pixels of row i from Bgr.
+    void PackRow(std::size_t i, const Color *src, std::int32_t width);
+
     std::int32_t GetHeight() const;
 
     std::int32_t GetWidth() const;
@@ -51,10 +107,47 @@ public:
 
     BitmapInfoHeader GetInfoHeader() const;
 
-    Color GetData(std::size_t i, std::size_t j) const;
+    std::size_t GetRowStride() const {
+        return row_stride_;
+    }
+
+    std::uint8_t *GetPixels() {
+        return pixels_.get();
+    }
+
+    const std::uint8_t *GetPixels() const {
+        return pixels_.get();
+    }
+
+    // The owning pointer of the pixels, for bitmaps that share or recycle this buffer.
+    const std::shared_ptr<std::uint8_t> &GetBuffer() const {
+        return pixels_;
+    }
+
+    // Rows of the other formats hold PixelSize(GetFormat()) bytes per pixel at the same address.
+    Color *GetRow(std::size_t i) {
+        return reinterpret_cast<Color *>(pixels_.get() + i * row_stride_);
+    }
+
+    const Color *GetRow(std::size_t i) const {
+        return reinterpret_cast<const Color *>(pixels_.get() + i * row_stride_);
+    }
+
+    std::span<Color> GetRowSpan(std::size_t i) {
+        return {GetRow(i), static_cast<std::size_t>(info_header_.biWidth)};
+    }
+
+    std::span<const Color> GetRowSpan(std::size_t i) const {
+        return {GetRow(i), static_cast<std::size_t>(info_header_.biWidth)};
+    }
+
+    Color GetData(std::size_t i, std::size_t j) const {
+        return GetRow(i)[j];
+    }
 
 private:
     BitmapFileHeader file_header_;
     BitmapInfoHeader info_header_;
-    std::vector<std::vector<Color>> data_;
+    std::size_t row_stride_;
+    std::shared_ptr<std::uint8_t> pixels_;
 };
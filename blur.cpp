@@ -0,0 +1,249 @@
+#include "blur.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cmath>
+
+namespace blur {
+namespace {
+
+constexpr std::size_t kBlock = 256;
+constexpr std::size_t kStrip = 64;
+constexpr std::uint32_t kBoxScale = 256;
+
+const std::uint8_t *Bytes(const Color *row) {
+    return reinterpret_cast<const std::uint8_t *>(row);
+}
+
+std::uint8_t *Bytes(Color *row) {
+    return reinterpret_cast<std::uint8_t *>(row);
+}
+
+// Multiplier m such that (sum * m) >> 32 == sum * in_scale / (out_scale * (2 * radius + 1)).
+std::uint64_t BoxMultiplier(int32_t radius, std::uint32_t in_scale, std::uint32_t out_scale) {
+    std::uint64_t denominator = static_cast<std::uint64_t>(out_scale) * (2 * radius + 1);
+    return ((static_cast<std::uint64_t>(in_scale) << 32) + denominator / 2) / denominator;
+}
+
+template <typename In, typename Out>
+void BoxLine(const In *in, std::size_t in_step, Out *out, std::size_t out_step, int32_t n, int32_t radius,
+             std::uint64_t multiplier) {
+    auto at = [&](int32_t i) -> std::uint32_t { return in[std::clamp(i, 0, n - 1) * in_step]; };
+    std::uint32_t sum = 0;
+    for (int32_t k = -radius; k <= radius; ++k) {
+        sum += at(k);
+    }
+    for (int32_t i = 0; i < n; ++i) {
+        out[i * out_step] = static_cast<Out>((sum * multiplier) >> 32);
+        sum += at(i + radius + 1) - at(i - radius);
+    }
+}
+
+template <typename In, typename Out>
+void BoxColumns(const In *in, std::size_t in_pitch, Out *out, std::size_t out_pitch, int32_t height,
+                std::size_t count, int32_t radius, std::uint64_t multiplier) {
+    auto row = [&](int32_t i) { return in + std::clamp(i, 0, height - 1) * in_pitch; };
+    std::uint32_t sum[kStrip] = {};
+    for (int32_t k = -radius; k <= radius; ++k) {
+        const In *src = row(k);
+        for (std::size_t t = 0; t < count; ++t) {
+            sum[t] += src[t];
+        }
+    }
+    for (int32_t i = 0; i < height; ++i) {
+        const In *add = row(i + radius + 1);
+        const In *sub = row(i - radius);
+        Out *dst = out + i * out_pitch;
+        for (std::size_t t = 0; t < count; ++t) {
+            dst[t] = static_cast<Out>((sum[t] * multiplier) >> 32);
+            sum[t] += add[t] - sub[t];
+        }
+    }
+}
+
+}  // namespace
+
+std::vector<double> GaussianWeights(double sigma) {
+    std::int32_t sigma3 = static_cast<int32_t>(sigma * 3.0);
+    std::int32_t sigma_full = sigma3 * 2 + 1;
+
+    double s = 0.0;
+    for (std::int32_t i = 0; i < sigma_full; ++i) {
+        s += std::exp(-((i - sigma3) * (i - sigma3)) / (2 * sigma * sigma)) / (sigma * std::sqrt(2.0 * M_PI));
+    }
+
+    std::vector<double> weights(sigma_full);
+    for (std::int32_t i = 0; i < sigma_full; ++i) {
+        weights[i] =
+                std::exp(-((i - sigma3) * (i - sigma3)) / (2 * sigma * sigma)) / (sigma * std::sqrt(2.0 * M_PI)) / s;
+    }
+    return weights;
+}
+
+std::vector<std::uint32_t> FixedWeights(const std::vector<double> &weights) {
+    std::vector<std::uint32_t> fixed(weights.size());
+    std::int64_t total = 0;
+    for (std::size_t i = 0; i < weights.size(); ++i) {
+        fixed[i] = static_cast<std::uint32_t>(std::llround(weights[i] * (1 << kFixedShift)));
+        total += fixed[i];
+    }
+    fixed[weights.size() / 2] += static_cast<std::int32_t>((1 << kFixedShift) - total);
+    return fixed;
+}
+
+std::vector<int32_t> BoxRadii(double sigma, int32_t passes) {
+    double ideal = std::sqrt(12.0 * sigma * sigma / passes + 1.0);
+    auto lower = static_cast<int32_t>(std::floor(ideal));
+    if (lower % 2 == 0) {
+        --lower;
+    }
+    lower = std::max(lower, 1);
+    int32_t upper = lower + 2;
+    double lower_count = (12.0 * sigma * sigma - passes * lower * lower - 4.0 * passes * lower - 3.0 * passes) /
+                         (-4.0 * lower - 4.0);
+    auto count = static_cast<int32_t>(std::lround(lower_count));
+
+    std::vector<int32_t> radii(passes);
+    for (int32_t i = 0; i < passes; ++i) {
+        radii[i] = (i < count ? lower : upper) / 2;
+    }
+    return radii;
+}
+
+void PadRow(Color *padded, int32_t width, int32_t radius) {
+    std::fill(padded, padded + radius, padded[radius]);
+    std::fill(padded + radius + width, padded + 2 * radius + width, padded[radius + width - 1]);
+}
+
+void VerticalExact(const Color *const *rows, const std::vector<double> &weights, Color *dst, int32_t width) {
+    std::size_t size = static_cast<std::size_t>(width) * sizeof(Color);
+    double acc[kBlock];
+    for (std::size_t begin = 0; begin < size; begin += kBlock) {
+        std::size_t count = std::min(kBlock, size - begin);
+        std::fill(acc, acc + count, 0.0);
+        for (std::size_t tap = 0; tap < weights.size(); ++tap) {
+            const std::uint8_t *src = Bytes(rows[tap]) + begin;
+            double weight = weights[tap];
+            for (std::size_t k = 0; k < count; ++k) {
+                acc[k] += src[k] * weight / 255.0;
+            }
+        }
+        std::uint8_t *out = Bytes(dst) + begin;
+        for (std::size_t k = 0; k < count; ++k) {
+            out[k] = acc[k] > 1 ? 255 : static_cast<uint8_t>(acc[k] * 255);
+        }
+    }
+}
+
+void HorizontalExact(const Color *padded, const std::vector<double> &weights, Color *dst, int32_t width) {
+    std::size_t size = static_cast<std::size_t>(width) * sizeof(Color);
+    double acc[kBlock];
+    for (std::size_t begin = 0; begin < size; begin += kBlock) {
+        std::size_t count = std::min(kBlock, size - begin);
+        std::fill(acc, acc + count, 0.0);
+        for (std::size_t tap = 0; tap < weights.size(); ++tap) {
+            const std::uint8_t *src = Bytes(padded) + begin + tap * sizeof(Color);
+            double weight = weights[tap];
+            for (std::size_t k = 0; k < count; ++k) {
+                acc[k] += src[k] * weight / 255.0;
+            }
+        }
+        std::uint8_t *out = Bytes(dst) + begin;
+        for (std::size_t k = 0; k < count; ++k) {
+            out[k] = acc[k] > 1 ? 255 : static_cast<uint8_t>(acc[k] * 255);
+        }
+    }
+}
+
+void VerticalFixed(const Color *const *rows, const std::vector<std::uint32_t> &weights, Color *dst, int32_t width) {
+    std::size_t size = static_cast<std::size_t>(width) * sizeof(Color);
+    std::uint32_t acc[kBlock];
+    for (std::size_t begin = 0; begin < size; begin += kBlock) {
+        std::size_t count = std::min(kBlock, size - begin);
+        std::fill(acc, acc + count, 0u);
+        for (std::size_t tap = 0; tap < weights.size(); ++tap) {
+            const std::uint8_t *src = Bytes(rows[tap]) + begin;
+            std::uint32_t weight = weights[tap];
+            for (std::size_t k = 0; k < count; ++k) {
+                acc[k] += src[k] * weight;
+            }
+        }
+        std::uint8_t *out = Bytes(dst) + begin;
+        for (std::size_t k = 0; k < count; ++k) {
+            out[k] = static_cast<std::uint8_t>(acc[k] >> kFixedShift);
+        }
+    }
+}
+
+void HorizontalFixed(const Color *padded, const std::vector<std::uint32_t> &weights, Color *dst, int32_t width) {
+    std::size_t size = static_cast<std::size_t>(width) * sizeof(Color);
+    std::uint32_t acc[kBlock];
+    for (std::size_t begin = 0; begin < size; begin += kBlock) {
+        std::size_t count = std::min(kBlock, size - begin);
+        std::fill(acc, acc + count, 0u);
+        for (std::size_t tap = 0; tap < weights.size(); ++tap) {
+            const std::uint8_t *src = Bytes(padded) + begin + tap * sizeof(Color);
+            std::uint32_t weight = weights[tap];
+            for (std::size_t k = 0; k < count; ++k) {
+                acc[k] += src[k] * weight;
+            }
+        }
+        std::uint8_t *out = Bytes(dst) + begin;
+        for (std::size_t k = 0; k < count; ++k) {
+            out[k] = static_cast<std::uint8_t>(acc[k] >> kFixedShift);
+        }
+    }
+}
+
+void BoxBlur(Bitmap *bitmap, const std::vector<int32_t> &radii, ThreadPool *pool) {
+    int32_t height = bitmap->GetHeight();
+    int32_t width = bitmap->GetWidth();
+    std::size_t last = radii.size() - 1;
+
+    // Intermediate passes keep 8 fractional bits in 16-bit samples.
+    RowBands(height, pool).Run([&](int32_t begin, int32_t end) {
+        std::vector<std::uint16_t> front(width);
+        std::vector<std::uint16_t> back(width);
+        for (int32_t i = begin; i < end; ++i) {
+            std::uint8_t *row = Bytes(bitmap->GetRow(i));
+            for (std::size_t channel = 0; channel < sizeof(Color); ++channel) {
+                BoxLine(row + channel, sizeof(Color), front.data(), 1, width, radii[0],
+                        BoxMultiplier(radii[0], kBoxScale, 1));
+                for (std::size_t pass = 1; pass < last; ++pass) {
+                    BoxLine(front.data(), 1, back.data(), 1, width, radii[pass], BoxMultiplier(radii[pass], 1, 1));
+                    front.swap(back);
+                }
+                BoxLine(front.data(), 1, row + channel, sizeof(Color), width, radii[last],
+                        BoxMultiplier(radii[last], 1, kBoxScale));
+            }
+        }
+    });
+
+    std::size_t size = static_cast<std::size_t>(width) * sizeof(Color);
+    std::size_t stride = bitmap->GetRowStride();
+    std::size_t strips = (size + kStrip - 1) / kStrip;
+    auto vertical = [&](std::size_t strip) {
+        std::size_t begin = strip * kStrip;
+        std::size_t count = std::min(kStrip, size - begin);
+        std::uint8_t *column = bitmap->GetPixels() + begin;
+        std::vector<std::uint16_t> front(static_cast<std::size_t>(height) * kStrip);
+        std::vector<std::uint16_t> back(static_cast<std::size_t>(height) * kStrip);
+        BoxColumns(column, stride, front.data(), kStrip, height, count, radii[0],
+                   BoxMultiplier(radii[0], kBoxScale, 1));
+        for (std::size_t pass = 1; pass < last; ++pass) {
+            BoxColumns(front.data(), kStrip, back.data(), kStrip, height, count, radii[pass],
+                       BoxMultiplier(radii[pass], 1, 1));
+            front.swap(back);
+        }
+        BoxColumns(front.data(), kStrip, column, stride, height, count, radii[last],
+                   BoxMultiplier(radii[last], 1, kBoxScale));
+    };
+    if (pool != nullptr) {
+        pool->ParallelFor(strips, vertical);
+    } else {
+        for (std::size_t strip = 0; strip < strips; ++strip) {
+            vertical(strip);
+        }
+    }
+}
+
+}  // namespace blur
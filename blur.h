@@ -0,0 +1,38 @@
+#pragma once
+
+#include "bitmap.h"
+#include <vector>
+
+class ThreadPool;
+
+// Building blocks of GaussianBlur. Vertical passes take the 2 * radius + 1 rows around the output
+// row; horizontal passes take a row padded with radius copies of its edge pixels on each side.
+// All of them walk rows as flat byte arrays, a block of columns at a time, so the inner loops
+// run over contiguous memory and vectorize.
+namespace blur {
+
+constexpr int kFixedShift = 14;
+
+// Normalized weights of the sampled kernel, radius = floor(3 sigma).
+std::vector<double> GaussianWeights(double sigma);
+
+// The same weights in 1 / 2^kFixedShift units, rounded so that they still sum to one.
+std::vector<std::uint32_t> FixedWeights(const std::vector<double> &weights);
+
+// Radii of `passes` box filters whose composition approximates a Gaussian of the given sigma.
+std::vector<int32_t> BoxRadii(double sigma, int32_t passes);
+
+void PadRow(Color *padded, int32_t width, int32_t radius);
+
+// Double arithmetic identical to the reference filter: every tap adds pixel * weight / 255.
+void VerticalExact(const Color *const *rows, const std::vector<double> &weights, Color *dst, int32_t width);
+void HorizontalExact(const Color *padded, const std::vector<double> &weights, Color *dst, int32_t width);
+
+// Integer taps truncated like the exact passes; off by at most one level per pass.
+void VerticalFixed(const Color *const *rows, const std::vector<std::uint32_t> &weights, Color *dst, int32_t width);
+void HorizontalFixed(const Color *padded, const std::vector<std::uint32_t> &weights, Color *dst, int32_t width);
+
+// Stacked box blurs with running sums: constant work per pixel whatever the radii. In place.
+void BoxBlur(Bitmap *bitmap, const std::vector<int32_t> &radii, ThreadPool *pool);
+
+}  // namespace blur
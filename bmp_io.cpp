@@ -0,0 +1,239 @@
+#include "bmp_io.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+OutputFile::OutputFile(const std::string &filename) {
+    // Renaming over a symbolic link would replace the link rather than the file it points to.
+    std::error_code error;
+    std::filesystem::path target = std::filesystem::weakly_canonical(filename, error);
+    filename_ = error ? filename : target.string();
+    // Unique among the threads and processes that may write next to the same file. Created with the
+    // mode a new file would get.
+    static std::atomic<unsigned> counter = 0;
+    for (int attempt = 0; temporary_.empty(); ++attempt) {
+        std::string name = filename_ + ".tmp" + std::to_string(getpid()) + "." + std::to_string(counter++);
+        int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (fd >= 0) {
+            close(fd);
+            temporary_ = name;
+        } else if (errno != EEXIST || attempt >= 100) {
+            throw std::runtime_error("Could not open the output file");
+        }
+    }
+    outstream_.open(temporary_, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!outstream_) {
+        std::remove(temporary_.c_str());
+        throw std::runtime_error("Could not open the output file");
+    }
+}
+
+OutputFile::~OutputFile() {
+    if (!committed_) {
+        outstream_.close();
+        std::remove(temporary_.c_str());
+    }
+}
+
+std::ostream &OutputFile::GetStream() {
+    return outstream_;
+}
+
+void OutputFile::Commit() {
+    outstream_.close();
+    if (!outstream_ || std::rename(temporary_.c_str(), filename_.c_str()) != 0) {
+        throw std::runtime_error("Could not write the output file");
+    }
+    committed_ = true;
+}
+
+MappedFile::MappedFile(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open the input file");
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        void *data = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, info.st_size, MADV_SEQUENTIAL);
+            data_ = static_cast<std::uint8_t *>(data);
+            size_ = info.st_size;
+        }
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data_ != nullptr) {
+        munmap(data_, size_);
+    }
+}
+
+bool MappedFile::IsMapped() const {
+    return data_ != nullptr;
+}
+
+std::uint8_t *MappedFile::GetData() const {
+    return data_;
+}
+
+std::size_t MappedFile::GetSize() const {
+    return size_;
+}
+
+namespace {
+
+// Wraps the pixel array of the BMP file held in data[0, size); `owner` keeps the data alive.
+Bitmap *WrapFile(const std::shared_ptr<void> &owner, std::uint8_t *data, std::size_t size) {
+    if (size < sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader)) {
+        return nullptr;
+    }
+
+    BitmapFileHeader file_header;
+    BitmapInfoHeader info_header;
+    std::memcpy(&file_header, data, sizeof(BitmapFileHeader));
+    std::memcpy(&info_header, data + sizeof(BitmapFileHeader), sizeof(BitmapInfoHeader));
+    if (!Bitmap::CheckHeaders(file_header, info_header, size)) {
+        return nullptr;
+    }
+    PixelFormat format = Bitmap::FormatOf(info_header);
+    if (format == PixelFormat::Gray && !Bitmap::CheckPalette(data + sizeof(BitmapFileHeader) + info_header.biSize)) {
+        return nullptr;
+    }
+
+    std::shared_ptr<std::uint8_t> pixels(owner, data + file_header.bfOffBits);
+    return new Bitmap(file_header, info_header, std::move(pixels), Bitmap::PaddedRowSize(info_header.biWidth, format));
+}
+
+}  // namespace
+
+Bitmap *BmpReader::Read(const char *filename) {
+    auto file = std::make_shared<MappedFile>(filename);
+    if (!file->IsMapped()) {
+        std::ifstream instream(filename, std::ios::in | std::ios::binary);
+        if (!instream) {
+            throw std::runtime_error("Could not open the input file");
+        }
+        return Bitmap::Read(instream);
+    }
+    return WrapFile(file, file->GetData(), file->GetSize());
+}
+
+Bitmap *BmpReader::FromMemory(std::string contents) {
+    auto owner = std::make_shared<std::string>(std::move(contents));
+    return WrapFile(owner, reinterpret_cast<std::uint8_t *>(owner->data()), owner->size());
+}
+
+BmpRowReader::BmpRowReader(const char *filename) : instream_(filename, std::ios::in | std::ios::binary) {
+    if (!instream_) {
+        throw std::runtime_error("Could not open the input file");
+    }
+    instream_.seekg(0, std::ios::end);
+    std::size_t length = instream_.tellg();
+    instream_.seekg(0, std::ios::beg);
+    instream_.read(reinterpret_cast<char *>(&file_header_), sizeof(BitmapFileHeader));
+    instream_.read(reinterpret_cast<char *>(&info_header_), sizeof(BitmapInfoHeader));
+    if (!instream_ || !Bitmap::CheckHeaders(file_header_, info_header_, length)) {
+        throw std::runtime_error("Could not read the input file");
+    }
+    format_ = Bitmap::FormatOf(info_header_);
+    if (format_ == PixelFormat::Gray) {
+        std::uint8_t palette[Bitmap::kPaletteSize];
+        instream_.seekg(sizeof(BitmapFileHeader) + info_header_.biSize, std::ios::beg);
+        instream_.read(reinterpret_cast<char *>(palette), Bitmap::kPaletteSize);
+        if (!instream_ || !Bitmap::CheckPalette(palette)) {
+            throw std::runtime_error("Could not read the input file");
+        }
+    }
+    padded_row_size_ = Bitmap::PaddedRowSize(info_header_.biWidth, format_);
+}
+
+const BitmapFileHeader &BmpRowReader::GetFileHeader() const {
+    return file_header_;
+}
+
+const BitmapInfoHeader &BmpRowReader::GetInfoHeader() const {
+    return info_header_;
+}
+
+void BmpRowReader::ReadRows(std::int32_t first, std::int32_t count, Bitmap *strip) {
+    if (first != next_row_) {
+        instream_.seekg(static_cast<std::streamoff>(file_header_.bfOffBits + first * padded_row_size_), std::ios::beg);
+    }
+    if (strip->GetFormat() != format_) {
+        row_.resize(padded_row_size_);
+        for (std::int32_t i = 0; i < count && instream_; ++i) {
+            instream_.read(reinterpret_cast<char *>(row_.data()), static_cast<std::streamsize>(padded_row_size_));
+            Bitmap::ConvertRow(row_.data(), format_, reinterpret_cast<std::uint8_t *>(strip->GetRow(i)),
+                               strip->GetFormat(), info_header_.biWidth);
+        }
+    } else if (strip->GetRowStride() == padded_row_size_) {
+        instream_.read(reinterpret_cast<char *>(strip->GetRow(0)),
+                       static_cast<std::streamsize>(count * padded_row_size_));
+    } else {
+        for (std::int32_t i = 0; i < count; ++i) {
+            instream_.read(reinterpret_cast<char *>(strip->GetRow(i)), static_cast<std::streamsize>(padded_row_size_));
+        }
+    }
+    if (!instream_) {
+        throw std::runtime_error("Could not read the input file");
+    }
+    next_row_ = first + count;
+}
+
+BmpRowWriter::BmpRowWriter(std::ostream &outstream, const BitmapFileHeader &file_header,
+                           const BitmapInfoHeader &info_header)
+        : outstream_(outstream),
+          format_(Bitmap::FormatOf(info_header)),
+          width_(info_header.biWidth),
+          row_size_(static_cast<std::size_t>(info_header.biWidth) * Bitmap::PixelSize(format_)),
+          padded_row_size_(Bitmap::PaddedRowSize(info_header.biWidth, format_)) {
+    BitmapFileHeader normalized_file_header = file_header;
+    BitmapInfoHeader normalized_info_header = info_header;
+    Bitmap::NormalizeHeaders(normalized_file_header, normalized_info_header);
+    outstream_.write(reinterpret_cast<const char *>(&normalized_file_header), sizeof(BitmapFileHeader));
+    outstream_.write(reinterpret_cast<const char *>(&normalized_info_header), sizeof(BitmapInfoHeader));
+    if (format_ == PixelFormat::Gray) {
+        Bitmap::WritePalette(outstream_);
+    }
+    block_.resize(std::max(kBlockSize / padded_row_size_, std::size_t{1}) * padded_row_size_);
+}
+
+void BmpRowWriter::WriteRow(const Color *row) {
+    WriteRow(reinterpret_cast<const std::uint8_t *>(row), PixelFormat::Bgr);
+}
+
+void BmpRowWriter::WriteRows(const Bitmap *bitmap) {
+    for (std::int32_t i = 0; i < bitmap->GetHeight(); ++i) {
+        WriteRow(reinterpret_cast<const std::uint8_t *>(bitmap->GetRow(i)), bitmap->GetFormat());
+    }
+}
+
+void BmpRowWriter::WriteRow(const std::uint8_t *row, PixelFormat format) {
+    if (block_used_ == block_.size()) {
+        Flush();
+    }
+    auto *dst = reinterpret_cast<std::uint8_t *>(block_.data() + block_used_);
+    Bitmap::ConvertRow(row, format, dst, format_, width_);
+    std::memset(dst + row_size_, 0, padded_row_size_ - row_size_);
+    block_used_ += padded_row_size_;
+    ++rows_written_;
+}
+
+void BmpRowWriter::Flush() {
+    outstream_.write(block_.data(), static_cast<std::streamsize>(block_used_));
+    block_used_ = 0;
+}
+
+std::int32_t BmpRowWriter::GetRowsWritten() const {
+    return rows_written_;
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "bitmap.h"
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// An output file written under a temporary name next to it and renamed over it by Commit, so that
+// the target is replaced whole or not at all. A file being read through a MappedFile may be the
+// target: the mapping keeps the old contents, where truncating the file in place would fault it.
+class OutputFile {
+public:
+    // Throws std::runtime_error if the temporary file can not be created.
+    explicit OutputFile(const std::string &filename);
+
+    // Removes the temporary file unless it was committed.
+    ~OutputFile();
+
+    OutputFile(const OutputFile &) = delete;
+
+    OutputFile &operator=(const OutputFile &) = delete;
+
+    std::ostream &GetStream();
+
+    // Closes the stream and renames the file over the target. Throws std::runtime_error if
+    // anything written could not be, leaving the target untouched.
+    void Commit();
+
+private:
+    std::string filename_;
+    std::string temporary_;
+    std::ofstream outstream_;
+    bool committed_ = false;
+};
+
+// Read-write private mapping of a whole file: pages are loaded lazily and writes never reach the disk.
+class MappedFile {
+public:
+    explicit MappedFile(const char *filename);
+
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool IsMapped() const;
+
+    std::uint8_t *GetData() const;
+
+    std::size_t GetSize() const;
+
+private:
+    std::uint8_t *data_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+class BmpReader {
+public:
+    // Maps the file and wraps its pixel array without copying. Falls back to a single bulk read
+    // when the file cannot be mapped. Returns nullptr if the file is not a supported BMP.
+    static Bitmap *Read(const char *filename);
+
+    // Wraps the pixel array of a whole BMP file held in memory, taking the string over.
+    // Returns nullptr if it is not a supported BMP.
+    static Bitmap *FromMemory(std::string contents);
+};
+
+// Reads the pixel array of a BMP in runs of rows, seeking over the rows that are not asked for,
+// so that only the rows being worked on are ever held in memory.
+class BmpRowReader {
+public:
+    // Throws std::runtime_error if the file cannot be opened or is not a supported BMP.
+    explicit BmpRowReader(const char *filename);
+
+    const BitmapFileHeader &GetFileHeader() const;
+
+    const BitmapInfoHeader &GetInfoHeader() const;
+
+    // Reads rows [first, first + count) into the first rows of `strip`, which must be as wide as the image
+    // and may be in another format.
+    void ReadRows(std::int32_t first, std::int32_t count, Bitmap *strip);
+
+private:
+    std::ifstream instream_;
+    BitmapFileHeader file_header_;
+    BitmapInfoHeader info_header_;
+    PixelFormat format_;
+    std::size_t padded_row_size_;
+    // A file row, when the strip is in another format.
+    std::vector<std::uint8_t> row_;
+    std::int32_t next_row_ = -1;
+};
+
+// Writes padded BMP rows one by one, collecting them into large blocks so that the stream
+// sees one write per block instead of one per pixel. Rows go out in file order (bottom-up), in
+// the format of the headers, converted from the format they are given in.
+class BmpRowWriter {
+public:
+    static constexpr std::size_t kBlockSize = 1 << 20;
+
+    BmpRowWriter(std::ostream &outstream, const BitmapFileHeader &file_header, const BitmapInfoHeader &info_header);
+
+    void WriteRow(const Color *row);
+
+    void WriteRows(const Bitmap *bitmap);
+
+    void Flush();
+
+    std::int32_t GetRowsWritten() const;
+
+private:
+    void WriteRow(const std::uint8_t *row, PixelFormat format);
+
+    std::ostream &outstream_;
+    PixelFormat format_;
+    std::int32_t width_;
+    std::size_t row_size_;
+    std::size_t padded_row_size_;
+    std::vector<char> block_;
+    std::size_t block_used_ = 0;
+    std::int32_t rows_written_ = 0;
+};
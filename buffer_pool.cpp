@@ -0,0 +1,81 @@
+#include "buffer_pool.h"
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+namespace {
+thread_local BufferPool *current_pool = nullptr;
+}
+
+BufferPool::BufferPool(std::size_t max_idle_bytes) : shelf_(std::make_shared<Shelf>()) {
+    shelf_->max_idle_bytes = max_idle_bytes;
+}
+
+std::shared_ptr<std::uint8_t> BufferPool::Acquire(std::size_t size, std::size_t alignment) {
+    size = (std::max(size, std::size_t{1}) + alignment - 1) / alignment * alignment;
+    std::uint8_t *buffer = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(shelf_->mutex);
+        auto it = shelf_->idle.find(size);
+        if (it != shelf_->idle.end() && !it->second.empty()) {
+            buffer = it->second.back();
+            it->second.pop_back();
+            shelf_->idle_bytes -= size;
+            ++shelf_->reused;
+        } else {
+            ++shelf_->allocated;
+        }
+    }
+    if (buffer == nullptr) {
+        buffer = static_cast<std::uint8_t *>(std::aligned_alloc(alignment, size));
+        if (buffer == nullptr) {
+            throw std::bad_alloc();
+        }
+    }
+    std::shared_ptr<Shelf> shelf = shelf_;
+    return std::shared_ptr<std::uint8_t>(buffer, [shelf, size](std::uint8_t *released) {
+        shelf->Release(released, size);
+    });
+}
+
+std::size_t BufferPool::GetReused() const {
+    std::lock_guard<std::mutex> lock(shelf_->mutex);
+    return shelf_->reused;
+}
+
+std::size_t BufferPool::GetAllocated() const {
+    std::lock_guard<std::mutex> lock(shelf_->mutex);
+    return shelf_->allocated;
+}
+
+BufferPool::Scope::Scope(BufferPool *pool) : previous_(current_pool) {
+    current_pool = pool;
+}
+
+BufferPool::Scope::~Scope() {
+    current_pool = previous_;
+}
+
+BufferPool *BufferPool::Current() {
+    return current_pool;
+}
+
+BufferPool::Shelf::~Shelf() {
+    for (auto &[size, buffers] : idle) {
+        for (std::uint8_t *buffer : buffers) {
+            std::free(buffer);
+        }
+    }
+}
+
+void BufferPool::Shelf::Release(std::uint8_t *buffer, std::size_t size) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (idle_bytes + size <= max_idle_bytes) {
+            idle[size].push_back(buffer);
+            idle_bytes += size;
+            return;
+        }
+    }
+    std::free(buffer);
+}
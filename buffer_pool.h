@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Recycles pixel buffers of the sizes seen so far. A released buffer goes back on the shelf of
+// its size (up to a cap on the idle bytes) and the next request of that size takes it, so a
+// run over many images of the same few sizes stops allocating after the first ones.
+class BufferPool {
+public:
+    static constexpr std::size_t kDefaultMaxIdleBytes = std::size_t{1} << 30;
+
+    explicit BufferPool(std::size_t max_idle_bytes = kDefaultMaxIdleBytes);
+
+    BufferPool(const BufferPool &) = delete;
+
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    // A buffer of at least `size` bytes aligned to `alignment`. It returns to the pool when the
+    // last owner lets go, even if that happens after the pool itself is gone.
+    std::shared_ptr<std::uint8_t> Acquire(std::size_t size, std::size_t alignment);
+
+    std::size_t GetReused() const;
+
+    std::size_t GetAllocated() const;
+
+    // While a scope is alive, bitmaps created on the current thread take their buffers from the pool.
+    class Scope {
+    public:
+        explicit Scope(BufferPool *pool);
+
+        ~Scope();
+
+        Scope(const Scope &) = delete;
+
+        Scope &operator=(const Scope &) = delete;
+
+    private:
+        BufferPool *previous_;
+    };
+
+    // The pool of the innermost scope on this thread, or nullptr.
+    static BufferPool *Current();
+
+private:
+    struct Shelf {
+        ~Shelf();
+
+        void Release(std::uint8_t *buffer, std::size_t size);
+
+        std::mutex mutex;
+        std::unordered_map<std::size_t, std::vector<std::uint8_t *>> idle;
+        std::size_t idle_bytes = 0;
+        std::size_t max_idle_bytes = 0;
+        std::size_t reused = 0;
+        std::size_t allocated = 0;
+    };
+
+    std::shared_ptr<Shelf> shelf_;
+};
@@ -0,0 +1,83 @@
+#include "protocol.h"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <unistd.h>
+
+// Command line client of the filter server:
+//   finale_client SOCKET [--inline] INPUT OUTPUT [-filter [parameters] ...]
+//   finale_client SOCKET --stats|--shutdown
+// With --inline the input is sent in the request and the result written here, so the server
+// needs no access to the files; otherwise the server reads and writes the files itself.
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::cerr << "usage: " << argv[0] << " SOCKET [--inline] INPUT OUTPUT [-filter [parameters] ...]\n"
+                  << "       " << argv[0] << " SOCKET --stats|--shutdown" << std::endl;
+        return 1;
+    }
+    protocol::Message request;
+    bool inline_files = false;
+    int first = 2;
+    if (strcmp("--stats", argv[2]) == 0 || strcmp("--shutdown", argv[2]) == 0) {
+        request.text = argv[2] + 2;
+        first = argc;
+    } else if (strcmp("--inline", argv[2]) == 0) {
+        inline_files = true;
+        ++first;
+    }
+    if (first < argc) {
+        if (argc - first < 2) {
+            std::cerr << "not enough parameters entered" << std::endl;
+            return 1;
+        }
+        if (inline_files) {
+            std::ifstream instream(argv[first], std::ios::in | std::ios::binary);
+            if (!instream) {
+                std::cerr << "Could not open the input file" << std::endl;
+                return 1;
+            }
+            instream.seekg(0, std::ios::end);
+            request.data.resize(static_cast<std::size_t>(instream.tellg()));
+            instream.seekg(0, std::ios::beg);
+            instream.read(request.data.data(), static_cast<std::streamsize>(request.data.size()));
+            request.text = "-\n-";
+        } else {
+            // The server has its own working directory.
+            request.text = std::filesystem::absolute(argv[first]).string() + "\n" +
+                           std::filesystem::absolute(argv[first + 1]).string();
+        }
+        for (int k = first + 2; k < argc; ++k) {
+            request.text += std::string("\n") + argv[k];
+        }
+    }
+
+    int fd = protocol::Connect(argv[1]);
+    if (fd < 0) {
+        std::cerr << "Could not connect to the server" << std::endl;
+        return 1;
+    }
+    protocol::Message response;
+    bool received = protocol::Write(fd, request) && protocol::Read(fd, response);
+    close(fd);
+    if (!received) {
+        std::cerr << "The server closed the connection" << std::endl;
+        return 1;
+    }
+    if (response.text.rfind("ok", 0) != 0) {
+        std::cerr << response.text << std::endl;
+        return 1;
+    }
+    if (inline_files) {
+        std::ofstream outstream(argv[first + 1], std::ios::out | std::ios::binary);
+        outstream.write(response.data.data(), static_cast<std::streamsize>(response.data.size()));
+        outstream.close();
+        if (!outstream) {
+            std::cerr << "Could not write the output file" << std::endl;
+            return 1;
+        }
+    } else if (response.text.size() > 3) {
+        std::cout << response.text.substr(3) << std::endl;
+    }
+    return 0;
+}
@@ -1,146 +1,485 @@
 #include "controller.h"
+#include "batch.h"
+#include "bmp_io.h"
+#include "integral.h"
+#include "pipeline.h"
+#include "pyramid.h"
+#include "server.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <filesystem>
 #include <iostream>
+#include <limits>
+
+namespace {
+
+// The whole argument as a number; throws MyException(message) otherwise.
+double ParseNumber(const char *arg, const char *message) {
+    char *end = nullptr;
+    double value = std::strtod(arg, &end);
+    if (end == arg || *end != '\0') {
+        throw MyException(message);
+    }
+    return value;
+}
+
+std::int32_t ParseInteger(const char *arg, std::int32_t min, std::int32_t max, const char *message) {
+    char *end = nullptr;
+    long value = std::strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || value < min || value > max) {
+        throw MyException(message);
+    }
+    return static_cast<std::int32_t>(value);
+}
+
+}  // namespace
 
 Controller::~Controller() {
-    for (Filter *filter : filters_) {
-        delete filter;
+    if (profiler_ != nullptr && Profiler::Active() == profiler_.get()) {
+        Profiler::SetActive(nullptr);
     }
 }
 
-Controller *Controller::Parse(int argc, char **argv) {
+std::unique_ptr<Controller> Controller::Parse(int argc, char **argv) {
+    std::vector<char *> args;
+    std::size_t thread_count = std::max(1u, std::thread::hardware_concurrency());
+    bool streaming = false;
+    bool batch = false;
+    bool profiling = false;
+    std::optional<Profiler::Format> profile_format;
+    std::string trace_path;
+    std::string cache_directory;
+    std::uint64_t cache_capacity = ResultCache::kDefaultCapacity;
+    std::string socket_path;
+    std::int32_t preview_level = 0;
+    PixelFormat output_format = PixelFormat::Bgr;
+    for (int k = 0; k < argc; ++k) {
+        if (strcmp("--threads", argv[k]) == 0) {
+            const char *count = k + 1 < argc ? argv[k + 1] : "";
+            thread_count = static_cast<std::size_t>(
+                ParseInteger(count, 1, std::numeric_limits<std::int32_t>::max(), "wrong value for --threads"));
+            ++k;
+        } else if (strcmp("--stream", argv[k]) == 0) {
+            streaming = true;
+        } else if (strcmp("--batch", argv[k]) == 0) {
+            batch = true;
+        } else if (strcmp("--profile", argv[k]) == 0) {
+            const char *format = k + 1 < argc ? argv[k + 1] : "";
+            if (strcmp("text", format) == 0) {
+                profile_format = Profiler::Format::Text;
+            } else if (strcmp("json", format) == 0) {
+                profile_format = Profiler::Format::JsonLines;
+            } else {
+                throw MyException("wrong value for --profile, expected text or json");
+            }
+            profiling = true;
+            ++k;
+        } else if (strcmp("--trace", argv[k]) == 0) {
+            if (k + 1 >= argc) {
+                throw MyException("missing file name for --trace");
+            }
+            trace_path = argv[k + 1];
+            profiling = true;
+            ++k;
+        } else if (strcmp("--cache", argv[k]) == 0) {
+            if (k + 1 >= argc) {
+                throw MyException("missing directory for --cache");
+            }
+            cache_directory = argv[k + 1];
+            ++k;
+        } else if (strcmp("--serve", argv[k]) == 0) {
+            if (k + 1 >= argc) {
+                throw MyException("missing socket path for --serve");
+            }
+            socket_path = argv[k + 1];
+            ++k;
+        } else if (strcmp("--cache-size", argv[k]) == 0) {
+            const char *size = k + 1 < argc ? argv[k + 1] : "";
+            std::int32_t megabytes = ParseInteger(size, 1, std::numeric_limits<std::int32_t>::max(),
+                                                  "wrong value for --cache-size, expected megabytes");
+            cache_capacity = static_cast<std::uint64_t>(megabytes) << 20;
+            ++k;
+        } else if (strcmp("--bpp", argv[k]) == 0) {
+            const char *bits = k + 1 < argc ? argv[k + 1] : "";
+            if (strcmp("8", bits) == 0) {
+                output_format = PixelFormat::Gray;
+            } else if (strcmp("24", bits) == 0) {
+                output_format = PixelFormat::Bgr;
+            } else if (strcmp("32", bits) == 0) {
+                output_format = PixelFormat::Bgrx;
+            } else {
+                throw MyException("wrong value for --bpp, expected 8, 24 or 32");
+            }
+            ++k;
+        } else if (strcmp("--preview", argv[k]) == 0) {
+            const char *scale = k + 1 < argc ? argv[k + 1] : "";
+            const char *message = "wrong value for --preview, expected a power of two from 2 to 128";
+            std::int32_t value = ParseInteger(scale, 2, 1 << Pyramid::kMaxLevel, message);
+            if ((value & (value - 1)) != 0) {
+                throw MyException(message);
+            }
+            while ((1 << preview_level) < value) {
+                ++preview_level;
+            }
+            ++k;
+        } else {
+            args.push_back(argv[k]);
+        }
+    }
+    argc = static_cast<int>(args.size());
+    argv = args.data();
+
+    if (!socket_path.empty()) {
+        if (argc > 1 || streaming || batch || preview_level > 0) {
+            throw MyException("--serve takes no files, filters, --stream, --batch or --preview");
+        }
+        auto controller = std::make_unique<Controller>(nullptr, nullptr, std::vector<std::unique_ptr<Filter>>(),
+                                                       thread_count);
+        controller->socket_path_ = socket_path;
+        if (!cache_directory.empty()) {
+            controller->EnableCache(std::make_unique<ResultCache>(cache_directory, cache_capacity));
+        }
+        return controller;
+    }
     if (argc < 3) {
-        MyException("not enough parameters entered");
+        throw MyException("not enough parameters entered");
+    }
+    char *input_filename = argv[1];
+    char *output_filename = argv[2];
+    std::vector<std::unique_ptr<Filter>> filters = ParseFilters(argc - 3, argv + 3, 1 << preview_level);
+    if (streaming && !cache_directory.empty()) {
+        throw MyException("--cache can not be used in streaming mode");
+    }
+    if ((streaming || batch) && preview_level > 0) {
+        throw MyException("--preview can not be used with --stream or --batch");
     }
-    char *input_filename = argv[2];
-    char *output_filename = argv[3];
-    std::vector<Filter *> filters;
+    bool chain_streams = std::all_of(filters.begin(), filters.end(), [](const std::unique_ptr<Filter> &filter) {
+        return dynamic_cast<const Crop *>(filter.get()) != nullptr || Pipeline::IsStreamable(filter.get());
+    });
+    if (streaming && !chain_streams) {
+        throw MyException("filter can not be applied in streaming mode");
+    }
+    // A single image whose chain streams is streamed anyway: that overlaps reading, filtering and
+    // writing and needs less memory. The output replaces the file only once it is complete, so it
+    // may be the input.
+    if (!batch && chain_streams && cache_directory.empty() && preview_level == 0) {
+        streaming = true;
+    }
+    auto controller = std::make_unique<Controller>(input_filename, output_filename, std::move(filters), thread_count,
+                                                   streaming, batch);
+    if (profiling) {
+        controller->EnableProfiling(std::make_unique<Profiler>(profile_format, trace_path));
+    }
+    if (!cache_directory.empty()) {
+        controller->EnableCache(std::make_unique<ResultCache>(cache_directory, cache_capacity));
+    }
+    controller->EnablePreview(preview_level);
+    controller->SetOutputFormat(output_format);
+    return controller;
+}
 
-    int i = 4;
+std::vector<std::unique_ptr<Filter>> Controller::ParseFilters(int argc, char **argv, std::int32_t preview_scale) {
+    std::vector<std::unique_ptr<Filter>> filters;
+    int i = 0;
     while (i < argc) {
         if (argv[i][0] != '-') {
-            MyException("wrong filter name, expected '-' at the beginning");
+            throw MyException("wrong filter name, expected '-' at the beginning");
         }
+        // Parameters may be negative numbers; filter names never start with a digit.
         int j = i + 1;
-        while (j < argc && argv[j][0] != '-') {
+        while (j < argc && (argv[j][0] != '-' || std::isdigit(static_cast<unsigned char>(argv[j][1])))) {
             j++;
         }
         if (strcmp("crop", argv[i] + 1) == 0) {
             if (j - i != 3) {
-                MyException("wrong parameters for crop filter");
+                throw MyException("wrong parameters for crop filter");
             }
 
             std::int32_t height = static_cast<int32_t>(std::strtol(argv[i + 1], nullptr, 10));
             std::int32_t width = static_cast<int32_t>(std::strtol(argv[i + 2], nullptr, 10));
             if (height == 0L || width == 0L) {
-                MyException("wrong parameters for crop filter");
+                throw MyException("wrong parameters for crop filter");
+            }
+            // Negative sizes keep the whole image either way.
+            if (height > 0) {
+                height = (height + preview_scale - 1) / preview_scale;
             }
-            filters.push_back(new Crop(width, height));
+            if (width > 0) {
+                width = (width + preview_scale - 1) / preview_scale;
+            }
+            filters.emplace_back(new Crop(width, height));
         } else if (strcmp("gs", argv[i] + 1) == 0) {
             if (j - i != 1) {
-                MyException("wrong parameters for gray scale filter");
+                throw MyException("wrong parameters for gray scale filter");
             }
-            filters.push_back(new Grayscale());
+            filters.emplace_back(new Grayscale());
         } else if (strcmp("neg", argv[i] + 1) == 0) {
             if (j - i != 1) {
-                MyException("wrong parameters for negative filter");
+                throw MyException("wrong parameters for negative filter");
             }
-            filters.push_back(new Negative());
+            filters.emplace_back(new Negative());
         } else if (strcmp("sharp", argv[i] + 1) == 0) {
             if (j - i != 1) {
-                MyException("wrong parameters for sharpening filter");
+                throw MyException("wrong parameters for sharpening filter");
             }
-            filters.push_back(new Sharpening());
+            filters.emplace_back(new Sharpening());
         } else if (strcmp("edge", argv[i] + 1) == 0) {
-            if (j - i != 2) {
-                MyException("wrong parameters for edge detection filter");
+            // -edge threshold [adaptive radius]
+            if (j - i != 2 && j - i != 4) {
+                throw MyException("wrong parameters for edge detection filter");
             }
             std::int32_t threshold = static_cast<int32_t>(std::strtol(argv[i + 1], nullptr, 10));
             if (threshold == 0L) {
-                MyException("threshold is too large");
+                throw MyException("threshold is too large");
             }
-            filters.push_back(new EdgeDetection(threshold));
-        } else if (strcmp("blur", argv[i] + 1) == 0) {
+            std::int32_t adaptive_radius = 0;
+            if (j - i == 4) {
+                if (strcmp("adaptive", argv[i + 2]) != 0) {
+                    throw MyException("wrong mode for edge detection filter, expected adaptive");
+                }
+                adaptive_radius = ParseInteger(argv[i + 3], 1, integral::kMaxRadius,
+                                               "wrong radius for edge detection filter, expected 1..2047");
+                adaptive_radius = std::max(adaptive_radius / preview_scale, 1);
+            }
+            filters.emplace_back(new EdgeDetection(threshold, adaptive_radius));
+        } else if (strcmp("box", argv[i] + 1) == 0 || strcmp("mean", argv[i] + 1) == 0) {
+            bool box = strcmp("box", argv[i] + 1) == 0;
             if (j - i != 2) {
-                MyException("wrong parameters for gaussian blur filter");
+                throw MyException(box ? "wrong parameters for box blur filter"
+                                      : "wrong parameters for local normalization filter");
+            }
+            std::int32_t radius = ParseInteger(argv[i + 1], 1, integral::kMaxRadius,
+                                               box ? "wrong radius for box blur filter, expected 1..2047"
+                                                   : "wrong radius for local normalization filter, expected 1..2047");
+            radius = std::max(radius / preview_scale, 1);
+            if (box) {
+                filters.emplace_back(new BoxBlur(radius));
+            } else {
+                filters.emplace_back(new LocalNormalization(radius));
+            }
+        } else if (strcmp("blur", argv[i] + 1) == 0) {
+            if (j - i != 2 && j - i != 3) {
+                throw MyException("wrong parameters for gaussian blur filter");
             }
             double sigma = std::strtod(argv[i + 1], nullptr);
-            if (sigma == 0.0) {
-                MyException("wrong value for sigma");
+            if (sigma <= 0.0) {
+                throw MyException("wrong value for sigma");
+            }
+            GaussianBlur::Mode mode = GaussianBlur::Mode::Exact;
+            if (j - i == 3) {
+                if (strcmp("exact", argv[i + 2]) == 0) {
+                    mode = GaussianBlur::Mode::Exact;
+                } else if (strcmp("fast", argv[i + 2]) == 0) {
+                    mode = GaussianBlur::Mode::Fast;
+                } else if (strcmp("box", argv[i + 2]) == 0) {
+                    mode = GaussianBlur::Mode::Box;
+                } else if (strcmp("pyramid", argv[i + 2]) == 0) {
+                    mode = GaussianBlur::Mode::Pyramid;
+                } else {
+                    throw MyException("wrong accuracy mode for gaussian blur filter");
+                }
             }
-            filters.push_back(new GaussianBlur(sigma));
+            filters.emplace_back(new GaussianBlur(sigma / preview_scale, mode));
         } else if (strcmp("voronoi", argv[i] + 1) == 0) {
-            if (j - i != 2) {
-                MyException("wrong parameters for voronoi filter");
+            // -voronoi count [seed] [mean [iterations]]
+            if (j - i < 2 || j - i > 5) {
+                throw MyException("wrong parameters for voronoi filter");
             }
             std::uint32_t cluster_count = static_cast<std::uint32_t>(std::strtol(argv[i + 1], nullptr, 10));
             if (cluster_count == 0L) {
-                MyException("wrong parameter for voronoi filter");
+                throw MyException("wrong parameter for voronoi filter");
+            }
+            std::int32_t k = i + 2;
+            std::optional<std::uint32_t> seed;
+            if (k < j && strcmp("mean", argv[k]) != 0) {
+                char *end = nullptr;
+                seed = static_cast<std::uint32_t>(std::strtoul(argv[k], &end, 10));
+                if (end == argv[k] || *end != '\0') {
+                    throw MyException("wrong random seed for voronoi filter");
+                }
+                ++k;
+            }
+            VoronoiBlur::Mode mode = VoronoiBlur::Mode::Seed;
+            std::int32_t iterations = 0;
+            if (k < j) {
+                if (strcmp("mean", argv[k]) != 0) {
+                    throw MyException("wrong mode for voronoi filter, expected mean");
+                }
+                mode = VoronoiBlur::Mode::Mean;
+                ++k;
+            }
+            if (k < j) {
+                iterations = ParseInteger(argv[k], 0, VoronoiBlur::kMaxIterations,
+                                          "wrong iteration count for voronoi filter, expected 0..100");
+                ++k;
+            }
+            if (k != j) {
+                throw MyException("wrong parameters for voronoi filter");
+            }
+            filters.emplace_back(new VoronoiBlur(cluster_count, seed, mode, iterations));
+        } else if (strcmp("bc", argv[i] + 1) == 0) {
+            if (j - i != 3) {
+                throw MyException("wrong parameters for brightness/contrast filter");
+            }
+            std::int32_t brightness = ParseInteger(argv[i + 1], -255, 255, "wrong brightness, expected -255..255");
+            double contrast = ParseNumber(argv[i + 2], "wrong contrast, expected a non-negative number");
+            if (contrast < 0.0) {
+                throw MyException("wrong contrast, expected a non-negative number");
             }
-            filters.push_back(new VoronoiBlur(cluster_count));
+            filters.emplace_back(new BrightnessContrast(brightness, contrast));
+        } else if (strcmp("gamma", argv[i] + 1) == 0) {
+            if (j - i != 2) {
+                throw MyException("wrong parameters for gamma filter");
+            }
+            double gamma = ParseNumber(argv[i + 1], "wrong value for gamma");
+            if (gamma <= 0.0) {
+                throw MyException("wrong value for gamma");
+            }
+            filters.emplace_back(new Gamma(gamma));
+        } else if (strcmp("levels", argv[i] + 1) == 0) {
+            if (j - i != 3 && j - i != 4) {
+                throw MyException("wrong parameters for levels filter");
+            }
+            std::int32_t black = ParseInteger(argv[i + 1], 0, 254, "wrong black point for levels filter");
+            std::int32_t white = ParseInteger(argv[i + 2], black + 1, 255, "wrong white point for levels filter");
+            double gamma = j - i == 4 ? ParseNumber(argv[i + 3], "wrong value for gamma") : 1.0;
+            if (gamma <= 0.0) {
+                throw MyException("wrong value for gamma");
+            }
+            filters.emplace_back(new Levels(black, white, gamma));
+        } else if (strcmp("threshold", argv[i] + 1) == 0) {
+            if (j - i != 2) {
+                throw MyException("wrong parameters for threshold filter");
+            }
+            std::int32_t level = ParseInteger(argv[i + 1], 0, 256, "wrong level for threshold filter");
+            filters.emplace_back(new Threshold(level));
+        } else if (strcmp("posterize", argv[i] + 1) == 0) {
+            if (j - i != 2) {
+                throw MyException("wrong parameters for posterize filter");
+            }
+            std::int32_t levels = ParseInteger(argv[i + 1], 2, 256, "wrong number of levels for posterize filter");
+            filters.emplace_back(new Posterize(levels));
+        } else if (strcmp("conv", argv[i] + 1) == 0 || strcmp("convfile", argv[i] + 1) == 0) {
+            bool from_file = strcmp("convfile", argv[i] + 1) == 0;
+            if (j - i != 2 && j - i != 3) {
+                throw MyException(from_file ? "wrong parameters for convolution file filter"
+                                            : "wrong parameters for convolution filter");
+            }
+            std::vector<float> weights = from_file ? convolution::Kernel::ReadWeights(argv[i + 1])
+                                                   : convolution::Kernel::ParseWeights(argv[i + 1]);
+            if (convolution::Kernel::SizeOf(weights.size()) == 0) {
+                throw MyException("convolution kernel must be a square of odd size up to 31x31");
+            }
+            convolution::Border border = convolution::Border::Clamp;
+            if (j - i == 3) {
+                if (strcmp("clamp", argv[i + 2]) == 0) {
+                    border = convolution::Border::Clamp;
+                } else if (strcmp("mirror", argv[i + 2]) == 0) {
+                    border = convolution::Border::Mirror;
+                } else if (strcmp("wrap", argv[i + 2]) == 0) {
+                    border = convolution::Border::Wrap;
+                } else {
+                    throw MyException("wrong border mode for convolution filter");
+                }
+            }
+            filters.emplace_back(new Convolution(convolution::Kernel(std::move(weights), border)));
+        } else {
+            throw MyException("unknown filter name");
         }
         i = j;
     }
-    return new Controller(input_filename, output_filename, filters);
+    return filters;
 }
 
 Bitmap *Controller::ReadFile() const {
-    Bitmap *bitmap = nullptr;
-    std::ifstream instream;
-
-    try {
-        instream.open(input_filename_, std::ios::in | std::ios::binary);
-        if (!instream) {
-            throw std::runtime_error("Could not open the input file");
-        }
-        bitmap = Bitmap::Read(instream);
-        if (bitmap == nullptr) {
-            throw std::runtime_error("Could not read the input file");
-        }
-        instream.close();
-
-    } catch (const std::exception &e) {
-        if (bitmap != nullptr) {
-            delete bitmap;
-        }
-        if (instream.is_open()) {
-            instream.close();
-        }
-        throw e;
+    Profiler::Stage stage("read");
+    Bitmap *bitmap = BmpReader::Read(input_filename_);
+    if (bitmap == nullptr) {
+        throw std::runtime_error("Could not read the input file");
     }
+    stage.SetPixels(static_cast<int64_t>(bitmap->GetWidth()) * bitmap->GetHeight());
     return bitmap;
 }
 
 Bitmap *Controller::ApplyFilters(Bitmap *bitmap) const {
-
-    if (filters_.empty()) {
-        return bitmap;
-    } else if (filters_.size() == 1) {
-        return filters_[0]->Apply(bitmap);
-    } else {
-        Bitmap *bitmap0;
-        bitmap = filters_[0]->Apply(bitmap);
-        for (size_t i = 1; i < filters_.size(); ++i) {
-            bitmap0 = filters_[i]->Apply(bitmap);
-            delete bitmap;
-            bitmap = bitmap0;
+    if (preview_level_ > 0) {
+        Bitmap *preview = nullptr;
+        {
+            Profiler::Stage stage("preview", static_cast<int64_t>(bitmap->GetWidth()) * bitmap->GetHeight());
+            std::unique_ptr<Bitmap> converted;
+            if (bitmap->GetFormat() != PixelFormat::Bgr) {
+                converted.reset(bitmap->Convert(PixelFormat::Bgr));
+            }
+            preview = Pyramid(converted != nullptr ? converted.get() : bitmap, pool_.get()).Release(preview_level_);
         }
+        if (filters_.empty()) {
+            return preview;
+        }
+        // A result cut out of the preview shares its pixels, which outlive the preview itself.
+        Bitmap *result = Pipeline(filters_, pool_.get(), cache_.get()).ApplyInPlace(preview);
+        if (result != preview) {
+            delete preview;
+        }
+        return result;
+    }
+    if (filters_.empty()) {
         return bitmap;
     }
+    return Pipeline(filters_, pool_.get(), cache_.get()).ApplyInPlace(bitmap);
 }
 
 void Controller::WriteFile(Bitmap *bitmap) const {
-    std::ofstream outstream;
-    try {
-        outstream.open(output_filename_, std::ios::out | std::ios::binary);
-        if (!outstream) {
-            throw std::runtime_error("Could not open the output file");
-        }
-        bitmap->Write(outstream);
-        outstream.close();
-    } catch (const std::exception &e) {
-        if (outstream.is_open()) {
-            outstream.close();
-        }
-        throw e;
+    Profiler::Stage stage("write", static_cast<int64_t>(bitmap->GetWidth()) * bitmap->GetHeight());
+    // The input may be the output, and still mapped.
+    OutputFile output(output_filename_);
+    BitmapFileHeader file_header = bitmap->GetFileHeader();
+    BitmapInfoHeader info_header = bitmap->GetInfoHeader();
+    Bitmap::SetFormat(file_header, info_header, output_format_);
+    BmpRowWriter writer(output.GetStream(), file_header, info_header);
+    writer.WriteRows(bitmap);
+    writer.Flush();
+    output.Commit();
+}
+
+void Controller::Stream() const {
+    Profiler::Stage stage("stream");
+    BmpRowReader reader(input_filename_);
+    stage.SetPixels(static_cast<int64_t>(reader.GetInfoHeader().biWidth) * reader.GetInfoHeader().biHeight);
+    OutputFile output(output_filename_);
+    StreamingPipeline(filters_, pool_.get()).Run(reader, output.GetStream(), output_format_);
+    output.Commit();
+}
+
+std::size_t Controller::ProcessBatch() const {
+    std::vector<std::string> inputs = BatchRunner::ListInputs(input_filename_);
+    BatchRunner runner(filters_, pool_.get(), streaming_, cache_.get(), output_format_);
+    return runner.Run(inputs, output_filename_, std::cout);
+}
+
+void Controller::EnableProfiling(std::unique_ptr<Profiler> profiler) {
+    profiler_ = std::move(profiler);
+    Profiler::SetActive(profiler_.get());
+}
+
+void Controller::FinishProfile() const {
+    if (profiler_ != nullptr) {
+        profiler_->Finish(std::cerr);
     }
-}
\ No newline at end of file
+}
+
+void Controller::Serve() const {
+    Server(socket_path_, pool_->GetThreadCount(), cache_.get()).Run();
+}
+
+void Controller::EnableCache(std::unique_ptr<ResultCache> cache) {
+    cache_ = std::move(cache);
+}
+
+void Controller::ReportCache() const {
+    if (cache_ != nullptr && !batch_) {
+        std::cerr << "cache: ";
+        cache_->Report(std::cerr);
+        std::cerr << std::endl;
+    }
+}
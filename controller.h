@@ -3,13 +3,20 @@
 #include <utility>
 #include <vector>
 #include <iostream>
+#include <memory>
 #include <optional>
 #include "filter.h"
+#include "profile.h"
+#include "result_cache.h"
+#include "thread_pool.h"
 
 class MyException : public std::exception {
 public:
     MyException(const char *message) : message_(message) {
-        std::cerr << message_;
+    }
+
+    const char *what() const noexcept override {
+        return message_.c_str();
     }
 
 protected:
@@ -19,18 +26,85 @@ protected:
 class Controller {
 public:
     Controller(){}
-    Controller(char *input_filename, char *output_filename, std::vector<Filter *> filters)
-            : input_filename_(input_filename), output_filename_(output_filename), filters_(std::move(filters)) {
+    Controller(char *input_filename, char *output_filename, std::vector<std::unique_ptr<Filter>> filters,
+               std::size_t thread_count = 1, bool streaming = false, bool batch = false)
+            : input_filename_(input_filename),
+              output_filename_(output_filename),
+              owned_filters_(std::move(filters)),
+              pool_(std::make_unique<ThreadPool>(thread_count)),
+              streaming_(streaming),
+              batch_(batch) {
+        for (const std::unique_ptr<Filter> &filter : owned_filters_) {
+            filters_.push_back(filter.get());
+        }
     }
 
     ~Controller();
-    static Controller* Parse(int argc, char **argv);
+    static std::unique_ptr<Controller> Parse(int argc, char **argv);
+    // The filters of a command line without the program name and the files, e.g. {"-blur", "2"}.
+    // With a preview scale, sizes and radii are divided by it to fit an image reduced as much.
+    static std::vector<std::unique_ptr<Filter>> ParseFilters(int argc, char **argv, std::int32_t preview_scale = 1);
     Bitmap* ReadFile() const;
     Bitmap* ApplyFilters(Bitmap* bitmap) const;
     void WriteFile(Bitmap* bitmap) const;
 
+    // With --stream the image is never held in memory as a whole: Stream() reads, filters and writes
+    // it strip by strip instead of ReadFile, ApplyFilters and WriteFile. A single image is also
+    // streamed without --stream when every filter streams and there is no --cache or --preview.
+    bool IsStreaming() const {
+        return streaming_;
+    }
+    void Stream() const;
+
+    // With --batch the input is a directory, glob pattern or manifest and the output a directory;
+    // ProcessBatch() runs the chain over every listed file. Returns the number of failed files.
+    bool IsBatch() const {
+        return batch_;
+    }
+    std::size_t ProcessBatch() const;
+
+    // With --serve SOCKET there are no files or filters on the command line: Serve() runs a
+    // Server on the socket with one worker per --threads until a client asks it to shut down.
+    bool IsServing() const {
+        return !socket_path_.empty();
+    }
+    void Serve() const;
+
+    // --profile text|json and --trace FILE install a profiler for the lifetime of the controller;
+    // FinishProfile() prints its report to stderr and writes the trace.
+    void EnableProfiling(std::unique_ptr<Profiler> profiler);
+    void FinishProfile() const;
+
+    // --cache DIR [--cache-size MB] keeps the results of the chain and of its prefixes in DIR, so
+    // that a later run on the same pixels skips what it shares with an earlier one. ReportCache()
+    // prints the hit and miss counts to stderr; a batch includes them in its own report instead.
+    void EnableCache(std::unique_ptr<ResultCache> cache);
+    void ReportCache() const;
+
+    // --preview SCALE, a power of two up to 128, runs the chain on the image reduced SCALE times in
+    // both directions by a Pyramid and writes the reduced result.
+    void EnablePreview(std::int32_t level) {
+        preview_level_ = level;
+    }
+
+    // --bpp 8|24|32 sets the bits per pixel of the output files, 24 by default; 8 writes a grey
+    // image with a palette, converting colour pixels to their grey value.
+    void SetOutputFormat(PixelFormat format) {
+        output_format_ = format;
+    }
+
 private:
     char *input_filename_;
     char *output_filename_;
+    std::vector<std::unique_ptr<Filter>> owned_filters_;
+    // The same filters, as Pipeline takes them.
     std::vector<Filter *> filters_;
+    std::unique_ptr<ThreadPool> pool_;
+    bool streaming_ = false;
+    bool batch_ = false;
+    std::unique_ptr<Profiler> profiler_;
+    std::unique_ptr<ResultCache> cache_;
+    std::string socket_path_;
+    std::int32_t preview_level_ = 0;
+    PixelFormat output_format_ = PixelFormat::Bgr;
 };
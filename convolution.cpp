@@ -0,0 +1,140 @@
+#include "convolution.h"
+#include <cmath>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+namespace convolution {
+namespace {
+
+// Sums of 16-bit integer taps over 8-bit channels stay within this bound.
+constexpr float kMaxIntegerSum = 32767.0f / 255.0f;
+
+// Relative tolerance of the rank-one test for kernels with fractional weights.
+constexpr float kSeparableTolerance = 1e-6f;
+
+bool IsIntegral(const std::vector<float> &values) {
+    return std::all_of(values.begin(), values.end(), [](float value) { return value == std::round(value); });
+}
+
+}  // namespace
+
+Kernel::Kernel(std::vector<float> weights, Border border, std::optional<int32_t> threshold)
+        : size_(SizeOf(weights.size())), border_(border), threshold_(threshold), weights_(std::move(weights)) {
+    if (size_ == 0) {
+        throw std::invalid_argument("convolution kernel must be a square of odd size");
+    }
+    bool integral = IsIntegral(weights_);
+
+    // Rank one test around the largest weight. Integral kernels are factored into integral
+    // vectors, so that both passes stay exact in float.
+    auto largest = std::max_element(weights_.begin(), weights_.end(),
+                                     [](float a, float b) { return std::abs(a) < std::abs(b); });
+    float pivot = *largest;
+    if (pivot != 0.0f) {
+        int32_t p = static_cast<int32_t>(largest - weights_.begin()) / size_;
+        int32_t q = static_cast<int32_t>(largest - weights_.begin()) % size_;
+        std::vector<float> column(size_);
+        std::vector<float> row(weights_.begin() + p * size_, weights_.begin() + (p + 1) * size_);
+        float divisor = pivot;
+        if (integral) {
+            int64_t common = 0;
+            for (float value : row) {
+                common = std::gcd(common, static_cast<int64_t>(value));
+            }
+            divisor = static_cast<float>(common);
+        }
+        for (float &value : row) {
+            value /= divisor;
+        }
+        for (int32_t y = 0; y < size_; ++y) {
+            column[y] = weights_[y * size_ + q] / row[q];
+        }
+        bool separable = true;
+        for (int32_t y = 0; y < size_ && separable; ++y) {
+            for (int32_t x = 0; x < size_ && separable; ++x) {
+                float error = std::abs(weights_[y * size_ + x] - column[y] * row[x]);
+                separable = integral ? error == 0.0f : error <= kSeparableTolerance * std::abs(pivot);
+            }
+        }
+        // A 3x3 integral kernel is cheaper as nine 16-bit taps than as two float passes.
+        if (separable && (size_ > 3 || !integral)) {
+            column_ = std::move(column);
+            row_ = std::move(row);
+        }
+    }
+
+    float magnitude = 0.0f;
+    for (float value : weights_) {
+        magnitude += std::abs(value);
+    }
+    if (!IsSeparable() && integral && magnitude <= kMaxIntegerSum) {
+        integer_weights_.assign(weights_.begin(), weights_.end());
+    }
+}
+
+Taps Kernel::GetTaps() const {
+    return {size_,
+            border_,
+            weights_.data(),
+            integer_weights_.empty() ? nullptr : integer_weights_.data(),
+            column_.empty() ? nullptr : column_.data(),
+            row_.empty() ? nullptr : row_.data(),
+            threshold_};
+}
+
+int32_t Kernel::SizeOf(std::size_t count) {
+    auto size = static_cast<int32_t>(std::lround(std::sqrt(static_cast<double>(count))));
+    if (size % 2 == 0 || size > kMaxSize || static_cast<std::size_t>(size) * size != count) {
+        return 0;
+    }
+    return size;
+}
+
+std::vector<float> Kernel::ParseWeights(std::string_view text) {
+    std::string cleaned;
+    bool comment = false;
+    for (char c : text) {
+        if (c == '#') {
+            comment = true;
+        } else if (c == '\n') {
+            comment = false;
+        }
+        cleaned += comment || c == ',' ? ' ' : c;
+    }
+
+    std::vector<float> weights;
+    std::istringstream tokens(cleaned);
+    std::string token;
+    while (tokens >> token) {
+        char *end = nullptr;
+        double value = std::strtod(token.c_str(), &end);
+        if (end != token.c_str() && *end == '/') {
+            const char *denominator = end + 1;
+            double divisor = std::strtod(denominator, &end);
+            if (end == denominator || divisor == 0.0) {
+                throw std::runtime_error("wrong weight " + token + " in convolution kernel");
+            }
+            value /= divisor;
+        }
+        if (end == token.c_str() || *end != '\0' || !std::isfinite(value)) {
+            throw std::runtime_error("wrong weight " + token + " in convolution kernel");
+        }
+        weights.push_back(static_cast<float>(value));
+    }
+    return weights;
+}
+
+std::vector<float> Kernel::ReadWeights(const char *path) {
+    std::ifstream instream(path);
+    if (!instream) {
+        throw std::runtime_error("Could not open the kernel file");
+    }
+    std::stringstream text;
+    text << instream.rdbuf();
+    return ParseWeights(text.str());
+}
+
+}  // namespace convolution
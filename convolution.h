@@ -0,0 +1,97 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace convolution {
+
+constexpr int32_t kMaxSize = 31;
+
+// How pixels outside the image are taken: the nearest edge pixel, the pixel mirrored about the
+// edge pixel, or the pixel from the opposite side.
+enum class Border { Clamp, Mirror, Wrap };
+
+template <Border border>
+constexpr int32_t BorderIndex(int32_t i, int32_t count) {
+    if constexpr (border == Border::Wrap) {
+        i %= count;
+        return i < 0 ? i + count : i;
+    }
+    if constexpr (border == Border::Mirror) {
+        i = i < 0 ? -i : i;
+        i = i >= count ? 2 * (count - 1) - i : i;
+    }
+    return std::clamp(i, 0, count - 1);
+}
+
+constexpr int32_t BorderIndex(Border border, int32_t i, int32_t count) {
+    switch (border) {
+        case Border::Mirror:
+            return BorderIndex<Border::Mirror>(i, count);
+        case Border::Wrap:
+            return BorderIndex<Border::Wrap>(i, count);
+        default:
+            return BorderIndex<Border::Clamp>(i, count);
+    }
+}
+
+// What the row kernels need to know about a kernel. Exactly one evaluation is selected:
+// two 1-D float passes when `column` is set, 16-bit integer taps when `integer_weights` is set,
+// float taps otherwise.
+struct Taps {
+    int32_t size;
+    Border border;
+    // size * size weights in row-major order; the centre is at (size / 2, size / 2).
+    const float *weights;
+    // The weights as integers, set when they are integral and small enough for 16-bit sums.
+    const std::int16_t *integer_weights;
+    // Factors of a separable kernel: weights[y * size + x] == column[y] * row[x].
+    const float *column;
+    const float *row;
+    // Without a threshold a channel becomes its sum rounded and clamped to 0..255; with one it
+    // becomes 255 where the rounded sum exceeds the threshold and 0 elsewhere.
+    std::optional<int32_t> threshold;
+};
+
+// A square kernel of odd size and everything derived from it for the row kernels.
+class Kernel {
+public:
+    Kernel(std::vector<float> weights, Border border, std::optional<int32_t> threshold = std::nullopt);
+
+    int32_t GetSize() const {
+        return size_;
+    }
+
+    Border GetBorder() const {
+        return border_;
+    }
+
+    bool IsSeparable() const {
+        return !column_.empty();
+    }
+
+    Taps GetTaps() const;
+
+    // The side of a square kernel with `count` weights, or 0 if there is none of an odd size up to kMaxSize.
+    static int32_t SizeOf(std::size_t count);
+
+    // Weights separated by commas or whitespace, each a number or a fraction such as 1/16;
+    // '#' starts a comment that runs to the end of the line. Throws std::runtime_error.
+    static std::vector<float> ParseWeights(std::string_view text);
+
+    static std::vector<float> ReadWeights(const char *path);
+
+private:
+    int32_t size_;
+    Border border_;
+    std::optional<int32_t> threshold_;
+    std::vector<float> weights_;
+    std::vector<std::int16_t> integer_weights_;
+    std::vector<float> column_;
+    std::vector<float> row_;
+};
+
+}  // namespace convolution
@@ -0,0 +1,410 @@
+#pragma once
+
+// Row kernels of the convolution filter. This header is included by each of kernels.cpp,
+// kernels_sse2.cpp and kernels_avx2.cpp, so that the same loops are compiled once per instruction
+// set; everything is in an unnamed namespace to keep the copies apart. The border mode only
+// affects the few pixels at the row ends. The interior adds up the taps one at a time, each as a
+// plain loop over the bytes of a row that the compiler vectorizes; the SSE2 and AVX2 copies run
+// integer kernels of 3x3, 5x5 and 7x7 in explicit 16-bit lanes instead.
+
+#include "bitmap.h"
+#include "convolution.h"
+#include <algorithm>
+#include <cmath>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CONVOLUTION_ROWS_VECTOR
+#elif defined(CONVOLUTION_ROWS_SSE2)
+#include <emmintrin.h>
+#define CONVOLUTION_ROWS_VECTOR
+#endif
+
+namespace kernels {
+namespace {
+
+namespace conv {
+
+using convolution::Border;
+using convolution::Taps;
+
+inline std::uint8_t Finish(float sum, const Taps &taps) {
+    float rounded = std::floor(sum + 0.5f);
+    if (taps.threshold) {
+        return rounded > static_cast<float>(*taps.threshold) ? 255 : 0;
+    }
+    return static_cast<std::uint8_t>(std::clamp(rounded, 0.0f, 255.0f));
+}
+
+// Finish over bytes [begin, end) of a row of sums, written as selects so that it vectorizes.
+template <bool threshold>
+void FinishRow(const float *sums, std::uint8_t *out, int32_t begin, int32_t end, const Taps &taps) {
+    if constexpr (threshold) {
+        const float limit = static_cast<float>(*taps.threshold) + 1.0f;
+        for (int32_t b = begin; b < end; ++b) {
+            out[b] = sums[b] + 0.5f >= limit ? 255 : 0;
+        }
+    } else {
+        for (int32_t b = begin; b < end; ++b) {
+            float rounded = sums[b] + 0.5f;
+            out[b] = rounded < 0.0f ? 0 : rounded >= 255.0f ? 255 : static_cast<std::uint8_t>(rounded);
+        }
+    }
+}
+
+// Adds `weight` times the bytes [begin, end) of `src` to the sums.
+inline void Accumulate(const std::uint8_t *src, float weight, float *sums, int32_t begin, int32_t end) {
+    for (int32_t b = begin; b < end; ++b) {
+        sums[b] += weight * src[b];
+    }
+}
+
+// The pixels whose taps leave the row: [0, radius) and [width - radius, width). The taps read
+// `sample(y, column, channel)`, which hides whether rows or column sums are read.
+template <Border border, class Sample>
+void BorderPixels(const Taps &taps, int32_t size, std::uint8_t *out, int32_t width, bool separable, Sample sample) {
+    int32_t radius = size / 2;
+    auto pixel = [&](int32_t j) {
+        for (int32_t channel = 0; channel < 3; ++channel) {
+            float sum = 0.0f;
+            for (int32_t y = 0; y < (separable ? 1 : size); ++y) {
+                for (int32_t x = 0; x < size; ++x) {
+                    float weight = separable ? taps.row[x] : taps.weights[y * size + x];
+                    sum += weight * sample(y, convolution::BorderIndex<border>(j + x - radius, width), channel);
+                }
+            }
+            out[3 * j + channel] = Finish(sum, taps);
+        }
+    };
+    int32_t left = std::min(radius, width);
+    for (int32_t j = 0; j < left; ++j) {
+        pixel(j);
+    }
+    for (int32_t j = std::max(left, width - radius); j < width; ++j) {
+        pixel(j);
+    }
+}
+
+#ifdef CONVOLUTION_ROWS_VECTOR
+// The 16-bit lane operations of the integer interior: AVX2 in kernels_avx2.cpp, SSE2 in
+// kernels_sse2.cpp, which defines CONVOLUTION_ROWS_SSE2 before including this header.
+struct Lanes {
+#ifdef __AVX2__
+    using Vector = __m256i;
+
+    static Vector Load(const std::uint8_t *p) {
+        return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    }
+
+    static void Store(std::uint8_t *p, Vector v) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), v);
+    }
+
+    static Vector Zero() {
+        return _mm256_setzero_si256();
+    }
+
+    static Vector Set(std::int16_t value) {
+        return _mm256_set1_epi16(value);
+    }
+
+    static Vector Low(Vector v, Vector zero) {
+        return _mm256_unpacklo_epi8(v, zero);
+    }
+
+    static Vector High(Vector v, Vector zero) {
+        return _mm256_unpackhi_epi8(v, zero);
+    }
+
+    static Vector Add(Vector a, Vector b) {
+        return _mm256_add_epi16(a, b);
+    }
+
+    static Vector Sub(Vector a, Vector b) {
+        return _mm256_sub_epi16(a, b);
+    }
+
+    static Vector Mul(Vector a, Vector b) {
+        return _mm256_mullo_epi16(a, b);
+    }
+
+    static Vector Greater(Vector a, Vector b) {
+        return _mm256_cmpgt_epi16(a, b);
+    }
+
+    static Vector Pack(Vector a, Vector b) {
+        return _mm256_packs_epi16(a, b);
+    }
+
+    static Vector PackUnsigned(Vector a, Vector b) {
+        return _mm256_packus_epi16(a, b);
+    }
+#else
+    using Vector = __m128i;
+
+    static Vector Load(const std::uint8_t *p) {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    }
+
+    static void Store(std::uint8_t *p, Vector v) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(p), v);
+    }
+
+    static Vector Zero() {
+        return _mm_setzero_si128();
+    }
+
+    static Vector Set(std::int16_t value) {
+        return _mm_set1_epi16(value);
+    }
+
+    static Vector Low(Vector v, Vector zero) {
+        return _mm_unpacklo_epi8(v, zero);
+    }
+
+    static Vector High(Vector v, Vector zero) {
+        return _mm_unpackhi_epi8(v, zero);
+    }
+
+    static Vector Add(Vector a, Vector b) {
+        return _mm_add_epi16(a, b);
+    }
+
+    static Vector Sub(Vector a, Vector b) {
+        return _mm_sub_epi16(a, b);
+    }
+
+    static Vector Mul(Vector a, Vector b) {
+        return _mm_mullo_epi16(a, b);
+    }
+
+    static Vector Greater(Vector a, Vector b) {
+        return _mm_cmpgt_epi16(a, b);
+    }
+
+    static Vector Pack(Vector a, Vector b) {
+        return _mm_packs_epi16(a, b);
+    }
+
+    static Vector PackUnsigned(Vector a, Vector b) {
+        return _mm_packus_epi16(a, b);
+    }
+#endif
+
+    static constexpr int32_t kBytes = sizeof(Vector);
+};
+
+// The integer interior of a kernel of a known size, one vector of bytes per step with the sums
+// in two registers. The taps are sorted first: taps of 1 are added and taps of -1 subtracted
+// without multiplying, and zero taps are dropped, which the generic loop cannot do. Unpacking and
+// packing both work within 128-bit lanes, so the byte order is restored. Returns the first byte
+// not done.
+template <int32_t size, bool threshold>
+int32_t InteriorVector(const std::uint8_t *const *rows, const std::int16_t *weights, std::uint8_t *out,
+                       int32_t begin, int32_t end, std::int16_t limit) {
+    using Vector = Lanes::Vector;
+    constexpr int32_t radius = size / 2;
+    // Sources of the taps, the added ones from the front and the subtracted ones from the back;
+    // the multiplied ones have their own list.
+    const std::uint8_t *signed_sources[size * size];
+    const std::uint8_t *scaled_sources[size * size];
+    Vector factors[size * size];
+    int32_t added = 0;
+    int32_t subtracted = size * size;
+    int32_t scaled = 0;
+    for (int32_t y = 0; y < size; ++y) {
+        for (int32_t x = 0; x < size; ++x) {
+            const std::int16_t weight = weights[y * size + x];
+            const std::uint8_t *source = rows[y] + 3 * (x - radius);
+            if (weight == 1) {
+                signed_sources[added++] = source;
+            } else if (weight == -1) {
+                signed_sources[--subtracted] = source;
+            } else if (weight != 0) {
+                scaled_sources[scaled] = source;
+                factors[scaled++] = Lanes::Set(weight);
+            }
+        }
+    }
+    const Vector zero = Lanes::Zero();
+    const Vector limits = Lanes::Set(limit);
+    int32_t b = begin;
+    for (; b + Lanes::kBytes <= end; b += Lanes::kBytes) {
+        Vector low = zero;
+        Vector high = zero;
+        for (int32_t t = 0; t < scaled; ++t) {
+            Vector bytes = Lanes::Load(scaled_sources[t] + b);
+            low = Lanes::Add(low, Lanes::Mul(Lanes::Low(bytes, zero), factors[t]));
+            high = Lanes::Add(high, Lanes::Mul(Lanes::High(bytes, zero), factors[t]));
+        }
+        for (int32_t t = 0; t < added; ++t) {
+            Vector bytes = Lanes::Load(signed_sources[t] + b);
+            low = Lanes::Add(low, Lanes::Low(bytes, zero));
+            high = Lanes::Add(high, Lanes::High(bytes, zero));
+        }
+        for (int32_t t = subtracted; t < size * size; ++t) {
+            Vector bytes = Lanes::Load(signed_sources[t] + b);
+            low = Lanes::Sub(low, Lanes::Low(bytes, zero));
+            high = Lanes::Sub(high, Lanes::High(bytes, zero));
+        }
+        if constexpr (threshold) {
+            Lanes::Store(out + b, Lanes::Pack(Lanes::Greater(low, limits), Lanes::Greater(high, limits)));
+        } else {
+            Lanes::Store(out + b, Lanes::PackUnsigned(low, high));
+        }
+    }
+    return b;
+}
+#endif
+
+// The integer interior of a kernel of a known size byte by byte, with the taps unrolled into the
+// loop over bytes; the weights and row pointers are copied first, since stores to `out` could
+// alias them otherwise.
+template <int32_t size, bool threshold>
+void InteriorUnrolled(const std::uint8_t *const *rows, const std::int16_t *weights, std::uint8_t *out,
+                      int32_t begin, int32_t end, std::int16_t limit) {
+    constexpr int32_t radius = size / 2;
+    std::int16_t taps[size * size];
+    const std::uint8_t *sources[size];
+    std::copy(weights, weights + size * size, taps);
+    std::copy(rows, rows + size, sources);
+    for (int32_t b = begin; b < end; ++b) {
+        std::int16_t sum = 0;
+        for (int32_t y = 0; y < size; ++y) {
+            for (int32_t x = 0; x < size; ++x) {
+                sum = static_cast<std::int16_t>(sum + taps[y * size + x] * sources[y][b + 3 * (x - radius)]);
+            }
+        }
+        if constexpr (threshold) {
+            out[b] = sum > limit ? 255 : 0;
+        } else {
+            out[b] = static_cast<std::uint8_t>(std::min<std::int16_t>(std::max<std::int16_t>(sum, 0), 255));
+        }
+    }
+}
+
+// Interior bytes [begin, end). Small integer kernels of a known size use 16-bit sums; otherwise
+// every nonzero tap adds its weighted source row to the float sums, which stay in cache between
+// the taps.
+template <int32_t fixed_size, bool threshold>
+void Interior(const std::uint8_t *const *rows, const Taps &taps, int32_t size, std::uint8_t *out, int32_t begin,
+              int32_t end, float *sums) {
+    constexpr int32_t kUnknown = 0;
+    if constexpr (fixed_size != kUnknown) {
+        if (taps.integer_weights != nullptr) {
+            auto limit = static_cast<std::int16_t>(threshold ? std::clamp(*taps.threshold, -32768, 32767) : 0);
+#ifdef CONVOLUTION_ROWS_VECTOR
+            begin = InteriorVector<fixed_size, threshold>(rows, taps.integer_weights, out, begin, end, limit);
+#endif
+            // Beyond 5x5 the unrolled taps no longer vectorize, and the float rows below are faster.
+            if constexpr (fixed_size <= 5) {
+                InteriorUnrolled<fixed_size, threshold>(rows, taps.integer_weights, out, begin, end, limit);
+                return;
+            }
+        }
+    }
+    const int32_t radius = size / 2;
+    std::fill(sums + begin, sums + end, 0.0f);
+    for (int32_t y = 0; y < size; ++y) {
+        for (int32_t x = 0; x < size; ++x) {
+            const float weight = taps.weights[y * size + x];
+            if (weight != 0.0f) {
+                Accumulate(rows[y] + 3 * (x - radius), weight, sums, begin, end);
+            }
+        }
+    }
+    FinishRow<threshold>(sums, out, begin, end, taps);
+}
+
+// Vertical pass into per-byte column sums, then the horizontal pass over those into the second
+// half of `sums`.
+template <int32_t fixed_size, Border border, bool threshold>
+void Separable(const std::uint8_t *const *rows, const Taps &taps, std::uint8_t *out, int32_t width, float *sums) {
+    constexpr int32_t kUnknown = 0;
+    const int32_t size = fixed_size != kUnknown ? fixed_size : taps.size;
+    const int32_t radius = size / 2;
+    const int32_t bytes = 3 * width;
+    std::fill(sums, sums + bytes, 0.0f);
+    for (int32_t y = 0; y < size; ++y) {
+        if (taps.column[y] != 0.0f) {
+            Accumulate(rows[y], taps.column[y], sums, 0, bytes);
+        }
+    }
+
+    const int32_t begin = 3 * radius;
+    const int32_t end = std::max(begin, 3 * (width - radius));
+    float *row_sums = sums + bytes;
+    std::fill(row_sums + begin, row_sums + end, 0.0f);
+    for (int32_t x = 0; x < size; ++x) {
+        const float weight = taps.row[x];
+        const float *src = sums + 3 * (x - radius);
+        for (int32_t b = begin; b < end; ++b) {
+            row_sums[b] += weight * src[b];
+        }
+    }
+    FinishRow<threshold>(row_sums, out, begin, end, taps);
+    BorderPixels<border>(taps, size, out, width, true,
+                         [&](int32_t, int32_t j, int32_t channel) { return sums[3 * j + channel]; });
+}
+
+template <int32_t fixed_size, Border border, bool threshold>
+void ConvolveRow(const std::uint8_t *const *rows, const Taps &taps, std::uint8_t *out, int32_t width, float *sums) {
+    constexpr int32_t kUnknown = 0;
+    const int32_t size = fixed_size != kUnknown ? fixed_size : taps.size;
+    if (taps.column != nullptr) {
+        Separable<fixed_size, border, threshold>(rows, taps, out, width, sums);
+        return;
+    }
+    const int32_t radius = size / 2;
+    if (width > 2 * radius) {
+        Interior<fixed_size, threshold>(rows, taps, size, out, 3 * radius, 3 * (width - radius), sums);
+    }
+    BorderPixels<border>(taps, size, out, width, false,
+                         [&](int32_t y, int32_t j, int32_t channel) { return rows[y][3 * j + channel]; });
+}
+
+template <int32_t fixed_size, Border border>
+void ConvolveSized(const std::uint8_t *const *rows, const Taps &taps, std::uint8_t *out, int32_t width, float *sums) {
+    if (taps.threshold) {
+        ConvolveRow<fixed_size, border, true>(rows, taps, out, width, sums);
+    } else {
+        ConvolveRow<fixed_size, border, false>(rows, taps, out, width, sums);
+    }
+}
+
+template <Border border>
+void ConvolveBordered(const std::uint8_t *const *rows, const Taps &taps, std::uint8_t *out, int32_t width,
+                      float *sums) {
+    switch (taps.size) {
+        case 3:
+            ConvolveSized<3, border>(rows, taps, out, width, sums);
+            break;
+        case 5:
+            ConvolveSized<5, border>(rows, taps, out, width, sums);
+            break;
+        case 7:
+            ConvolveSized<7, border>(rows, taps, out, width, sums);
+            break;
+        default:
+            ConvolveSized<0, border>(rows, taps, out, width, sums);
+    }
+}
+
+}  // namespace conv
+
+void Convolve(const Color *const *rows, const convolution::Taps &taps, Color *dst, int32_t width, float *sums) {
+    const auto *const *bytes = reinterpret_cast<const std::uint8_t *const *>(rows);
+    auto *out = reinterpret_cast<std::uint8_t *>(dst);
+    switch (taps.border) {
+        case convolution::Border::Mirror:
+            conv::ConvolveBordered<convolution::Border::Mirror>(bytes, taps, out, width, sums);
+            break;
+        case convolution::Border::Wrap:
+            conv::ConvolveBordered<convolution::Border::Wrap>(bytes, taps, out, width, sums);
+            break;
+        default:
+            conv::ConvolveBordered<convolution::Border::Clamp>(bytes, taps, out, width, sums);
+    }
+}
+
+}  // namespace
+}  // namespace kernels
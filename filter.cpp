@@ -1,14 +1,92 @@
 #include "filter.h"
+#include "blur.h"
+#include "integral.h"
+#include "kernels.h"
+#include "pipeline.h"
+#include "pyramid.h"
+#include "thread_pool.h"
+#include "voronoi.h"
+#include <algorithm>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <random>
 #include <limits>
+#include <memory>
+#include <mutex>
 
-void Crop::UpdateSize(BitmapFileHeader &file_header, BitmapInfoHeader &info_header) {
-    file_header.bfSize = sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader) + width_ * height_ * sizeof(Color);
+namespace {
+
+// Hexadecimal floating point, so that the key changes with every bit of the value.
+std::string ExactNumber(double value) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%a", value);
+    return buffer;
+}
+
+// Colour and position sums of the pixels of one Voronoi cell.
+struct CellSums {
+    std::uint64_t blue = 0;
+    std::uint64_t green = 0;
+    std::uint64_t red = 0;
+    std::uint64_t row = 0;
+    std::uint64_t column = 0;
+    std::uint64_t count = 0;
+};
+
+// sum / count rounded to nearest.
+std::int32_t RoundedMean(std::uint64_t sum, std::uint64_t count) {
+    return static_cast<std::int32_t>((2 * sum + count) / (2 * count));
+}
+
+// Calls visit(i, left, count, nearest) for every row i in [begin, end), one tile of the grid at a time,
+// where nearest[k] is the point nearest to pixel (i, left + k): the lowest index among equally near
+// ones, and 0 for a tile without candidates. The kernel compares one point against a whole tile row.
+template <typename Visit>
+void AssignRows(const voronoi::SeedGrid &grid, const std::vector<voronoi::Point> &points, int32_t begin, int32_t end,
+                int32_t width, Visit &&visit) {
+    const Kernels &kernels = GetKernels();
+    int32_t cell_size = grid.GetCellSize();
+    std::vector<std::uint32_t> candidates;
+    std::vector<int32_t> distance(cell_size);
+    std::vector<std::uint32_t> nearest(cell_size);
+    for (int32_t row = begin / cell_size; row * cell_size < end; ++row) {
+        int32_t top = std::max(begin, row * cell_size);
+        int32_t bottom = std::min(end, (row + 1) * cell_size);
+        for (int32_t column = 0; column < grid.GetColumns(); ++column) {
+            grid.Candidates(row, column, candidates);
+            int32_t left = column * cell_size;
+            int32_t count = std::min(width, left + cell_size) - left;
+            for (int32_t i = top; i < bottom; ++i) {
+                std::fill_n(distance.begin(), count, std::numeric_limits<int32_t>::max());
+                std::fill_n(nearest.begin(), count, 0u);
+                for (std::uint32_t candidate : candidates) {
+                    int32_t dy = i - points[candidate].first;
+                    kernels.nearest(dy * dy, points[candidate].second, left, count, candidate, distance.data(),
+                                    nearest.data());
+                }
+                visit(i, left, count, nearest.data());
+            }
+        }
+    }
+}
+
+}  // namespace
+
+void Crop::UpdateSize(BitmapFileHeader &file_header, BitmapInfoHeader &info_header) const {
+    PixelFormat format = Bitmap::FormatOf(info_header);
+    std::size_t palette_size = format == PixelFormat::Gray ? Bitmap::kPaletteSize : 0;
     info_header.biHeight = height_;
     info_header.biWidth = width_;
-    info_header.biSizeImage = height_ * (((width_ * sizeof(Color) + 3) / 4) * 4);
-    file_header.bfSize = sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader) + info_header.biSizeImage;
+    info_header.biSizeImage = height_ * Bitmap::PaddedRowSize(width_, format);
+    file_header.bfSize = sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader) + palette_size + info_header.biSizeImage;
+}
+
+Crop Crop::Fit(int32_t height, int32_t width) const {
+    if (height_ > height || width_ > width || height_ < 0 || width_ < 0) {
+        return Crop(width, height);
+    }
+    return *this;
 }
 
 Bitmap *Crop::Apply(const Bitmap *bitmap) {
@@ -16,216 +94,583 @@ Bitmap *Crop::Apply(const Bitmap *bitmap) {
     int32_t width = bitmap->GetWidth();
     BitmapFileHeader file_header = bitmap->GetFileHeader();
     BitmapInfoHeader info_header = bitmap->GetInfoHeader();
-    if (height_ > height || width_ > width || height_ < 0 || width_ < 0) {
-        height_ = height;
-        width_ = width;
-    }
-    UpdateSize(file_header, info_header);
-    std::vector<std::vector<Color>> data(height_, std::vector<Color>(width_));
-    for (size_t i = 0; i < static_cast<size_t>(height_); ++i) {
-        for (size_t j = 0; j < static_cast<size_t>(width_); ++j) {
-            data[i][j] = bitmap->GetData(height - height_ + i, j);
-        }
+    Crop crop = Fit(height, width);
+    crop.UpdateSize(file_header, info_header);
+    Bitmap *result = new Bitmap(file_header, info_header);
+    for (size_t i = 0; i < static_cast<size_t>(crop.height_); ++i) {
+        std::memcpy(result->GetRow(i), bitmap->GetRow(height - crop.height_ + i),
+                    crop.width_ * Bitmap::PixelSize(bitmap->GetFormat()));
     }
-    return new Bitmap(file_header, info_header, data);
+    return result;
 }
 
-Bitmap *Grayscale::Apply(const Bitmap *bitmap) {
+Bitmap *Crop::View(Bitmap *bitmap) const {
     BitmapFileHeader file_header = bitmap->GetFileHeader();
     BitmapInfoHeader info_header = bitmap->GetInfoHeader();
-    size_t height = static_cast<size_t>(bitmap->GetHeight());
-    size_t width = static_cast<size_t>(bitmap->GetWidth());
-    std::vector<std::vector<Color>> data(height, std::vector<Color>(width));
-    for (size_t i = 0; i < height; ++i) {
-        for (size_t j = 0; j < width; ++j) {
-            Color pixel = bitmap->GetData(i, j);
-            std::uint32_t grey = 0.299 * pixel.red + 0.587 * pixel.green + 0.114 * pixel.blue;
-            data[i][j].red = grey;
-            data[i][j].blue = grey;
-            data[i][j].green = grey;
-        }
+    Crop crop = Fit(bitmap->GetHeight(), bitmap->GetWidth());
+    crop.UpdateSize(file_header, info_header);
+    auto *first_row = reinterpret_cast<std::uint8_t *>(bitmap->GetRow(bitmap->GetHeight() - crop.height_));
+    return new Bitmap(file_header, info_header, std::shared_ptr<std::uint8_t>(bitmap->GetBuffer(), first_row),
+                      bitmap->GetRowStride());
+}
+
+std::string Crop::GetKey() const {
+    return "crop " + std::to_string(height_) + " " + std::to_string(width_);
+}
+
+Region Crop::GetInputRegion(const Region &output, int32_t height, int32_t width) const {
+    int32_t offset = height - Fit(height, width).height_;
+    return {output.top + offset, output.bottom + offset, output.left, output.right};
+}
+
+Region Filter::GetInputRegion(const Region &, int32_t height, int32_t width) const {
+    return {0, height, 0, width};
+}
+
+Bitmap *Filter::Apply(const Bitmap *bitmap, ThreadPool *) {
+    return Apply(bitmap);
+}
+
+bool Filter::ApplyInPlace(Bitmap *, ThreadPool *) {
+    return false;
+}
+
+bool Filter::MakesGray() const {
+    return false;
+}
+
+bool Filter::KeepsGray() const {
+    return false;
+}
+
+Bitmap *PixelFilter::Apply(const Bitmap *bitmap) {
+    return Apply(bitmap, nullptr);
+}
+
+Bitmap *PixelFilter::Apply(const Bitmap *bitmap, ThreadPool *pool) {
+    return Pipeline({this}, pool).Apply(bitmap);
+}
+
+Region PixelFilter::GetInputRegion(const Region &output, int32_t, int32_t) const {
+    return output;
+}
+
+Bitmap *NeighbourhoodFilter::Apply(const Bitmap *bitmap) {
+    return Apply(bitmap, nullptr);
+}
+
+Bitmap *NeighbourhoodFilter::Apply(const Bitmap *bitmap, ThreadPool *pool) {
+    return Pipeline({this}, pool).Apply(bitmap);
+}
+
+Region NeighbourhoodFilter::GetInputRegion(const Region &output, int32_t height, int32_t width) const {
+    if (!IsWindowed()) {
+        return Filter::GetInputRegion(output, height, width);
     }
-    return new Bitmap(file_header, info_header, data);
+    int32_t radius = GetRadius();
+    return {std::max(0, output.top - radius), std::min(height, output.bottom + radius),
+            std::max(0, output.left - radius), std::min(width, output.right + radius)};
 }
 
-Bitmap *Negative::Apply(const Bitmap *bitmap) {
-    BitmapFileHeader file_header = bitmap->GetFileHeader();
-    BitmapInfoHeader info_header = bitmap->GetInfoHeader();
-    size_t height = static_cast<size_t>(bitmap->GetHeight());
-    size_t width = static_cast<size_t>(bitmap->GetWidth());
-    std::vector<std::vector<Color>> data(height, std::vector<Color>(width));
-    for (size_t i = 0; i < height; ++i) {
-        for (size_t j = 0; j < width; ++j) {
-            Color pixel = bitmap->GetData(i, j);
-            data[i][j].red = 255 - pixel.red;
-            data[i][j].blue = 255 - pixel.blue;
-            data[i][j].green = 255 - pixel.green;
-        }
+bool NeighbourhoodFilter::IsWindowed() const {
+    return true;
+}
+
+int32_t NeighbourhoodFilter::GetScratchWidth(int32_t width) const {
+    return width;
+}
+
+void NeighbourhoodFilter::PrepareRow(const Color *src, Color *dst, int32_t width) const {
+    std::memcpy(dst, src, width * sizeof(Color));
+}
+
+int32_t NeighbourhoodFilter::MapRow(int32_t i, int32_t height) const {
+    return std::max(0, std::min(height - 1, i));
+}
+
+std::string Grayscale::GetKey() const {
+    return "gs";
+}
+
+void Grayscale::ApplyRow(const Color *src, Color *dst, int32_t width) const {
+    GetKernels().grayscale(src, dst, width);
+}
+
+void Grayscale::Compile(point::Lut &lut) const {
+    lut.Grey();
+}
+
+std::string Negative::GetKey() const {
+    return "neg";
+}
+
+void Negative::ApplyRow(const Color *src, Color *dst, int32_t width) const {
+    GetKernels().negative(src, dst, width);
+}
+
+void Negative::Compile(point::Lut &lut) const {
+    lut.Map(point::kInvert);
+}
+
+ChannelMap::ChannelMap(const point::Table &table) : table_(table) {
+    lut_.Map(table_);
+}
+
+std::string ChannelMap::GetKey() const {
+    static constexpr char kDigits[] = "0123456789abcdef";
+    std::string key = "map ";
+    for (std::uint8_t value : table_) {
+        key += kDigits[value >> 4];
+        key += kDigits[value & 15];
     }
-    return new Bitmap(file_header, info_header, data);
+    return key;
 }
 
-Bitmap *Sharpening::Apply(const Bitmap *bitmap) {
-    BitmapFileHeader file_header = bitmap->GetFileHeader();
-    BitmapInfoHeader info_header = bitmap->GetInfoHeader();
+void ChannelMap::ApplyRow(const Color *src, Color *dst, int32_t width) const {
+    lut_.ApplyRow(src, dst, width);
+}
+
+void ChannelMap::Compile(point::Lut &lut) const {
+    lut.Map(table_);
+}
+
+BrightnessContrast::BrightnessContrast(int32_t brightness, double contrast)
+        : ChannelMap(point::MakeTable([=](int32_t value) {
+              return static_cast<int32_t>(std::lround((value - 128) * contrast + 128 + brightness));
+          })) {
+}
+
+Gamma::Gamma(double gamma) : Levels(0, 255, gamma) {
+}
+
+Levels::Levels(int32_t black, int32_t white, double gamma)
+        : ChannelMap(point::MakeTable([=](int32_t value) {
+              double level = std::clamp(static_cast<double>(value - black) / (white - black), 0.0, 1.0);
+              return static_cast<int32_t>(std::lround(255 * std::pow(level, 1 / gamma)));
+          })) {
+}
+
+Threshold::Threshold(int32_t level)
+        : ChannelMap(point::MakeTable([=](int32_t value) { return value >= level ? 255 : 0; })) {
+}
+
+Posterize::Posterize(int32_t levels)
+        : ChannelMap(point::MakeTable([=](int32_t value) {
+              int32_t step = (value * (levels - 1) + 127) / 255;
+              return (step * 255 + (levels - 1) / 2) / (levels - 1);
+          })) {
+}
+
+Bitmap *Convolution::Apply(const Bitmap *bitmap, ThreadPool *pool) {
+    if (IsWindowed()) {
+        return NeighbourhoodFilter::Apply(bitmap, pool);
+    }
     int32_t height = bitmap->GetHeight();
     int32_t width = bitmap->GetWidth();
-    std::vector<std::vector<Color>> data(height, std::vector<Color>(width));
-    std::vector<std::vector<Color>> buffer(3, std::vector<Color>(3));
-    for (int32_t i = 0; i < height; ++i) {
-        for (int32_t j = 0; j < width; ++j) {
-            for (int32_t i0 = 0; i0 < 3; ++i0) {
-                for (int32_t j0 = 0; j0 < 3; ++j0) {
-                    buffer[i0][j0] = bitmap->GetData(std::max(0, std::min(height - 1, i + i0 - 1)),
-                                                     std::max(0, std::min(width - 1, j + j0 - 1)));
-                }
+    int32_t size = kernel_.GetSize();
+    std::unique_ptr<Bitmap> prepared(new Bitmap(bitmap->GetFileHeader(), bitmap->GetInfoHeader()));
+    Bitmap *result = new Bitmap(bitmap->GetFileHeader(), bitmap->GetInfoHeader());
+    RowBands(height, pool).Run([&](int32_t begin, int32_t end) {
+        for (int32_t i = begin; i < end; ++i) {
+            PrepareRow(bitmap->GetRow(i), prepared->GetRow(i), width);
+        }
+    });
+    RowBands(height, pool).Run([&](int32_t begin, int32_t end) {
+        std::vector<const Color *> rows(size);
+        std::vector<Color> scratch(GetScratchWidth(width));
+        for (int32_t i = begin; i < end; ++i) {
+            for (int32_t k = 0; k < size; ++k) {
+                rows[k] = prepared->GetRow(MapRow(i - size / 2 + k, height));
             }
-            int32_t red =
-                    5 * buffer[1][1].red - buffer[0][1].red - buffer[1][0].red - buffer[1][2].red - buffer[2][1].red;
-            data[i][j].red = std::min(255, std::max(0, red));
-            int32_t green = 5 * buffer[1][1].green - buffer[0][1].green - buffer[1][0].green - buffer[1][2].green -
-                            buffer[2][1].green;
-            data[i][j].green = std::min(255, std::max(0, green));
-            int32_t blue =
-                    5 * buffer[1][1].blue - buffer[0][1].blue - buffer[1][0].blue - buffer[1][2].blue - buffer[2][1].blue;
-            data[i][j].blue = std::min(255, std::max(0, blue));
+            ApplyRow(rows.data(), result->GetRow(i), scratch.data(), width);
         }
+    });
+    return result;
+}
+
+std::string Convolution::GetKey() const {
+    convolution::Taps taps = kernel_.GetTaps();
+    std::string key = GetName();
+    key += ' ';
+    key += std::to_string(static_cast<int32_t>(taps.border));
+    if (taps.threshold.has_value()) {
+        key += " threshold ";
+        key += std::to_string(*taps.threshold);
     }
-    return new Bitmap(file_header, info_header, data);
+    for (int32_t k = 0; k < taps.size * taps.size; ++k) {
+        key += ' ';
+        key += ExactNumber(taps.weights[k]);
+    }
+    return key;
 }
 
-Bitmap *EdgeDetection::Apply(const Bitmap *bitmap) {
-    Grayscale operation;
-    Bitmap *bitmap0 = operation.Apply(bitmap);
-    BitmapFileHeader file_header = bitmap->GetFileHeader();
-    BitmapInfoHeader info_header = bitmap->GetInfoHeader();
+int32_t Convolution::GetRadius() const {
+    return kernel_.GetSize() / 2;
+}
+
+bool Convolution::IsWindowed() const {
+    return kernel_.GetBorder() != convolution::Border::Wrap;
+}
+
+int32_t Convolution::MapRow(int32_t i, int32_t height) const {
+    return convolution::BorderIndex(kernel_.GetBorder(), i, height);
+}
+
+void Convolution::ApplyRow(const Color *const *rows, Color *dst, Color *, int32_t width) const {
+    thread_local std::vector<float> sums;
+    sums.resize(6 * static_cast<size_t>(width));
+    GetKernels().convolve(rows, kernel_.GetTaps(), dst, width, sums.data());
+}
+
+Sharpening::Sharpening()
+        : Convolution(convolution::Kernel({0, -1, 0, -1, 5, -1, 0, -1, 0}, convolution::Border::Clamp)) {
+}
+
+EdgeDetection::EdgeDetection(int32_t threshold, int32_t adaptive_radius)
+        : Convolution(convolution::Kernel({0, -1, 0, -1, 4, -1, 0, -1, 0}, convolution::Border::Clamp, threshold)),
+          threshold_(threshold),
+          adaptive_radius_(adaptive_radius) {
+}
+
+Bitmap *EdgeDetection::Apply(const Bitmap *bitmap, ThreadPool *pool) {
+    if (adaptive_radius_ == 0) {
+        return Convolution::Apply(bitmap, pool);
+    }
     int32_t height = bitmap->GetHeight();
     int32_t width = bitmap->GetWidth();
-    std::vector<std::vector<Color>> data(height, std::vector<Color>(width));
-    std::vector<std::vector<Color>> buffer(3, std::vector<Color>(3));
-    for (int32_t i = 0; i < height; ++i) {
-        for (int32_t j = 0; j < width; ++j) {
-            for (int32_t i0 = 0; i0 < 3; ++i0) {
-                for (int32_t j0 = 0; j0 < 3; ++j0) {
-                    buffer[i0][j0] = bitmap0->GetData(std::max(0, std::min(height - 1, i + i0 - 1)),
-                                                      std::max(0, std::min(width - 1, j + j0 - 1)));
-                }
+    auto at = [width](int32_t i, int32_t j) { return static_cast<size_t>(i) * width + j; };
+    std::vector<std::uint8_t> grey(static_cast<size_t>(height) * width);
+    RowBands(height, pool).Run([&](int32_t begin, int32_t end) {
+        for (int32_t i = begin; i < end; ++i) {
+            const Color *src = bitmap->GetRow(i);
+            for (int32_t j = 0; j < width; ++j) {
+                grey[at(i, j)] = kernels::GreyValue(src[j]);
             }
-            int32_t grey =
-                    4 * buffer[1][1].red - buffer[0][1].red - buffer[1][0].red - buffer[1][2].red - buffer[2][1].red;
-            if (grey > threshold_) {
-                data[i][j] = {255, 255, 255};
-            } else {
-                data[i][j] = {0, 0, 0};
+        }
+    });
+    // The Laplacian with clamped borders, as the kernel computes it, and its magnitude capped at 255
+    // for the table.
+    std::vector<int16_t> laplacian(grey.size());
+    std::vector<std::uint8_t> magnitude(grey.size());
+    RowBands(height, pool).Run([&](int32_t begin, int32_t end) {
+        for (int32_t i = begin; i < end; ++i) {
+            const std::uint8_t *up = &grey[at(std::max(i - 1, 0), 0)];
+            const std::uint8_t *middle = &grey[at(i, 0)];
+            const std::uint8_t *down = &grey[at(std::min(i + 1, height - 1), 0)];
+            for (int32_t j = 0; j < width; ++j) {
+                int32_t value = 4 * middle[j] - up[j] - down[j] - middle[std::max(j - 1, 0)] -
+                                middle[std::min(j + 1, width - 1)];
+                laplacian[at(i, j)] = static_cast<int16_t>(value);
+                magnitude[at(i, j)] = static_cast<std::uint8_t>(std::min(std::abs(value), 255));
+            }
+        }
+    });
+    integral::Table<std::uint32_t> table(magnitude.data(), width, width, height, 1, false, pool);
+    Bitmap *result = new Bitmap(bitmap->GetFileHeader(), bitmap->GetInfoHeader());
+    RowBands(height, pool).Run([&](int32_t begin, int32_t end) {
+        for (int32_t i = begin; i < end; ++i) {
+            integral::Window rows = integral::Clip(i, adaptive_radius_, height);
+            Color *dst = result->GetRow(i);
+            for (int32_t j = 0; j < width; ++j) {
+                integral::Window columns = integral::Clip(j, adaptive_radius_, width);
+                int64_t count = static_cast<int64_t>(rows.end - rows.begin) * (columns.end - columns.begin);
+                int64_t sum = table.Sum(rows.begin, rows.end, columns.begin, columns.end, 0);
+                // value > threshold + sum / count, without the division.
+                bool edge = laplacian[at(i, j)] * count > threshold_ * count + sum;
+                std::uint8_t level = edge ? 255 : 0;
+                dst[j] = {level, level, level};
             }
         }
+    });
+    return result;
+}
+
+std::string EdgeDetection::GetKey() const {
+    std::string key = Convolution::GetKey();
+    if (adaptive_radius_ != 0) {
+        key += " adaptive " + std::to_string(adaptive_radius_);
     }
-    delete bitmap0;
-    return new Bitmap(file_header, info_header, data);
+    return key;
 }
 
-Bitmap *GaussianBlur::Apply(const Bitmap *bitmap) {
-    BitmapFileHeader file_header = bitmap->GetFileHeader();
-    BitmapInfoHeader info_header = bitmap->GetInfoHeader();
+bool EdgeDetection::IsWindowed() const {
+    return adaptive_radius_ == 0 && Convolution::IsWindowed();
+}
 
-    std::int32_t height = bitmap->GetHeight();
-    std::int32_t width = bitmap->GetWidth();
+void EdgeDetection::PrepareRow(const Color *src, Color *dst, int32_t width) const {
+    Grayscale().ApplyRow(src, dst, width);
+}
 
-    std::vector<std::vector<Color>> data(height, std::vector<Color>(width));
+GaussianBlur::GaussianBlur(double sigma, Mode mode)
+        : sigma_(sigma),
+          mode_(mode),
+          sigma3_(static_cast<int32_t>(sigma * 3.0)),
+          gauss_buf_(blur::GaussianWeights(sigma)) {
+    if (mode_ == Mode::Fast && sigma_ >= kBoxSigma) {
+        mode_ = sigma_ >= kPyramidSigma ? Mode::Pyramid : Mode::Box;
+    }
+    if (mode_ == Mode::Fast) {
+        fixed_buf_ = blur::FixedWeights(gauss_buf_);
+    } else if (mode_ == Mode::Box) {
+        box_radii_ = blur::BoxRadii(sigma_, kBoxPasses);
+    } else if (mode_ == Mode::Pyramid) {
+        // Level k already carries the variance of its 2^k box, (4^k - 1) / 12 per axis, and the
+        // bilinear upsampling adds about 1 / 6 of a coarse pixel squared.
+        int32_t level = static_cast<int32_t>(std::floor(std::log2(sigma_ / kCoarseSigma))) + 1;
+        pyramid_level_ = std::clamp(level, 1, Pyramid::kMaxLevel);
+        double scale = std::ldexp(1.0, pyramid_level_);
+        double variance = sigma_ * sigma_ - (scale * scale - 1.0) / 12.0 - scale * scale / 6.0;
+        // Below 1/3 the blur is a single tap.
+        coarse_sigma_ = std::max(std::sqrt(std::max(variance, 0.0)) / scale, 0.1);
+    }
+}
 
-    std::int32_t sigma3 = static_cast<int32_t>(sigma_ * 3.0);
-    std::int32_t sigma_full = sigma3 * 2 + 1;
+Bitmap *GaussianBlur::Apply(const Bitmap *bitmap, ThreadPool *pool) {
+    if (IsWindowed()) {
+        return NeighbourhoodFilter::Apply(bitmap, pool);
+    }
+    Bitmap *result = new Bitmap(bitmap->GetFileHeader(), bitmap->GetInfoHeader());
+    if (mode_ == Mode::Pyramid) {
+        std::unique_ptr<Bitmap> coarse(BlurCoarse(bitmap, pool));
+        Pyramid::Upsample(coarse.get(), pyramid_level_, result, pool);
+        return result;
+    }
+    for (int32_t i = 0; i < bitmap->GetHeight(); ++i) {
+        std::memcpy(result->GetRow(i), bitmap->GetRow(i), bitmap->GetWidth() * sizeof(Color));
+    }
+    blur::BoxBlur(result, box_radii_, pool);
+    return result;
+}
 
-    double s = 0.0;
-    for (std::int32_t i = 0; i < sigma_full; ++i) {
-        s += std::exp(-((i - sigma3) * (i - sigma3)) / (2 * sigma_ * sigma_)) / (sigma_ * std::sqrt(2.0 * M_PI));
+bool GaussianBlur::ApplyInPlace(Bitmap *bitmap, ThreadPool *pool) {
+    if (IsWindowed()) {
+        return false;
     }
+    if (mode_ == Mode::Pyramid) {
+        // The coarse copy holds everything the upsampling reads.
+        std::unique_ptr<Bitmap> coarse(BlurCoarse(bitmap, pool));
+        Pyramid::Upsample(coarse.get(), pyramid_level_, bitmap, pool);
+        return true;
+    }
+    blur::BoxBlur(bitmap, box_radii_, pool);
+    return true;
+}
 
-    std::vector<double> gauss_buf(sigma_full);
-    for (std::int32_t i = 0; i < sigma_full; ++i) {
-        gauss_buf[i] =
-                std::exp(-((i - sigma3) * (i - sigma3)) / (2 * sigma_ * sigma_)) / (sigma_ * std::sqrt(2.0 * M_PI)) / s;
+Bitmap *GaussianBlur::BlurCoarse(const Bitmap *bitmap, ThreadPool *pool) const {
+    Pyramid pyramid(bitmap, pool);
+    return GaussianBlur(coarse_sigma_, Mode::Fast).Apply(pyramid.GetLevel(pyramid_level_), pool);
+}
+
+std::string GaussianBlur::GetKey() const {
+    return "blur " + ExactNumber(sigma_) + " " + std::to_string(static_cast<int32_t>(mode_));
+}
+
+int32_t GaussianBlur::GetRadius() const {
+    return sigma3_;
+}
+
+bool GaussianBlur::IsWindowed() const {
+    return mode_ == Mode::Exact || mode_ == Mode::Fast;
+}
+
+int32_t GaussianBlur::GetScratchWidth(int32_t width) const {
+    return width + 2 * sigma3_;
+}
+
+void GaussianBlur::ApplyRow(const Color *const *rows, Color *dst, Color *scratch, int32_t width) const {
+    if (mode_ == Mode::Exact) {
+        blur::VerticalExact(rows, gauss_buf_, scratch + sigma3_, width);
+        blur::PadRow(scratch, width, sigma3_);
+        blur::HorizontalExact(scratch, gauss_buf_, dst, width);
+    } else {
+        blur::VerticalFixed(rows, fixed_buf_, scratch + sigma3_, width);
+        blur::PadRow(scratch, width, sigma3_);
+        blur::HorizontalFixed(scratch, fixed_buf_, dst, width);
     }
+}
 
-    std::vector<Color> buf(std::max(height, width));
+Bitmap *BoxBlur::Apply(const Bitmap *bitmap) {
+    return Apply(bitmap, nullptr);
+}
 
-    for (std::int32_t j = 0; j < width; ++j) {
-        for (std::int32_t i = 0; i < height; ++i) {
-            buf[i] = bitmap->GetData(i, j);
-        }
-        for (std::int32_t i = 0; i < height; ++i) {
-            double red = 0.0;
-            double green = 0.0;
-            double blue = 0.0;
-            for (std::int32_t i0 = 0; i0 < sigma_full; ++i0) {
-                std::int32_t i1 = std::max(0, std::min(height - 1, i + i0 - sigma3));
-                red += buf[i1].red * gauss_buf[i0] / 255.0;
-                green += buf[i1].green * gauss_buf[i0] / 255.0;
-                blue += buf[i1].blue * gauss_buf[i0] / 255.0;
+Bitmap *BoxBlur::Apply(const Bitmap *bitmap, ThreadPool *pool) {
+    int32_t height = bitmap->GetHeight();
+    int32_t width = bitmap->GetWidth();
+    integral::Table<std::uint32_t> sums(bitmap, false, pool);
+    Bitmap *result = new Bitmap(bitmap->GetFileHeader(), bitmap->GetInfoHeader());
+    RowBands(height, pool).Run([&](int32_t begin, int32_t end) {
+        for (int32_t i = begin; i < end; ++i) {
+            integral::Window rows = integral::Clip(i, radius_, height);
+            auto *dst = reinterpret_cast<std::uint8_t *>(result->GetRow(i));
+            for (int32_t j = 0; j < width; ++j) {
+                integral::Window columns = integral::Clip(j, radius_, width);
+                std::uint32_t count = (rows.end - rows.begin) * (columns.end - columns.begin);
+                // The mean is below 256, so the double quotient truncates exactly like the integer one.
+                for (int32_t c = 0; c < 3; ++c) {
+                    std::uint32_t sum = sums.Sum(rows.begin, rows.end, columns.begin, columns.end, c);
+                    dst[3 * j + c] = static_cast<std::uint8_t>((sum + count / 2) / static_cast<double>(count));
+                }
             }
-            data[i][j].blue = blue > 1 ? 255 : static_cast<uint8_t>(blue * 255);
-            data[i][j].green = green > 1 ? 255 : static_cast<uint8_t>(green * 255);
-            data[i][j].red = red > 1 ? 255 : static_cast<uint8_t>(red * 255);
-        }
-    }
-    for (std::int32_t i = 0; i < height; ++i) {
-        for (std::int32_t j = 0; j < width; ++j) {
-            buf[j] = data[i][j];
         }
-        for (std::int32_t j = 0; j < width; ++j) {
-            double red = 0.0;
-            double green = 0.0;
-            double blue = 0.0;
-            for (std::int32_t j0 = 0; j0 < sigma_full; ++j0) {
-                std::int32_t j1 = std::max(0, std::min(width - 1, j + j0 - sigma3));
-                red += buf[j1].red * gauss_buf[j0] / 255.0;
-                green += buf[j1].green * gauss_buf[j0] / 255.0;
-                blue += buf[j1].blue * gauss_buf[j0] / 255.0;
+    });
+    return result;
+}
+
+std::string BoxBlur::GetKey() const {
+    return "box " + std::to_string(radius_);
+}
+
+Bitmap *LocalNormalization::Apply(const Bitmap *bitmap) {
+    return Apply(bitmap, nullptr);
+}
+
+Bitmap *LocalNormalization::Apply(const Bitmap *bitmap, ThreadPool *pool) {
+    int32_t height = bitmap->GetHeight();
+    int32_t width = bitmap->GetWidth();
+    integral::Table<std::uint32_t> sums(bitmap, false, pool);
+    integral::Table<std::uint64_t> squares(bitmap, true, pool);
+    Bitmap *result = new Bitmap(bitmap->GetFileHeader(), bitmap->GetInfoHeader());
+    RowBands(height, pool).Run([&](int32_t begin, int32_t end) {
+        for (int32_t i = begin; i < end; ++i) {
+            integral::Window rows = integral::Clip(i, radius_, height);
+            const auto *src = reinterpret_cast<const std::uint8_t *>(bitmap->GetRow(i));
+            auto *dst = reinterpret_cast<std::uint8_t *>(result->GetRow(i));
+            for (int32_t j = 0; j < width; ++j) {
+                integral::Window columns = integral::Clip(j, radius_, width);
+                double count = static_cast<double>(rows.end - rows.begin) * (columns.end - columns.begin);
+                for (int32_t c = 0; c < 3; ++c) {
+                    double mean = sums.Sum(rows.begin, rows.end, columns.begin, columns.end, c) / count;
+                    double variance =
+                            squares.Sum(rows.begin, rows.end, columns.begin, columns.end, c) / count - mean * mean;
+                    double deviation = std::max(std::sqrt(std::max(variance, 0.0)), 1.0);
+                    double value = 128.0 + 32.0 * (src[3 * j + c] - mean) / deviation;
+                    dst[3 * j + c] = static_cast<std::uint8_t>(std::clamp(std::lround(value), 0L, 255L));
+                }
             }
-            data[i][j].blue = blue > 1 ? 255 : static_cast<uint8_t>(blue * 255);
-            data[i][j].green = green > 1 ? 255 : static_cast<uint8_t>(green * 255);
-            data[i][j].red = red > 1 ? 255 : static_cast<uint8_t>(red * 255);
         }
-    }
-    return new Bitmap(file_header, info_header, data);
+    });
+    return result;
+}
+
+std::string LocalNormalization::GetKey() const {
+    return "mean " + std::to_string(radius_);
 }
 
 Bitmap *VoronoiBlur::Apply(const Bitmap *bitmap) {
-    BitmapFileHeader file_header = bitmap->GetFileHeader();
-    BitmapInfoHeader info_header = bitmap->GetInfoHeader();
+    return Apply(bitmap, nullptr);
+}
+
+Bitmap *VoronoiBlur::Apply(const Bitmap *bitmap, ThreadPool *pool) {
+    Bitmap *result = new Bitmap(bitmap->GetFileHeader(), bitmap->GetInfoHeader());
+    Render(bitmap, result, pool);
+    return result;
+}
 
+bool VoronoiBlur::ApplyInPlace(Bitmap *bitmap, ThreadPool *pool) {
+    Render(bitmap, bitmap, pool);
+    return true;
+}
+
+std::string VoronoiBlur::GetKey() const {
+    if (!seed_.has_value()) {
+        return "";
+    }
+    std::string key = "voronoi " + std::to_string(cluster_count_) + " " + std::to_string(*seed_);
+    if (mode_ == Mode::Mean) {
+        key += " mean " + std::to_string(iterations_);
+    }
+    return key;
+}
+
+void VoronoiBlur::Render(const Bitmap *bitmap, Bitmap *result, ThreadPool *pool) const {
     std::int32_t height = bitmap->GetHeight();
     std::int32_t width = bitmap->GetWidth();
 
-    std::vector<std::vector<Color>> data(height, std::vector<Color>(width));
-
     std::random_device srand;
-    std::mt19937 rng(srand());
-    std::uniform_int_distribution<> height_distribution(0, height - 1);
-    std::uniform_int_distribution<> width_distribution(0, width - 1);
-
-    std::vector<std::pair<std::int32_t, std::int32_t>> points(cluster_count_);
+    std::vector<voronoi::Point> points = voronoi::DrawPoints(cluster_count_, seed_ ? *seed_ : srand(), height, width);
+    std::vector<Color> colors(cluster_count_);
     for (std::uint32_t i = 0; i < cluster_count_; i++) {
-        points[i] = {height_distribution(rng), width_distribution(rng)};
-    }
-
-    std::int32_t current_nearest_point, a, b, distance, new_distance;
-    for (std::int32_t i = 0; i < height; i++) {
-        for (std::int32_t j = 0; j < width; j++) {
-            current_nearest_point = 0;
-            distance = std::numeric_limits<int>::max();
-            for (std::int32_t new_nearest_point = 1; new_nearest_point < static_cast<int32_t>(points.size());
-                 new_nearest_point++) {
-                a = i - points[new_nearest_point].first;
-                b = j - points[new_nearest_point].second;
-                new_distance = a * a + b * b;
-                if (new_distance < distance) {
-                    current_nearest_point = new_nearest_point;
-                    distance = new_distance;
+        colors[i] = bitmap->GetRow(points[i].first)[points[i].second];
+    }
+
+    // Point 0 has always been left out of the nearest search in Seed mode; it only colours the
+    // image when it is the sole point. The grid keeps that, and the search keeps the strict
+    // comparison in index order, so ties still go to the lowest index. Mean mode uses every point.
+    std::uint32_t first = 1;
+    if (mode_ == Mode::Mean) {
+        Refine(bitmap, points, colors, pool);
+        first = 0;
+    }
+    voronoi::SeedGrid grid(points, first, height, width);
+    RowBands(height, pool).Run([&](int32_t begin, int32_t end) {
+        AssignRows(grid, points, begin, end, width, [&](int32_t i, int32_t left, int32_t count,
+                                                        const std::uint32_t *nearest) {
+            Color *dst = result->GetRow(i) + left;
+            for (int32_t k = 0; k < count; ++k) {
+                dst[k] = colors[nearest[k]];
+            }
+        });
+    });
+}
+
+void VoronoiBlur::Refine(const Bitmap *bitmap, std::vector<voronoi::Point> &points, std::vector<Color> &colors,
+                         ThreadPool *pool) const {
+    std::int32_t height = bitmap->GetHeight();
+    std::int32_t width = bitmap->GetWidth();
+    std::vector<CellSums> sums;
+    std::mutex mutex;
+    for (std::uint32_t iteration = 0;; ++iteration) {
+        voronoi::SeedGrid grid(points, 0, height, width);
+        sums.assign(points.size(), CellSums());
+        // Every band sums into a table of its own and adds it to the total once; the sums are
+        // integers, so the total does not depend on the order of the bands.
+        RowBands(height, pool).Run([&](int32_t begin, int32_t end) {
+            std::vector<CellSums> band(points.size());
+            AssignRows(grid, points, begin, end, width, [&](int32_t i, int32_t left, int32_t count,
+                                                            const std::uint32_t *nearest) {
+                const Color *src = bitmap->GetRow(i) + left;
+                for (int32_t k = 0; k < count; ++k) {
+                    CellSums &cell = band[nearest[k]];
+                    cell.blue += src[k].blue;
+                    cell.green += src[k].green;
+                    cell.red += src[k].red;
+                    cell.row += i;
+                    cell.column += left + k;
+                    ++cell.count;
                 }
+            });
+            std::lock_guard<std::mutex> lock(mutex);
+            for (std::size_t c = 0; c < sums.size(); ++c) {
+                sums[c].blue += band[c].blue;
+                sums[c].green += band[c].green;
+                sums[c].red += band[c].red;
+                sums[c].row += band[c].row;
+                sums[c].column += band[c].column;
+                sums[c].count += band[c].count;
+            }
+        });
+
+        bool moved = false;
+        for (std::size_t c = 0; iteration < iterations_ && c < sums.size(); ++c) {
+            if (sums[c].count == 0) {
+                continue;
             }
-            data[i][j] = bitmap->GetData(points[current_nearest_point].first, points[current_nearest_point].second);
+            voronoi::Point centroid = {RoundedMean(sums[c].row, sums[c].count),
+                                       RoundedMean(sums[c].column, sums[c].count)};
+            moved = moved || centroid != points[c];
+            points[c] = centroid;
+        }
+        if (!moved) {
+            break;
         }
     }
-    return new Bitmap(file_header, info_header, data);
-}
\ No newline at end of file
+
+    // A point nearest to no pixel, e.g. a duplicate, keeps the colour under it; it is never drawn.
+    for (std::size_t c = 0; c < sums.size(); ++c) {
+        if (sums[c].count != 0) {
+            colors[c] = {static_cast<std::uint8_t>(RoundedMean(sums[c].blue, sums[c].count)),
+                         static_cast<std::uint8_t>(RoundedMean(sums[c].green, sums[c].count)),
+                         static_cast<std::uint8_t>(RoundedMean(sums[c].red, sums[c].count))};
+        }
+    }
+}
@@ -1,14 +1,54 @@
 #pragma once
 
 #include "bitmap.h"
+#include "convolution.h"
+#include "point.h"
+#include "voronoi.h"
 #include <algorithm>
+#include <optional>
+#include <string>
 #include <vector>
 
+class ThreadPool;
+
+// Rows [top, bottom) and columns [left, right) of an image, rows numbered as stored.
+struct Region {
+    int32_t top;
+    int32_t bottom;
+    int32_t left;
+    int32_t right;
+};
+
 class Filter {
 public:
     virtual ~Filter(){};
 
     virtual Bitmap *Apply(const Bitmap *bitmap) = 0;
+
+    // The command line name, without the leading '-'.
+    virtual const char *GetName() const = 0;
+
+    // The filter and its parameters in canonical form: filters with equal keys turn equal images
+    // into equal images. Empty when the output can not be reproduced, e.g. an unseeded voronoi.
+    virtual std::string GetKey() const = 0;
+
+    // The region of an input of the given size that the `output` region of the result depends
+    // on. The whole input by default.
+    virtual Region GetInputRegion(const Region &output, int32_t height, int32_t width) const;
+
+    // Filters that can split their work into independent row bands override this.
+    virtual Bitmap *Apply(const Bitmap *bitmap, ThreadPool *pool);
+
+    // Overwrites the bitmap with the result if the filter needs no second image buffer for that;
+    // otherwise returns false and leaves the bitmap untouched.
+    virtual bool ApplyInPlace(Bitmap *bitmap, ThreadPool *pool);
+
+    // Whether every output pixel has equal channels, whatever the input. Apply and ApplyInPlace
+    // always take and give Bgr bitmaps; these let a Pipeline keep grey images as Gray in between.
+    virtual bool MakesGray() const;
+
+    // Whether an input whose pixels all have equal channels gives such an output.
+    virtual bool KeepsGray() const;
 };
 
 class Crop : public Filter {
@@ -16,8 +56,35 @@ public:
     Crop(int32_t width, int32_t height) : width_(width), height_(height) {
     }
 
+    const char *GetName() const override {
+        return "crop";
+    }
+
+    bool KeepsGray() const override {
+        return true;
+    }
+
+    using Filter::Apply;
     Bitmap *Apply(const Bitmap *bitmap) override;
-    void UpdateSize(BitmapFileHeader &file_header, BitmapInfoHeader &info_header);
+    std::string GetKey() const override;
+    // `output` shifted by the rows cut off; the crop must fit the input or it is fitted first.
+    Region GetInputRegion(const Region &output, int32_t height, int32_t width) const override;
+    void UpdateSize(BitmapFileHeader &file_header, BitmapInfoHeader &info_header) const;
+
+    // The crop applied to an image of the given size: the requested one if it fits, else the whole image.
+    Crop Fit(int32_t height, int32_t width) const;
+
+    // The cropped image as a view sharing the pixels of `bitmap`: same row stride, first row moved.
+    Bitmap *View(Bitmap *bitmap) const;
+
+    // The kept rows are the last GetHeight() rows of the image, the kept columns the first GetWidth().
+    int32_t GetHeight() const {
+        return height_;
+    }
+
+    int32_t GetWidth() const {
+        return width_;
+    }
 
 private:
     int32_t width_;
@@ -25,49 +92,361 @@ private:
 };
 
 
-class Grayscale : public Filter {
+// Output pixel depends only on the input pixel at the same position.
+class PixelFilter : public Filter {
 public:
     Bitmap *Apply(const Bitmap *bitmap) override;
+    Bitmap *Apply(const Bitmap *bitmap, ThreadPool *pool) override;
+    Region GetInputRegion(const Region &output, int32_t height, int32_t width) const override;
+
+    // src and dst may point to the same row.
+    virtual void ApplyRow(const Color *src, Color *dst, int32_t width) const = 0;
+
+    // Appends the filter to a run of point operations compiled into lookup tables.
+    virtual void Compile(point::Lut &lut) const = 0;
 };
 
-class Negative : public Filter {
+// Output row i depends on input rows i - radius .. i + radius, clamped to the image.
+class NeighbourhoodFilter : public Filter {
 public:
     Bitmap *Apply(const Bitmap *bitmap) override;
+    Bitmap *Apply(const Bitmap *bitmap, ThreadPool *pool) override;
+
+    // `output` widened by the radius on every side when windowed, the whole input otherwise.
+    Region GetInputRegion(const Region &output, int32_t height, int32_t width) const override;
+
+    virtual int32_t GetRadius() const = 0;
+
+    // False when the current settings need the whole image at once; Apply then handles it.
+    virtual bool IsWindowed() const;
+
+    // Number of pixels in the scratch row passed to ApplyRow.
+    virtual int32_t GetScratchWidth(int32_t width) const;
+
+    // Called once for every input row before it enters the window.
+    virtual void PrepareRow(const Color *src, Color *dst, int32_t width) const;
+
+    // The row read in place of row i outside [0, height); the nearest one by default. Windowed
+    // filters must map to a row of the image within radius rows of i.
+    virtual int32_t MapRow(int32_t i, int32_t height) const;
+
+    // rows holds 2 * radius + 1 prepared rows centred on the output row.
+    virtual void ApplyRow(const Color *const *rows, Color *dst, Color *scratch, int32_t width) const = 0;
 };
 
-class Sharpening : public Filter {
+class Grayscale : public PixelFilter {
 public:
-    Bitmap *Apply(const Bitmap *bitmap) override;
+    const char *GetName() const override {
+        return "gs";
+    }
+
+    bool MakesGray() const override {
+        return true;
+    }
+
+    std::string GetKey() const override;
+    void ApplyRow(const Color *src, Color *dst, int32_t width) const override;
+    void Compile(point::Lut &lut) const override;
 };
 
-class EdgeDetection : public Filter {
+class Negative : public PixelFilter {
 public:
-    explicit EdgeDetection(int32_t threshold) : threshold_(threshold) {
+    const char *GetName() const override {
+        return "neg";
     }
 
-    Bitmap *Apply(const Bitmap *bitmap) override;
+    bool KeepsGray() const override {
+        return true;
+    }
+
+    std::string GetKey() const override;
+    void ApplyRow(const Color *src, Color *dst, int32_t width) const override;
+    void Compile(point::Lut &lut) const override;
+};
+
+// A point filter mapping every channel through the same table.
+class ChannelMap : public PixelFilter {
+public:
+    explicit ChannelMap(const point::Table &table);
+
+    bool KeepsGray() const override {
+        return true;
+    }
+
+    // The table itself, so that e.g. -gamma 1 and -levels 0 255 share a key.
+    std::string GetKey() const override;
+    void ApplyRow(const Color *src, Color *dst, int32_t width) const override;
+    void Compile(point::Lut &lut) const override;
+
+    const point::Table &GetTable() const {
+        return table_;
+    }
+
+private:
+    point::Table table_;
+    point::Lut lut_;
+};
+
+// (value - 128) * contrast + 128 + brightness.
+class BrightnessContrast : public ChannelMap {
+public:
+    BrightnessContrast(int32_t brightness, double contrast);
+
+    const char *GetName() const override {
+        return "bc";
+    }
+};
+
+// Stretches [black, white] to the full range, clipping outside it, then applies the gamma.
+class Levels : public ChannelMap {
+public:
+    Levels(int32_t black, int32_t white, double gamma = 1.0);
+
+    const char *GetName() const override {
+        return "levels";
+    }
+};
+
+// Levels over the full range: 255 * (value / 255) ^ (1 / gamma), above 1 brightens the mid-tones.
+class Gamma : public Levels {
+public:
+    explicit Gamma(double gamma);
+
+    const char *GetName() const override {
+        return "gamma";
+    }
+};
+
+// 255 where the channel is at least `level`, 0 elsewhere; after -gs this gives a black and white image.
+class Threshold : public ChannelMap {
+public:
+    explicit Threshold(int32_t level);
+
+    const char *GetName() const override {
+        return "threshold";
+    }
+};
+
+// Rounds every channel to the nearest of `levels` evenly spaced values.
+class Posterize : public ChannelMap {
+public:
+    explicit Posterize(int32_t levels);
+
+    const char *GetName() const override {
+        return "posterize";
+    }
+};
+
+// Weighted sum of the size x size neighbourhood of every channel, with an odd size up to
+// convolution::kMaxSize. Separable kernels run as a vertical and a horizontal pass. The wrap
+// border needs rows from both ends of the image, so with it the filter works on the whole
+// image and does not stream.
+class Convolution : public NeighbourhoodFilter {
+public:
+    explicit Convolution(convolution::Kernel kernel) : kernel_(std::move(kernel)) {
+    }
+
+    const char *GetName() const override {
+        return "conv";
+    }
+
+    bool KeepsGray() const override {
+        return true;
+    }
+
+    using NeighbourhoodFilter::Apply;
+    Bitmap *Apply(const Bitmap *bitmap, ThreadPool *pool) override;
+    std::string GetKey() const override;
+    int32_t GetRadius() const override;
+    bool IsWindowed() const override;
+    int32_t MapRow(int32_t i, int32_t height) const override;
+    void ApplyRow(const Color *const *rows, Color *dst, Color *scratch, int32_t width) const override;
+
+    const convolution::Kernel &GetKernel() const {
+        return kernel_;
+    }
+
+private:
+    convolution::Kernel kernel_;
+};
+
+class Sharpening : public Convolution {
+public:
+    Sharpening();
+
+    const char *GetName() const override {
+        return "sharp";
+    }
+};
+
+// Convolution of the grey image with a Laplacian; white where it exceeds the threshold. With an
+// adaptive radius the threshold is raised by the local mean of the Laplacian's magnitude over the
+// box of that radius, so that edges have to stand out from the texture around them; the mean comes
+// from an integral::Table, at a constant cost per pixel, and the filter works on the whole image.
+class EdgeDetection : public Convolution {
+public:
+    explicit EdgeDetection(int32_t threshold, int32_t adaptive_radius = 0);
+
+    const char *GetName() const override {
+        return "edge";
+    }
+
+    bool MakesGray() const override {
+        return true;
+    }
+
+    using Convolution::Apply;
+    Bitmap *Apply(const Bitmap *bitmap, ThreadPool *pool) override;
+    std::string GetKey() const override;
+    bool IsWindowed() const override;
+    void PrepareRow(const Color *src, Color *dst, int32_t width) const override;
+
+    // 0 without the adaptive threshold.
+    int32_t GetAdaptiveRadius() const {
+        return adaptive_radius_;
+    }
 
 private:
     int32_t threshold_;
+    int32_t adaptive_radius_;
 };
 
-class GaussianBlur : public Filter {
+class GaussianBlur : public NeighbourhoodFilter {
 public:
-    explicit GaussianBlur(double sigma) : sigma_(sigma) {
+    // Exact reproduces the reference double arithmetic. Fast uses fixed-point taps for small sigma
+    // and switches to stacked box blurs, whose cost does not depend on sigma, from kBoxSigma up, and
+    // to Pyramid from kPyramidSigma up. Box always uses the stacked box blurs. Pyramid blurs a
+    // coarse level of the image, with sigma scaled down to at most kCoarseSigma, and interpolates
+    // the result back up; against Exact its mean error is about 0.3 and 99% of the channel values
+    // are within 2, the worst cases, up to about 20, sitting on hard edges and the border.
+    enum class Mode { Exact, Fast, Box, Pyramid };
+
+    static constexpr double kBoxSigma = 4.0;
+    static constexpr int32_t kBoxPasses = 3;
+    static constexpr double kPyramidSigma = 16.0;
+    static constexpr double kCoarseSigma = 4.0;
+
+    explicit GaussianBlur(double sigma, Mode mode = Mode::Exact);
+
+    const char *GetName() const override {
+        return "blur";
     }
-    Bitmap *Apply(const Bitmap *bitmap) override;
+
+    bool KeepsGray() const override {
+        return true;
+    }
+
+    using NeighbourhoodFilter::Apply;
+    Bitmap *Apply(const Bitmap *bitmap, ThreadPool *pool) override;
+    bool ApplyInPlace(Bitmap *bitmap, ThreadPool *pool) override;
+    std::string GetKey() const override;
+    int32_t GetRadius() const override;
+    bool IsWindowed() const override;
+    int32_t GetScratchWidth(int32_t width) const override;
+    void ApplyRow(const Color *const *rows, Color *dst, Color *scratch, int32_t width) const override;
 
 private:
+    // The pyramid level blurred with the coarse sigma.
+    Bitmap *BlurCoarse(const Bitmap *bitmap, ThreadPool *pool) const;
+
     double sigma_;
+    Mode mode_;
+    int32_t sigma3_;
+    std::vector<double> gauss_buf_;
+    std::vector<std::uint32_t> fixed_buf_;
+    std::vector<int32_t> box_radii_;
+    int32_t pyramid_level_ = 0;
+    double coarse_sigma_ = 0.0;
+};
+
+// Mean of the box of (2 radius + 1)^2 pixels around every pixel, the box clipped to the image,
+// rounded. Sums come from an integral::Table, so the cost per pixel does not depend on the radius,
+// up to integral::kMaxRadius. Works on the whole image.
+class BoxBlur : public Filter {
+public:
+    explicit BoxBlur(int32_t radius) : radius_(radius) {
+    }
+
+    const char *GetName() const override {
+        return "box";
+    }
+
+    bool KeepsGray() const override {
+        return true;
+    }
+
+    Bitmap *Apply(const Bitmap *bitmap) override;
+    Bitmap *Apply(const Bitmap *bitmap, ThreadPool *pool) override;
+    std::string GetKey() const override;
+
+private:
+    int32_t radius_;
+};
+
+// Local normalization: every channel becomes 128 + 32 (value - mean) / max(deviation, 1), rounded
+// and clamped, with the mean and standard deviation of the channel over the same box as BoxBlur.
+// Evens out lighting and contrast that vary across the image. Works on the whole image.
+class LocalNormalization : public Filter {
+public:
+    explicit LocalNormalization(int32_t radius) : radius_(radius) {
+    }
+
+    const char *GetName() const override {
+        return "mean";
+    }
+
+    bool KeepsGray() const override {
+        return true;
+    }
+
+    Bitmap *Apply(const Bitmap *bitmap) override;
+    Bitmap *Apply(const Bitmap *bitmap, ThreadPool *pool) override;
+    std::string GetKey() const override;
+
+private:
+    int32_t radius_;
 };
 
 class VoronoiBlur : public Filter {
 public:
-    VoronoiBlur(std::uint32_t cluster_count)
-            : cluster_count_(cluster_count){
+    // Seed colours every cell with the pixel under its seed. Mean colours it with the mean of its
+    // pixels, after moving every seed to the centroid of its cell the given number of times
+    // (Lloyd's k-means iteration, stopping early once no seed moves).
+    enum class Mode { Seed, Mean };
+
+    static constexpr std::int32_t kMaxIterations = 100;
+
+    // Without a seed the points are drawn from std::random_device, so every run differs.
+    VoronoiBlur(std::uint32_t cluster_count, std::optional<std::uint32_t> seed = std::nullopt, Mode mode = Mode::Seed,
+                std::uint32_t iterations = 0)
+            : cluster_count_(cluster_count), seed_(seed), mode_(mode), iterations_(iterations) {
     }
-    Bitmap *Apply(const Bitmap *bitmap);
+
+    const char *GetName() const override {
+        return "voronoi";
+    }
+
+    bool KeepsGray() const override {
+        return true;
+    }
+
+    Bitmap *Apply(const Bitmap *bitmap) override;
+    Bitmap *Apply(const Bitmap *bitmap, ThreadPool *pool) override;
+    bool ApplyInPlace(Bitmap *bitmap, ThreadPool *pool) override;
+    std::string GetKey() const override;
 
 private:
+    // Every output pixel takes the colour of a point, and those are read before anything is
+    // written, so `result` may be `bitmap` itself.
+    void Render(const Bitmap *bitmap, Bitmap *result, ThreadPool *pool) const;
+
+    // Moves the points to the centroids of their cells up to iterations_ times and gives every cell
+    // the mean colour of its pixels.
+    void Refine(const Bitmap *bitmap, std::vector<voronoi::Point> &points, std::vector<Color> &colors,
+                ThreadPool *pool) const;
+
     std::uint32_t cluster_count_;
-};
\ No newline at end of file
+    std::optional<std::uint32_t> seed_;
+    Mode mode_;
+    std::uint32_t iterations_;
+};
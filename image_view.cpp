@@ -0,0 +1,74 @@
+#include "image_view.h"
+#include <stdexcept>
+
+namespace {
+// Headers of a bitmap of the view's size and format, as if it were read from a file.
+Bitmap *MakeBitmap(const std::uint8_t *pixels, std::int32_t width, std::int32_t height, std::size_t stride,
+                   PixelFormat format) {
+    if (pixels == nullptr || width <= 0 || height <= 0) {
+        throw std::invalid_argument("image view is empty");
+    }
+    if (stride < static_cast<std::size_t>(width) * Bitmap::PixelSize(format)) {
+        throw std::invalid_argument("image view stride is shorter than a row");
+    }
+    BitmapFileHeader file_header = {};
+    BitmapInfoHeader info_header = {};
+    file_header.bfType = 0x4D42;
+    info_header.biWidth = width;
+    info_header.biHeight = height;
+    info_header.biPlanes = 1;
+    Bitmap::SetFormat(file_header, info_header, format);
+    // An empty owner: the pointer is only borrowed, and the use count of zero keeps Pipeline from
+    // recycling the buffer.
+    std::shared_ptr<std::uint8_t> borrowed(std::shared_ptr<std::uint8_t>(), const_cast<std::uint8_t *>(pixels));
+    return new Bitmap(file_header, info_header, std::move(borrowed), stride);
+}
+
+const std::uint8_t *End(const ConstImageView &view) {
+    return view.pixels + (view.height - 1) * view.stride + view.width * Bitmap::PixelSize(view.format);
+}
+}  // namespace
+
+std::unique_ptr<Bitmap> WrapView(const ImageView &view) {
+    return std::unique_ptr<Bitmap>(MakeBitmap(view.pixels, view.width, view.height, view.stride, view.format));
+}
+
+std::unique_ptr<const Bitmap> WrapView(const ConstImageView &view) {
+    return std::unique_ptr<const Bitmap>(MakeBitmap(view.pixels, view.width, view.height, view.stride, view.format));
+}
+
+ImageProcessor::ImageProcessor(std::vector<std::unique_ptr<Filter>> filters, std::size_t thread_count)
+        : filters_(std::move(filters)) {
+    if (thread_count > 1) {
+        pool_ = std::make_unique<ThreadPool>(thread_count);
+    }
+    std::vector<Filter *> chain;
+    for (const std::unique_ptr<Filter> &filter : filters_) {
+        chain.push_back(filter.get());
+    }
+    pipeline_ = std::make_unique<Pipeline>(chain, pool_.get());
+}
+
+ImageSize ImageProcessor::GetOutputSize(std::int32_t width, std::int32_t height) const {
+    for (const std::unique_ptr<Filter> &filter : filters_) {
+        if (const auto *crop = dynamic_cast<const Crop *>(filter.get())) {
+            Crop fitted = crop->Fit(height, width);
+            width = fitted.GetWidth();
+            height = fitted.GetHeight();
+        }
+    }
+    return {width, height};
+}
+
+void ImageProcessor::Apply(const ConstImageView &input, const ImageView &output) const {
+    std::unique_ptr<const Bitmap> source = WrapView(input);
+    std::unique_ptr<Bitmap> result = WrapView(output);
+    ImageSize size = GetOutputSize(input.width, input.height);
+    if (output.width != size.width || output.height != size.height) {
+        throw std::invalid_argument("output view does not have the output size of the chain");
+    }
+    if (output.pixels < End(input) && input.pixels < End(output)) {
+        throw std::invalid_argument("output view overlaps the input");
+    }
+    pipeline_->ApplyTo(source.get(), result.get());
+}
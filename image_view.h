@@ -0,0 +1,76 @@
+#pragma once
+
+#include "bitmap.h"
+#include "filter.h"
+#include "pipeline.h"
+#include "thread_pool.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Pixels owned by the caller, for code that embeds the filters and holds its images in its own
+// buffers: row i starts at pixels + i * stride and holds `width` pixels of
+// Bitmap::PixelSize(format) bytes. Rows are numbered as in Bitmap, that is as a BMP file stores
+// them, bottom row first; a crop keeps the last rows. A view never owns or frees the pixels.
+struct ImageView {
+    std::uint8_t *pixels;
+    std::int32_t width;
+    std::int32_t height;
+    std::size_t stride;
+    PixelFormat format;
+};
+
+// The same for pixels that are only read.
+struct ConstImageView {
+    const std::uint8_t *pixels;
+    std::int32_t width;
+    std::int32_t height;
+    std::size_t stride;
+    PixelFormat format;
+
+    ConstImageView(const std::uint8_t *pixels, std::int32_t width, std::int32_t height, std::size_t stride,
+                   PixelFormat format)
+            : pixels(pixels), width(width), height(height), stride(stride), format(format) {
+    }
+
+    ConstImageView(const ImageView &view)
+            : pixels(view.pixels), width(view.width), height(view.height), stride(view.stride), format(view.format) {
+    }
+};
+
+struct ImageSize {
+    std::int32_t width;
+    std::int32_t height;
+};
+
+// A bitmap over the pixels of the view, which must outlive it; nothing is copied and the bitmap
+// never frees them. Throws std::invalid_argument for an empty view or a stride shorter than a row.
+std::unique_ptr<Bitmap> WrapView(const ImageView &view);
+
+std::unique_ptr<const Bitmap> WrapView(const ConstImageView &view);
+
+// A filter chain for caller-owned images. It owns its filters and, for more than one thread, its
+// pool, and can be moved but not copied. Apply reads the input where it lies and writes the
+// result into the output view, so that no image crosses the interface by copy; the only buffers
+// allocated are those between segments of the chain that Pipeline itself would allocate.
+class ImageProcessor {
+public:
+    explicit ImageProcessor(std::vector<std::unique_ptr<Filter>> filters, std::size_t thread_count = 1);
+
+    ImageProcessor(ImageProcessor &&) = default;
+
+    ImageProcessor &operator=(ImageProcessor &&) = default;
+
+    // Size of the result for an input of the given size; only crops change it.
+    ImageSize GetOutputSize(std::int32_t width, std::int32_t height) const;
+
+    // Filters `input` into `output`, which must have GetOutputSize of the input, may be in any
+    // format and must not overlap the input. Throws std::invalid_argument otherwise.
+    void Apply(const ConstImageView &input, const ImageView &output) const;
+
+private:
+    std::vector<std::unique_ptr<Filter>> filters_;
+    std::unique_ptr<ThreadPool> pool_;
+    std::unique_ptr<Pipeline> pipeline_;
+};
@@ -0,0 +1,78 @@
+#include "integral.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <mutex>
+
+namespace integral {
+
+template <typename T>
+Table<T>::Table(const std::uint8_t *pixels, std::size_t stride, std::int32_t width, std::int32_t height,
+                std::int32_t channels, bool squares, ThreadPool *pool)
+        : channels_(channels),
+          row_size_(static_cast<std::size_t>(width + 1) * channels),
+          sums_(static_cast<std::size_t>(height + 1) * row_size_) {
+    std::size_t count = static_cast<std::size_t>(width) * channels;
+    RowBands bands(height, pool);
+    std::mutex mutex;
+    std::vector<std::int32_t> begins;
+    // Every band first sums its own rows, as if it were the top of the image.
+    bands.Run([&](std::int32_t begin, std::int32_t end) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            begins.push_back(begin);
+        }
+        for (std::int32_t i = begin; i < end; ++i) {
+            const std::uint8_t *src = pixels + static_cast<std::size_t>(i) * stride;
+            T *dst = Row(i + 1);
+            if (squares) {
+                for (std::size_t k = 0; k < count; ++k) {
+                    dst[k + channels] = dst[k] + static_cast<T>(src[k]) * src[k];
+                }
+            } else {
+                for (std::size_t k = 0; k < count; ++k) {
+                    dst[k + channels] = dst[k] + src[k];
+                }
+            }
+            if (i > begin) {
+                const T *above = Row(i);
+                for (std::size_t k = 0; k < row_size_; ++k) {
+                    dst[k] += above[k];
+                }
+            }
+        }
+    });
+    // Then the totals above every band are carried into its last row, band after band, and from
+    // there into its other rows.
+    std::sort(begins.begin(), begins.end());
+    for (std::size_t b = 1; b < begins.size(); ++b) {
+        std::int32_t end = b + 1 < begins.size() ? begins[b + 1] : height;
+        const T *carry = Row(begins[b]);
+        T *last = Row(end);
+        for (std::size_t k = 0; k < row_size_; ++k) {
+            last[k] += carry[k];
+        }
+    }
+    bands.Run([&](std::int32_t begin, std::int32_t end) {
+        if (begin == 0) {
+            return;
+        }
+        const T *carry = Row(begin);
+        for (std::int32_t i = begin + 1; i < end; ++i) {
+            T *dst = Row(i);
+            for (std::size_t k = 0; k < row_size_; ++k) {
+                dst[k] += carry[k];
+            }
+        }
+    });
+}
+
+template <typename T>
+Table<T>::Table(const Bitmap *bitmap, bool squares, ThreadPool *pool)
+        : Table(bitmap->GetPixels(), bitmap->GetRowStride(), bitmap->GetWidth(), bitmap->GetHeight(),
+                static_cast<std::int32_t>(Bitmap::PixelSize(bitmap->GetFormat())), squares, pool) {
+}
+
+template class Table<std::uint32_t>;
+template class Table<std::uint64_t>;
+
+}  // namespace integral
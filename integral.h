@@ -0,0 +1,76 @@
+#pragma once
+
+#include "bitmap.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class ThreadPool;
+
+// Summed-area tables: after one pass over an image, the sum of a channel over any box of it costs
+// four lookups, whatever the size of the box. This is what lets BoxBlur, LocalNormalization and
+// the adaptive EdgeDetection spend a constant amount of work per pixel for any radius.
+namespace integral {
+
+// Largest box radius whose sums of byte values fit 32 bits: (2 * 2047 + 1)^2 * 255 < 2^32.
+constexpr std::int32_t kMaxRadius = 2047;
+
+// At(i, j, c) is the sum of channel c over rows [0, i) and columns [0, j) of an image of bytes, or
+// of their squares, kept modulo 2^bits of T. Differences are taken modulo the same, so a box sum
+// is exact as long as it fits T, however large the image is: uint32_t for byte values over boxes
+// up to kMaxRadius, uint64_t for their squares. Rows are built in parallel bands, each band adding
+// up its own rows before the totals of the bands above are carried into it; those vertical sums
+// run over whole rows of all channels and vectorize.
+template <typename T>
+class Table {
+public:
+    // `channels` interleaved bytes per pixel, e.g. 3 for a Bgr bitmap and 1 for a grey plane.
+    Table(const std::uint8_t *pixels, std::size_t stride, std::int32_t width, std::int32_t height,
+          std::int32_t channels, bool squares, ThreadPool *pool);
+
+    // One channel per byte of a pixel of the bitmap, e.g. blue, green and red for Bgr.
+    Table(const Bitmap *bitmap, bool squares, ThreadPool *pool);
+
+    // Sum of channel c over rows [top, bottom) and columns [left, right).
+    T Sum(std::int32_t top, std::int32_t bottom, std::int32_t left, std::int32_t right, std::int32_t c) const {
+        const T *upper = Row(top);
+        const T *lower = Row(bottom);
+        std::size_t l = static_cast<std::size_t>(left) * channels_ + c;
+        std::size_t r = static_cast<std::size_t>(right) * channels_ + c;
+        return static_cast<T>(lower[r] - lower[l] - upper[r] + upper[l]);
+    }
+
+    std::int32_t GetChannels() const {
+        return channels_;
+    }
+
+private:
+    const T *Row(std::int32_t i) const {
+        return sums_.data() + static_cast<std::size_t>(i) * row_size_;
+    }
+
+    T *Row(std::int32_t i) {
+        return sums_.data() + static_cast<std::size_t>(i) * row_size_;
+    }
+
+    std::int32_t channels_;
+    // (width + 1) * channels; row 0 and column 0 are zero.
+    std::size_t row_size_;
+    std::vector<T> sums_;
+};
+
+extern template class Table<std::uint32_t>;
+extern template class Table<std::uint64_t>;
+
+// Rows and columns [begin, end) of the box of the given radius around position k of [0, size),
+// clipped to it.
+struct Window {
+    std::int32_t begin;
+    std::int32_t end;
+};
+
+inline Window Clip(std::int32_t k, std::int32_t radius, std::int32_t size) {
+    return {k > radius ? k - radius : 0, k + radius + 1 < size ? k + radius + 1 : size};
+}
+
+}  // namespace integral
@@ -0,0 +1,88 @@
+#include "kernels.h"
+#include "convolution_rows.h"
+#include <algorithm>
+
+namespace kernels {
+
+void LookupPixels(const Color *src, Color *dst, int32_t begin, int32_t end, const std::uint8_t *tables) {
+    for (int32_t j = begin; j < end; ++j) {
+        dst[j] = {tables[src[j].blue], tables[256 + src[j].green], tables[512 + src[j].red]};
+    }
+}
+
+void DownsamplePixels(const Color *top, const Color *bottom, Color *dst, int32_t begin, int32_t end,
+                      int32_t rounding) {
+    const auto *upper = reinterpret_cast<const std::uint8_t *>(top);
+    const auto *lower = reinterpret_cast<const std::uint8_t *>(bottom);
+    auto *out = reinterpret_cast<std::uint8_t *>(dst);
+    for (int32_t k = 3 * begin; k < 3 * end; ++k) {
+        int32_t left = 2 * k - k % 3;
+        out[k] = static_cast<std::uint8_t>((upper[left] + upper[left + 3] + lower[left] + lower[left + 3] + rounding) >> 2);
+    }
+}
+
+void NearestPixels(int32_t dy2, int32_t column, int32_t left, int32_t begin, int32_t end, std::uint32_t seed,
+                   int32_t *distance, std::uint32_t *nearest) {
+    for (int32_t j = begin; j < end; ++j) {
+        int32_t dx = left + j - column;
+        int32_t candidate = dy2 + dx * dx;
+        if (candidate < distance[j]) {
+            distance[j] = candidate;
+            nearest[j] = seed;
+        }
+    }
+}
+
+namespace {
+
+void GrayscaleScalar(const Color *src, Color *dst, int32_t width) {
+    for (int32_t j = 0; j < width; ++j) {
+        std::uint8_t grey = GreyValue(src[j]);
+        dst[j] = {grey, grey, grey};
+    }
+}
+
+void NegativeScalar(const Color *src, Color *dst, int32_t width) {
+    for (int32_t j = 0; j < width; ++j) {
+        dst[j].red = 255 - src[j].red;
+        dst[j].blue = 255 - src[j].blue;
+        dst[j].green = 255 - src[j].green;
+    }
+}
+
+void LookupScalar(const Color *src, Color *dst, int32_t width, const std::uint8_t *tables) {
+    LookupPixels(src, dst, 0, width, tables);
+}
+
+void DownsampleScalar(const Color *top, const Color *bottom, Color *dst, int32_t width, int32_t rounding) {
+    DownsamplePixels(top, bottom, dst, 0, width, rounding);
+}
+
+void NearestScalar(int32_t dy2, int32_t column, int32_t left, int32_t count, std::uint32_t seed, int32_t *distance,
+                   std::uint32_t *nearest) {
+    NearestPixels(dy2, column, left, 0, count, seed, distance, nearest);
+}
+
+}  // namespace
+
+const Kernels kScalar = {"scalar", GrayscaleScalar, NegativeScalar, LookupScalar, Convolve, DownsampleScalar,
+                         NearestScalar};
+
+}  // namespace kernels
+
+const Kernels &GetKernels(KernelLevel level) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (level == KernelLevel::AVX2 && __builtin_cpu_supports("avx2")) {
+        return kernels::kAVX2;
+    }
+    if (level != KernelLevel::Scalar && __builtin_cpu_supports("sse2")) {
+        return kernels::kSSE2;
+    }
+#endif
+    return kernels::kScalar;
+}
+
+const Kernels &GetKernels() {
+    static const Kernels &best = GetKernels(KernelLevel::AVX2);
+    return best;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "bitmap.h"
+#include "convolution.h"
+
+// Row kernels for the point and convolution filters. Every implementation produces exactly the
+// same bytes as the scalar one; the vector variants only differ in speed.
+struct Kernels {
+    const char *name;
+
+    // 0.299 R + 0.587 G + 0.114 B evaluated in double and truncated, as in the original filter.
+    // src and dst may be the same row.
+    void (*grayscale)(const Color *src, Color *dst, int32_t width);
+
+    // src and dst may be the same row.
+    void (*negative)(const Color *src, Color *dst, int32_t width);
+
+    // Maps every byte through the 256-entry table of its channel; tables holds the blue, green
+    // and red tables one after another. src and dst may be the same row.
+    void (*lookup)(const Color *src, Color *dst, int32_t width, const std::uint8_t *tables);
+
+    // One output row of a convolution; rows holds the taps.size input rows centred on it and
+    // sums has room for 6 * width floats.
+    void (*convolve)(const Color *const *rows, const convolution::Taps &taps, Color *dst, int32_t width,
+                     float *sums);
+
+    // dst[j] is the mean of pixels 2j and 2j + 1 of top and bottom, which hold 2 * width pixels, with
+    // `rounding` (0 to 3) added to the sum before the division by four.
+    void (*downsample)(const Color *top, const Color *bottom, Color *dst, int32_t width, int32_t rounding);
+
+    // One Voronoi seed against pixels left .. left + count - 1 of a row dy rows away from it: where
+    // dy2 = dy * dy plus the squared column distance to the seed is below distance[j], stores it there
+    // and `seed` in nearest[j]. Ties keep the earlier seed.
+    void (*nearest)(int32_t dy2, int32_t column, int32_t left, int32_t count, std::uint32_t seed,
+                    int32_t *distance, std::uint32_t *nearest);
+};
+
+enum class KernelLevel { Scalar, SSE2, AVX2 };
+
+// The best implementation supported by the running CPU, picked once through CPUID.
+const Kernels &GetKernels();
+
+// A specific implementation; falls back to a lower level if the CPU or the build lacks it.
+const Kernels &GetKernels(KernelLevel level);
+
+namespace kernels {
+extern const Kernels kScalar;
+#if defined(__x86_64__) || defined(__i386__)
+extern const Kernels kSSE2;
+extern const Kernels kAVX2;
+#endif
+
+// Inline, so that loops over pixels can use it without a call.
+inline std::uint8_t GreyValue(const Color &pixel) {
+    std::int32_t luma = 299 * pixel.red + 587 * pixel.green + 114 * pixel.blue;
+    // For integral luma the double expression may land just below the exact value. Both are
+    // computed and one picked through a mask, not a branch, so that loops over pixels vectorize.
+    auto grey = static_cast<std::int32_t>(0.299 * pixel.red + 0.587 * pixel.green + 0.114 * pixel.blue);
+    std::int32_t exact = -static_cast<std::int32_t>(luma % 1000 != 0);
+    return static_cast<std::uint8_t>((luma / 1000 & exact) | (grey & ~exact));
+}
+
+void LookupPixels(const Color *src, Color *dst, int32_t begin, int32_t end, const std::uint8_t *tables);
+
+void DownsamplePixels(const Color *top, const Color *bottom, Color *dst, int32_t begin, int32_t end,
+                      int32_t rounding);
+
+void NearestPixels(int32_t dy2, int32_t column, int32_t left, int32_t begin, int32_t end, std::uint32_t seed,
+                   int32_t *distance, std::uint32_t *nearest);
+}  // namespace kernels
@@ -0,0 +1,125 @@
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <algorithm>
+#include <cstring>
+#include <immintrin.h>
+#include "convolution_rows.h"
+
+namespace kernels {
+namespace {
+
+void GrayscaleAVX2(const Color *src, Color *dst, int32_t width) {
+    const auto *in = reinterpret_cast<const std::uint8_t *>(src);
+    auto *out = reinterpret_cast<std::uint8_t *>(dst);
+    const __m128i blue_mask = _mm_setr_epi8(0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9, -1, -1, -1);
+    const __m128i green_mask = _mm_setr_epi8(1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1);
+    const __m128i red_mask = _mm_setr_epi8(2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1);
+    const __m128i spread_mask = _mm_setr_epi8(0, 0, 0, 4, 4, 4, 8, 8, 8, 12, 12, 12, -1, -1, -1, -1);
+    const __m256d red_weight = _mm256_set1_pd(0.299);
+    const __m256d green_weight = _mm256_set1_pd(0.587);
+    const __m256d blue_weight = _mm256_set1_pd(0.114);
+
+    // Four pixels per step, evaluated in double with the same operation order as the scalar
+    // expression, so truncation gives the same grey. The 16-byte load reads one pixel and a bit ahead.
+    int32_t j = 0;
+    for (; j + 6 <= width; j += 4) {
+        __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 3 * j));
+        __m256d red = _mm256_cvtepi32_pd(_mm_shuffle_epi8(pixels, red_mask));
+        __m256d green = _mm256_cvtepi32_pd(_mm_shuffle_epi8(pixels, green_mask));
+        __m256d blue = _mm256_cvtepi32_pd(_mm_shuffle_epi8(pixels, blue_mask));
+        __m256d luma = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(red_weight, red), _mm256_mul_pd(green_weight, green)),
+                                     _mm256_mul_pd(blue_weight, blue));
+        __m128i grey = _mm_shuffle_epi8(_mm256_cvttpd_epi32(luma), spread_mask);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(out + 3 * j), grey);
+        std::uint32_t tail = _mm_cvtsi128_si32(_mm_srli_si128(grey, 8));
+        std::memcpy(out + 3 * j + 8, &tail, sizeof(tail));
+    }
+    for (; j < width; ++j) {
+        std::uint8_t grey = GreyValue(src[j]);
+        dst[j] = {grey, grey, grey};
+    }
+}
+
+void NegativeAVX2(const Color *src, Color *dst, int32_t width) {
+    const auto *in = reinterpret_cast<const std::uint8_t *>(src);
+    auto *out = reinterpret_cast<std::uint8_t *>(dst);
+    std::size_t size = static_cast<std::size_t>(width) * sizeof(Color);
+    const __m256i ones = _mm256_set1_epi8(-1);
+    std::size_t k = 0;
+    for (; k + 32 <= size; k += 32) {
+        __m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + k));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + k), _mm256_xor_si256(value, ones));
+    }
+    for (; k < size; ++k) {
+        out[k] = 255 - in[k];
+    }
+}
+
+void LookupAVX2(const Color *src, Color *dst, int32_t width, const std::uint8_t *tables) {
+    // Three 8-lane gathers per eight pixels measured no faster than the scalar loads, which
+    // already run at about one byte per cycle.
+    kScalar.lookup(src, dst, width, tables);
+}
+
+void DownsampleAVX2(const Color *top, const Color *bottom, Color *dst, int32_t width, int32_t rounding) {
+    const auto *upper = reinterpret_cast<const std::uint8_t *>(top);
+    const auto *lower = reinterpret_cast<const std::uint8_t *>(bottom);
+    auto *out = reinterpret_cast<std::uint8_t *>(dst);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i bias = _mm256_set1_epi16(static_cast<int16_t>(rounding));
+    // Output byte k comes from mean byte 6 * (k / 3) + k % 3; lane 0 holds bytes 0..15, lane 1 16..31.
+    const __m256i pick = _mm256_setr_epi8(0, 1, 2, 6, 7, 8, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1,
+                                          -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 3, 4, 8, 9, 10, -1);
+
+    // Five output pixels per step: byte k of both rows is summed with byte k + 3 for 32 bytes, the
+    // sums are rounded and packed back in order, and a shuffle picks the first three of every six.
+    // The loads read 35 bytes and the store writes one byte past the five pixels.
+    int32_t j = 0;
+    for (; j + 6 <= width; j += 5) {
+        const std::uint8_t *a = upper + 6 * j;
+        const std::uint8_t *b = lower + 6 * j;
+        __m256i a0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a));
+        __m256i a3 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + 3));
+        __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b));
+        __m256i b3 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + 3));
+        __m256i low = _mm256_add_epi16(
+                _mm256_add_epi16(_mm256_unpacklo_epi8(a0, zero), _mm256_unpacklo_epi8(a3, zero)),
+                _mm256_add_epi16(_mm256_unpacklo_epi8(b0, zero), _mm256_unpacklo_epi8(b3, zero)));
+        __m256i high = _mm256_add_epi16(
+                _mm256_add_epi16(_mm256_unpackhi_epi8(a0, zero), _mm256_unpackhi_epi8(a3, zero)),
+                _mm256_add_epi16(_mm256_unpackhi_epi8(b0, zero), _mm256_unpackhi_epi8(b3, zero)));
+        __m256i means = _mm256_packus_epi16(_mm256_srli_epi16(_mm256_add_epi16(low, bias), 2),
+                                            _mm256_srli_epi16(_mm256_add_epi16(high, bias), 2));
+        __m256i picked = _mm256_shuffle_epi8(means, pick);
+        __m128i result = _mm_or_si128(_mm256_castsi256_si128(picked), _mm256_extracti128_si256(picked, 1));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 3 * j), result);
+    }
+    DownsamplePixels(top, bottom, dst, j, width, rounding);
+}
+
+void NearestAVX2(int32_t dy2, int32_t column, int32_t left, int32_t count, std::uint32_t seed, int32_t *distance,
+                 std::uint32_t *nearest) {
+    const __m256i base = _mm256_set1_epi32(dy2);
+    const __m256i index = _mm256_set1_epi32(static_cast<int32_t>(seed));
+    const __m256i step = _mm256_set1_epi32(8);
+    __m256i dx = _mm256_add_epi32(_mm256_set1_epi32(left - column), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    int32_t j = 0;
+    for (; j + 8 <= count; j += 8) {
+        __m256i candidate = _mm256_add_epi32(base, _mm256_mullo_epi32(dx, dx));
+        __m256i best = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(distance + j));
+        __m256i closer = _mm256_cmpgt_epi32(best, candidate);
+        __m256i seeds = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(nearest + j));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(distance + j), _mm256_blendv_epi8(best, candidate, closer));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(nearest + j), _mm256_blendv_epi8(seeds, index, closer));
+        dx = _mm256_add_epi32(dx, step);
+    }
+    NearestPixels(dy2, column, left, j, count, seed, distance, nearest);
+}
+
+}  // namespace
+
+const Kernels kAVX2 = {"avx2", GrayscaleAVX2, NegativeAVX2, LookupAVX2, Convolve, DownsampleAVX2, NearestAVX2};
+
+}  // namespace kernels
+#endif
@@ -0,0 +1,53 @@
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <algorithm>
+#include <emmintrin.h>
+#define CONVOLUTION_ROWS_SSE2
+#include "convolution_rows.h"
+
+namespace kernels {
+namespace {
+
+void NegativeSSE2(const Color *src, Color *dst, int32_t width) {
+    const auto *in = reinterpret_cast<const std::uint8_t *>(src);
+    auto *out = reinterpret_cast<std::uint8_t *>(dst);
+    std::size_t size = static_cast<std::size_t>(width) * sizeof(Color);
+    const __m128i ones = _mm_set1_epi8(-1);
+    std::size_t k = 0;
+    for (; k + 16 <= size; k += 16) {
+        __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + k));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + k), _mm_xor_si128(value, ones));
+    }
+    for (; k < size; ++k) {
+        out[k] = 255 - in[k];
+    }
+}
+
+void GrayscaleSSE2(const Color *src, Color *dst, int32_t width) {
+    // Deinterleaving packed BGR needs byte shuffles, which SSE2 lacks; the integer scalar path is used.
+    kScalar.grayscale(src, dst, width);
+}
+
+void LookupSSE2(const Color *src, Color *dst, int32_t width, const std::uint8_t *tables) {
+    // SSE2 has neither gathers nor byte shuffles; table lookups stay scalar.
+    kScalar.lookup(src, dst, width, tables);
+}
+
+void DownsampleSSE2(const Color *top, const Color *bottom, Color *dst, int32_t width, int32_t rounding) {
+    // Picking three bytes out of every six needs byte shuffles as well.
+    kScalar.downsample(top, bottom, dst, width, rounding);
+}
+
+void NearestSSE2(int32_t dy2, int32_t column, int32_t left, int32_t count, std::uint32_t seed, int32_t *distance,
+                 std::uint32_t *nearest) {
+    // SSE2 has no 32-bit lane multiply; the scalar loop is vectorized by the compiler as far as it goes.
+    kScalar.nearest(dy2, column, left, count, seed, distance, nearest);
+}
+
+}  // namespace
+
+const Kernels kSSE2 = {"sse2", GrayscaleSSE2, NegativeSSE2, LookupSSE2, Convolve, DownsampleSSE2, NearestSSE2};
+
+}  // namespace kernels
+#endif
@@ -1,5 +1,6 @@
 #include <string>
 #include <iostream>
+#include <memory>
 #include <optional>
 #include "controller.h"
 
@@ -7,32 +8,66 @@ int main(int argc, char** argv) {
     if (argc < 3) {
         std::cout
                 << "{имя программы} {путь к входному файлу} {путь к выходному файлу} [-{имя фильтра 1} [параметр фильтра "
-                   "1] [параметр фильтра 2] ...] [-{имя фильтра 2} [параметр фильтра 1] [параметр фильтра 2] ...] ..."
+                   "1] [параметр фильтра 2] ...] [-{имя фильтра 2} [параметр фильтра 1] [параметр фильтра 2] ...] ...\n"
+                   "{имя программы} --batch {папка, маска или список файлов} {папка для результатов} [-{имя фильтра 1} "
+                   "...] ...\n"
+                   "{имя программы} --serve {путь к сокету} [--threads N] [--cache {папка}]\n"
+                   "\n"
+                   "Параметры, в любом месте командной строки:\n"
+                   "  --threads N                  число потоков, по умолчанию по числу ядер\n"
+                   "  --stream                     читать и записывать изображение полосами строк\n"
+                   "  --batch                      применить цепочку к многим файлам\n"
+                   "  --profile text|json          время, память и скорость каждого этапа в stderr\n"
+                   "  --trace {файл}               записать трассу этапов в формате Chrome trace\n"
+                   "  --cache {папка}              кэш результатов на диске\n"
+                   "  --cache-size МБ              размер кэша, по умолчанию 1024\n"
+                   "  --serve {сокет}              работать сервером на Unix-сокете, см. finale_client\n"
+                   "  --preview N                  предпросмотр в N раз меньше, N – степень двойки до 128\n"
+                   "  --bpp 8|24|32                формат результата: 8 – серый, 24 – BGR, 32 – BGRX\n"
+                   "\n"
+                   "Фильтры:\n"
+                   "  -crop width height\n"
+                   "  -gs\n"
+                   "  -neg\n"
+                   "  -sharp\n"
+                   "  -edge threshold [adaptive r]\n"
+                   "  -blur sigma [exact|fast|box|pyramid]\n"
+                   "  -box r\n"
+                   "  -mean r\n"
+                   "  -voronoi count [seed] [mean [iterations]]\n"
+                   "  -bc brightness contrast\n"
+                   "  -gamma gamma\n"
+                   "  -levels black white [gamma]\n"
+                   "  -threshold level\n"
+                   "  -posterize levels\n"
+                   "  -conv weights [clamp|mirror|wrap]\n"
+                   "  -convfile {файл} [clamp|mirror|wrap]"
                 << std::endl;
         return 0;
     }
-    Bitmap* bitmap = nullptr;
-    Bitmap* bitmap1 = nullptr;
-    Controller* controller;
+    int status = 0;
     try {
-        controller = Controller::Parse(argc, argv);
-        bitmap = controller->ReadFile();
-        bitmap1 = controller->ApplyFilters(bitmap);
-        controller->WriteFile(bitmap1);
-        delete controller;
-        delete bitmap;
-        delete bitmap1;
-    } catch (const std::exception& e) {
-        if (controller != nullptr) {
-            delete controller;
-        }
-        if (bitmap != nullptr) {
-            delete bitmap;
-        }
-        if (bitmap1 != nullptr) {
-            delete bitmap1;
+        std::unique_ptr<Controller> controller = Controller::Parse(argc, argv);
+        if (controller->IsServing()) {
+            controller->Serve();
+        } else if (controller->IsBatch()) {
+            if (controller->ProcessBatch() > 0) {
+                status = 1;
+            }
+        } else if (controller->IsStreaming()) {
+            controller->Stream();
+        } else {
+            std::unique_ptr<Bitmap> bitmap(controller->ReadFile());
+            Bitmap* result = controller->ApplyFilters(bitmap.get());
+            // ApplyFilters may return the input itself.
+            std::unique_ptr<Bitmap> filtered(result != bitmap.get() ? result : nullptr);
+            controller->WriteFile(result);
         }
+        controller->FinishProfile();
+        controller->ReportCache();
+    } catch (const std::exception& e) {
         std::cerr << e.what() << std::endl;
+        return 1;
     }
-    return 0;
+    return status;
 }
\ No newline at end of file
@@ -0,0 +1,662 @@
+#include "pipeline.h"
+#include "profile.h"
+#include "spsc_queue.h"
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+BitmapRowSource::BitmapRowSource(const Bitmap *bitmap, int32_t width)
+        : bitmap_(bitmap), width_(width < 0 ? bitmap->GetWidth() : width) {
+    SetBitmap(bitmap);
+}
+
+void BitmapRowSource::SetBitmap(const Bitmap *bitmap) {
+    bitmap_ = bitmap;
+    if (bitmap_->GetFormat() != PixelFormat::Bgr) {
+        row_.resize(width_);
+    }
+}
+
+int32_t BitmapRowSource::GetWidth() const {
+    return width_;
+}
+
+int32_t BitmapRowSource::GetHeight() const {
+    return bitmap_->GetHeight();
+}
+
+const Color *BitmapRowSource::GetRow(int32_t i) {
+    if (bitmap_->GetFormat() == PixelFormat::Bgr) {
+        return bitmap_->GetRow(i);
+    }
+    bitmap_->UnpackRow(i, row_.data(), width_);
+    return row_.data();
+}
+
+int32_t StripRowSource::GetWidth() const {
+    return width_;
+}
+
+int32_t StripRowSource::GetHeight() const {
+    return height_;
+}
+
+const Color *StripRowSource::GetRow(int32_t i) {
+    return strip_->GetRow(i - first_);
+}
+
+CropStage::CropStage(RowSource *source, const Crop *crop)
+        : source_(source), crop_(crop), offset_(source->GetHeight() - crop->GetHeight()) {
+}
+
+int32_t CropStage::GetWidth() const {
+    return std::min(crop_->GetWidth(), source_->GetWidth());
+}
+
+int32_t CropStage::GetHeight() const {
+    return crop_->GetHeight();
+}
+
+const Color *CropStage::GetRow(int32_t i) {
+    return source_->GetRow(offset_ + i);
+}
+
+PixelStage::PixelStage(RowSource *source, const std::vector<const PixelFilter *> &filters)
+        : source_(source), row_(source->GetWidth()) {
+    for (const PixelFilter *filter : filters) {
+        filter->Compile(lut_);
+    }
+}
+
+int32_t PixelStage::GetWidth() const {
+    return source_->GetWidth();
+}
+
+int32_t PixelStage::GetHeight() const {
+    return source_->GetHeight();
+}
+
+const Color *PixelStage::GetRow(int32_t i) {
+    lut_.ApplyRow(source_->GetRow(i), row_.data(), GetWidth());
+    return row_.data();
+}
+
+WindowStage::WindowStage(RowSource *source, const NeighbourhoodFilter *filter)
+        : source_(source),
+          filter_(filter),
+          radius_(filter->GetRadius()),
+          capacity_(2 * filter->GetRadius() + 1),
+          ring_(static_cast<size_t>(capacity_) * source->GetWidth()),
+          rows_(capacity_),
+          scratch_(filter->GetScratchWidth(source->GetWidth())),
+          row_(source->GetWidth()) {
+}
+
+int32_t WindowStage::GetWidth() const {
+    return source_->GetWidth();
+}
+
+int32_t WindowStage::GetHeight() const {
+    return source_->GetHeight();
+}
+
+Color *WindowStage::Slot(int32_t i) {
+    return ring_.data() + static_cast<size_t>(i % capacity_) * GetWidth();
+}
+
+const Color *WindowStage::GetRow(int32_t i) {
+    int32_t width = GetWidth();
+    int32_t height = GetHeight();
+    int32_t first = std::max(0, i - radius_);
+    int32_t last = std::min(height - 1, i + radius_);
+
+    if (first < loaded_begin_ || first > loaded_end_) {
+        loaded_begin_ = first;
+        loaded_end_ = first;
+    }
+    for (; loaded_end_ <= last; ++loaded_end_) {
+        filter_->PrepareRow(source_->GetRow(loaded_end_), Slot(loaded_end_), width);
+    }
+    loaded_begin_ = std::max(loaded_begin_, loaded_end_ - capacity_);
+
+    for (int32_t k = 0; k < capacity_; ++k) {
+        rows_[k] = Slot(filter_->MapRow(i - radius_ + k, height));
+    }
+    filter_->ApplyRow(rows_.data(), row_.data(), scratch_.data(), width);
+    return row_.data();
+}
+
+void WindowStage::Reset() {
+    loaded_begin_ = 0;
+    loaded_end_ = 0;
+}
+
+LazyChain::LazyChain(const std::vector<Filter *> &filters, int32_t height, int32_t width)
+        : filters_(filters), height_(height), width_(width) {
+    for (Filter *&filter : filters_) {
+        heights_.push_back(height_);
+        widths_.push_back(width_);
+        if (const auto *crop = dynamic_cast<const Crop *>(filter)) {
+            crops_.push_back(crop->Fit(height_, width_));
+            height_ = crops_.back().GetHeight();
+            width_ = crops_.back().GetWidth();
+            filter = &crops_.back();
+        } else if (const auto *neighbourhood_filter = dynamic_cast<const NeighbourhoodFilter *>(filter)) {
+            radius_ += neighbourhood_filter->GetRadius();
+        }
+    }
+}
+
+const std::vector<Filter *> &LazyChain::GetFilters() const {
+    return filters_;
+}
+
+int32_t LazyChain::GetHeight() const {
+    return height_;
+}
+
+int32_t LazyChain::GetWidth() const {
+    return width_;
+}
+
+void LazyChain::UpdateSize(BitmapFileHeader &file_header, BitmapInfoHeader &info_header) const {
+    // Without crops the headers are passed on untouched.
+    if (!crops_.empty()) {
+        Crop(width_, height_).UpdateSize(file_header, info_header);
+    }
+}
+
+int32_t LazyChain::GetRadius() const {
+    return radius_;
+}
+
+Region LazyChain::GetInputRegion(int32_t begin, int32_t end) const {
+    Region region = {begin, end, 0, width_};
+    for (size_t k = filters_.size(); k-- > 0;) {
+        region = filters_[k]->GetInputRegion(region, heights_[k], widths_[k]);
+    }
+    return region;
+}
+
+std::vector<std::unique_ptr<RowSource>> LazyChain::BuildStages(const Bitmap *bitmap) const {
+    int32_t columns = GetInputRegion(0, height_).right;
+    return Pipeline::BuildStages(std::make_unique<BitmapRowSource>(bitmap, columns), filters_);
+}
+
+void LazyChain::Rebind(std::vector<std::unique_ptr<RowSource>> &stages, const Bitmap *bitmap) {
+    static_cast<BitmapRowSource *>(stages.front().get())->SetBitmap(bitmap);
+    for (std::unique_ptr<RowSource> &stage : stages) {
+        stage->Reset();
+    }
+}
+
+Pipeline::Pipeline(const std::vector<Filter *> &filters, ThreadPool *pool, ResultCache *cache)
+        : pool_(pool), cache_(cache) {
+    for (size_t k = 0; k < filters.size(); ++k) {
+        Filter *filter = filters[k];
+        bool streamable = IsStreamable(filter);
+        bool lazy_crop = dynamic_cast<const Crop *>(filter) != nullptr && !segments_.empty() &&
+                         segments_.back().streamable;
+        bool closed = cache_ != nullptr && !segments_.empty() &&
+                      std::any_of(segments_.back().filters.begin(), segments_.back().filters.end(),
+                                  [](const Filter *previous) {
+                                      return dynamic_cast<const NeighbourhoodFilter *>(previous) != nullptr;
+                                  });
+        if (((streamable && !closed) || lazy_crop) && !segments_.empty() && segments_.back().streamable) {
+            segments_.back().filters.push_back(filter);
+            segments_.back().name += std::string("+") + filter->GetName();
+        } else {
+            segments_.push_back({{filter}, streamable, filter->GetName(), k});
+        }
+    }
+    if (cache_ != nullptr) {
+        for (const Filter *filter : filters) {
+            std::string key = filter->GetKey();
+            if (key.empty()) {
+                break;
+            }
+            keys_.push_back(key + "\n");
+        }
+    }
+}
+
+bool Pipeline::IsStreamable(const Filter *filter) {
+    const auto *neighbourhood_filter = dynamic_cast<const NeighbourhoodFilter *>(filter);
+    return dynamic_cast<const PixelFilter *>(filter) != nullptr ||
+           (neighbourhood_filter != nullptr && neighbourhood_filter->IsWindowed());
+}
+
+bool Pipeline::IsPixelwise(const Segment &segment) {
+    return std::all_of(segment.filters.begin(), segment.filters.end(),
+                       [](const Filter *filter) { return dynamic_cast<const PixelFilter *>(filter) != nullptr; });
+}
+
+bool Pipeline::IsCrop(const Segment &segment) {
+    return std::all_of(segment.filters.begin(), segment.filters.end(),
+                       [](const Filter *filter) { return dynamic_cast<const Crop *>(filter) != nullptr; });
+}
+
+Pipeline::Segment Pipeline::Tail(const Segment &segment, size_t first) {
+    Segment tail = {{segment.filters.begin() + static_cast<std::ptrdiff_t>(first - segment.first),
+                     segment.filters.end()},
+                    segment.streamable, "", first};
+    for (const Filter *filter : tail.filters) {
+        if (!tail.name.empty()) {
+            tail.name += '+';
+        }
+        tail.name += filter->GetName();
+    }
+    return tail;
+}
+
+bool Pipeline::IsGrayAfter(const std::vector<Filter *> &filters, bool gray) {
+    for (const Filter *filter : filters) {
+        gray = filter->MakesGray() || (gray && filter->KeepsGray());
+    }
+    return gray;
+}
+
+std::vector<std::string> Pipeline::CacheKeys(const Bitmap *bitmap) const {
+    std::vector<std::string> keys;
+    std::string digest;
+    std::string chain;
+    for (const std::string &key : keys_) {
+        if (digest.empty()) {
+            digest = ResultCache::Digest(bitmap);
+        }
+        chain += key;
+        keys.push_back(ResultCache::Key(digest, chain));
+    }
+    return keys;
+}
+
+Bitmap *Pipeline::Apply(const Bitmap *bitmap) const {
+    const Bitmap *current = bitmap;
+    Bitmap *result = nullptr;
+    for (const Segment &segment : segments_) {
+        Bitmap *next = ApplySegment(segment, current);
+        delete result;
+        result = next;
+        current = next;
+    }
+    return result;
+}
+
+void Pipeline::ApplyTo(const Bitmap *bitmap, Bitmap *result) const {
+    std::unique_ptr<Bitmap> owned;
+    const Bitmap *current = bitmap;
+    for (size_t k = 0; k + 1 < segments_.size(); ++k) {
+        owned.reset(ApplySegment(segments_[k], current));
+        current = owned.get();
+    }
+    if (!segments_.empty() && segments_.back().streamable) {
+        const Segment &segment = segments_.back();
+        Profiler::Stage stage(segment.name, static_cast<int64_t>(current->GetWidth()) * current->GetHeight());
+        std::unique_lock<std::mutex> lock;
+        std::optional<LazyChain> local;
+        const LazyChain &chain = Prepare(segment, current, lock, local);
+        ApplyStreamable(current, result, chain, lock.owns_lock() ? &segment.prepared : nullptr);
+        return;
+    }
+    if (!segments_.empty()) {
+        owned.reset(ApplySegment(segments_.back(), current));
+        current = owned.get();
+    }
+    for (int32_t i = 0; i < current->GetHeight(); ++i) {
+        Bitmap::ConvertRow(reinterpret_cast<const std::uint8_t *>(current->GetRow(i)), current->GetFormat(),
+                           reinterpret_cast<std::uint8_t *>(result->GetRow(i)), result->GetFormat(),
+                           current->GetWidth());
+    }
+}
+
+Bitmap *Pipeline::ApplySegment(const Segment &segment, const Bitmap *bitmap) const {
+    Profiler::Stage stage(segment.name, static_cast<int64_t>(bitmap->GetWidth()) * bitmap->GetHeight());
+    if (segment.streamable) {
+        std::unique_lock<std::mutex> lock;
+        std::optional<LazyChain> local;
+        const LazyChain &chain = Prepare(segment, bitmap, lock, local);
+        BitmapFileHeader file_header = bitmap->GetFileHeader();
+        BitmapInfoHeader info_header = bitmap->GetInfoHeader();
+        chain.UpdateSize(file_header, info_header);
+        if (bitmap->GetFormat() != PixelFormat::Bgr) {
+            Bitmap::SetFormat(file_header, info_header, PixelFormat::Bgr);
+        }
+        auto *result = new Bitmap(file_header, info_header);
+        ApplyStreamable(bitmap, result, chain, lock.owns_lock() ? &segment.prepared : nullptr);
+        return result;
+    }
+    if (bitmap->GetFormat() != PixelFormat::Bgr) {
+        std::unique_ptr<Bitmap> converted(bitmap->Convert(PixelFormat::Bgr));
+        return segment.filters[0]->Apply(converted.get(), pool_);
+    }
+    return segment.filters[0]->Apply(bitmap, pool_);
+}
+
+Bitmap *Pipeline::ApplyInPlace(Bitmap *bitmap) const {
+    // `owned` is the current image unless that is still `bitmap`.
+    std::unique_ptr<Bitmap> owned;
+    Bitmap *current = bitmap;
+    std::shared_ptr<std::uint8_t> spare;
+    size_t spare_size = 0;
+    auto replace = [&](Bitmap *next) {
+        owned.reset(next);
+        current = next;
+    };
+
+    // The first segment to compute, and in place of it the rest of it after a cached filter.
+    size_t first = 0;
+    std::optional<Segment> tail;
+    bool gray = bitmap->GetFormat() == PixelFormat::Gray;
+    std::vector<std::string> keys;
+    if (cache_ != nullptr) {
+        Profiler::Stage stage("cache lookup", static_cast<int64_t>(bitmap->GetWidth()) * bitmap->GetHeight());
+        keys = CacheKeys(bitmap);
+        if (!keys.empty()) {
+            auto [index, cached] = cache_->LoadLast(keys);
+            if (cached != nullptr) {
+                replace(cached);
+                for (; first < segments_.size() && segments_[first].first <= index; ++first) {
+                    const Segment &segment = segments_[first];
+                    if (segment.first + segment.filters.size() > index + 1) {
+                        tail = Tail(segment, index + 1);
+                        auto end = segment.filters.begin() + static_cast<std::ptrdiff_t>(index + 1 - segment.first);
+                        gray = IsGrayAfter({segment.filters.begin(), end}, gray);
+                        break;
+                    }
+                    gray = IsGrayAfter(segment.filters, gray);
+                }
+            }
+        }
+    }
+
+    for (size_t k = first; k < segments_.size(); ++k) {
+        const Segment &segment = k == first && tail.has_value() ? *tail : segments_[k];
+        gray = IsGrayAfter(segment.filters, gray);
+        PixelFormat format = gray ? PixelFormat::Gray : PixelFormat::Bgr;
+        {
+            Profiler::Stage stage(segment.name, static_cast<int64_t>(current->GetWidth()) * current->GetHeight());
+            Filter *filter = segment.filters[0];
+            if (segment.streamable && IsPixelwise(segment) && current->GetFormat() == format) {
+                ApplyPixelwise(current, segment.filters);
+            } else if (IsCrop(segment)) {
+                for (const Filter *crop : segment.filters) {
+                    replace(static_cast<const Crop *>(crop)->View(current));
+                }
+            } else if (!segment.streamable) {
+                if (current->GetFormat() != PixelFormat::Bgr) {
+                    replace(current->Convert(PixelFormat::Bgr));
+                }
+                if (!filter->ApplyInPlace(current, pool_)) {
+                    replace(filter->Apply(current, pool_));
+                }
+            } else {
+                // The output goes to the spare buffer, packed with the default row stride even when the
+                // input is a view into a wider image. The input buffer becomes the next spare unless
+                // some other bitmap still shares it.
+                std::unique_lock<std::mutex> lock;
+                std::optional<LazyChain> local;
+                const LazyChain &chain = Prepare(segment, current, lock, local);
+                BitmapFileHeader file_header = current->GetFileHeader();
+                BitmapInfoHeader info_header = current->GetInfoHeader();
+                chain.UpdateSize(file_header, info_header);
+                if (current->GetFormat() != format) {
+                    Bitmap::SetFormat(file_header, info_header, format);
+                }
+                size_t stride = Bitmap::PaddedRowSize(chain.GetWidth(), format);
+                size_t size = chain.GetHeight() * stride;
+                if (spare == nullptr || spare_size < size) {
+                    spare = Bitmap(file_header, info_header).GetBuffer();
+                    spare_size = size;
+                }
+                auto *next = new Bitmap(file_header, info_header, std::move(spare), stride);
+                ApplyStreamable(current, next, chain, lock.owns_lock() ? &segment.prepared : nullptr);
+                if (current->GetBuffer().use_count() == 1) {
+                    spare = current->GetBuffer();
+                    spare_size = current->GetHeight() * current->GetRowStride();
+                }
+                replace(next);
+            }
+        }
+        // A crop only moves the first row, recomputing it costs less than loading it.
+        size_t last = segment.first + segment.filters.size() - 1;
+        if (last < keys.size() && !IsCrop(segment)) {
+            Profiler::Stage stage("cache store", static_cast<int64_t>(current->GetWidth()) * current->GetHeight());
+            cache_->Store(keys[last], current);
+        }
+    }
+    return owned != nullptr ? owned.release() : bitmap;
+}
+
+std::vector<std::unique_ptr<RowSource>> Pipeline::BuildStages(std::unique_ptr<RowSource> source,
+                                                               const std::vector<Filter *> &filters) {
+    std::vector<std::unique_ptr<RowSource>> stages;
+    stages.push_back(std::move(source));
+    std::vector<const PixelFilter *> pixel_filters;
+    for (size_t k = 0; k <= filters.size(); ++k) {
+        const auto *pixel_filter = k < filters.size() ? dynamic_cast<const PixelFilter *>(filters[k]) : nullptr;
+        if (pixel_filter != nullptr) {
+            pixel_filters.push_back(pixel_filter);
+            continue;
+        }
+        if (!pixel_filters.empty()) {
+            stages.push_back(std::make_unique<PixelStage>(stages.back().get(), pixel_filters));
+            pixel_filters.clear();
+        }
+        if (k == filters.size()) {
+            break;
+        }
+        if (const auto *crop = dynamic_cast<const Crop *>(filters[k])) {
+            stages.push_back(std::make_unique<CropStage>(stages.back().get(), crop));
+        } else {
+            const auto *neighbourhood_filter = dynamic_cast<const NeighbourhoodFilter *>(filters[k]);
+            stages.push_back(std::make_unique<WindowStage>(stages.back().get(), neighbourhood_filter));
+        }
+    }
+
+    return stages;
+}
+
+void Pipeline::ApplyPixelwise(Bitmap *bitmap, const std::vector<Filter *> &filters) const {
+    point::Lut lut;
+    for (const Filter *filter : filters) {
+        static_cast<const PixelFilter *>(filter)->Compile(lut);
+    }
+    int32_t width = bitmap->GetWidth();
+    if (bitmap->GetFormat() != PixelFormat::Bgr) {
+        RowBands(bitmap->GetHeight(), pool_).Run([&](int32_t begin, int32_t end) {
+            std::vector<Color> row(width);
+            for (int32_t i = begin; i < end; ++i) {
+                bitmap->UnpackRow(i, row.data(), width);
+                lut.ApplyRow(row.data(), row.data(), width);
+                bitmap->PackRow(i, row.data(), width);
+            }
+        });
+        return;
+    }
+    RowBands(bitmap->GetHeight(), pool_).Run([&](int32_t begin, int32_t end) {
+        for (int32_t i = begin; i < end; ++i) {
+            lut.ApplyRow(bitmap->GetRow(i), bitmap->GetRow(i), width);
+        }
+    });
+}
+
+const LazyChain &Pipeline::Prepare(const Segment &segment, const Bitmap *bitmap, std::unique_lock<std::mutex> &lock,
+                                   std::optional<LazyChain> &local) const {
+    lock = std::unique_lock<std::mutex>(prepared_mutex_, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return local.emplace(segment.filters, bitmap->GetHeight(), bitmap->GetWidth());
+    }
+    Prepared &prepared = segment.prepared;
+    if (prepared.chain == nullptr || prepared.height != bitmap->GetHeight() || prepared.width != bitmap->GetWidth()) {
+        prepared.bands.clear();
+        prepared.chain = std::make_unique<LazyChain>(segment.filters, bitmap->GetHeight(), bitmap->GetWidth());
+        prepared.height = bitmap->GetHeight();
+        prepared.width = bitmap->GetWidth();
+    }
+    return *prepared.chain;
+}
+
+void Pipeline::ApplyStreamable(const Bitmap *bitmap, Bitmap *result, const LazyChain &chain,
+                               Prepared *prepared) const {
+    RowBands bands(chain.GetHeight(), pool_);
+    if (prepared != nullptr && prepared->bands.size() != bands.GetCount()) {
+        prepared->bands.clear();
+        prepared->bands.resize(bands.GetCount());
+    }
+    auto run = [&](size_t band, int32_t begin, int32_t end) {
+        std::vector<std::unique_ptr<RowSource>> owned;
+        std::vector<std::unique_ptr<RowSource>> &stages = prepared != nullptr ? prepared->bands[band] : owned;
+        if (stages.empty()) {
+            stages = chain.BuildStages(bitmap);
+        } else {
+            LazyChain::Rebind(stages, bitmap);
+        }
+        RowSource *last = stages.back().get();
+        for (int32_t i = begin; i < end; ++i) {
+            result->PackRow(i, last->GetRow(i), chain.GetWidth());
+        }
+    };
+    // By reference, which std::function holds without allocating.
+    bands.RunIndexed(std::cref(run));
+}
+
+StreamingPipeline::StreamingPipeline(const std::vector<Filter *> &filters, ThreadPool *pool)
+        : filters_(filters), pool_(pool) {
+}
+
+void StreamingPipeline::Run(BmpRowReader &reader, std::ostream &outstream, PixelFormat format) const {
+    // The strips are Bgr whatever the formats of the files.
+    BitmapFileHeader file_header = reader.GetFileHeader();
+    BitmapInfoHeader info_header = reader.GetInfoHeader();
+    Bitmap::SetFormat(file_header, info_header, PixelFormat::Bgr);
+    BitmapFileHeader input_strip_file_header = file_header;
+    BitmapInfoHeader input_strip_header = info_header;
+    int32_t input_height = info_header.biHeight;
+    LazyChain chain(filters_, info_header.biHeight, info_header.biWidth);
+    chain.UpdateSize(file_header, info_header);
+    int32_t radius = chain.GetRadius();
+    int32_t output_height = chain.GetHeight();
+
+    int32_t strip_height = std::max(kMinStripHeight, 4 * radius);
+    if (pool_ != nullptr) {
+        strip_height = std::max(strip_height, static_cast<int32_t>(pool_->GetThreadCount() *
+                                                                   RowBands::kBandsPerThread) *
+                                                      RowBands::kMinBandHeight);
+    }
+    strip_height = std::min(strip_height, std::max(output_height, 1));
+
+    input_strip_header.biHeight = std::min(input_height, strip_height + 2 * radius);
+    BitmapInfoHeader output_strip_header = info_header;
+    output_strip_header.biHeight = strip_height;
+    size_t row_size = static_cast<size_t>(info_header.biWidth) * sizeof(Color);
+
+    // Empty strips go back to the stage that fills them through the free queues.
+    std::vector<std::unique_ptr<Bitmap>> strips;
+    SpscQueue<Bitmap *> free_inputs(kStripsInFlight);
+    SpscQueue<Bitmap *> read_inputs(kStripsInFlight);
+    SpscQueue<Bitmap *> free_outputs(kStripsInFlight);
+    SpscQueue<Bitmap *> filtered_outputs(kStripsInFlight);
+    for (int32_t k = 0; k < kStripsInFlight; ++k) {
+        strips.push_back(std::make_unique<Bitmap>(input_strip_file_header, input_strip_header));
+        free_inputs.Push(strips.back().get());
+        strips.push_back(std::make_unique<Bitmap>(file_header, output_strip_header));
+        free_outputs.Push(strips.back().get());
+    }
+
+    // The first error of any stage is kept and closes every queue, so that the others stop.
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    auto fail = [&](std::exception_ptr exception) {
+        {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (error == nullptr) {
+                error = exception;
+            }
+        }
+        for (SpscQueue<Bitmap *> *queue : {&free_inputs, &read_inputs, &free_outputs, &filtered_outputs}) {
+            queue->Close();
+        }
+    };
+
+    Bitmap::SetFormat(file_header, info_header, format);
+    BmpRowWriter writer(outstream, file_header, info_header);
+    std::thread read_thread([&] {
+        try {
+            Bitmap *strip = nullptr;
+            for (int32_t begin = 0; begin < output_height; begin += strip_height) {
+                if (!free_inputs.Pop(strip)) {
+                    return;
+                }
+                // Input rows the strip depends on.
+                Region region = chain.GetInputRegion(begin, std::min(output_height, begin + strip_height));
+                {
+                    Profiler::Span span("read rows");
+                    reader.ReadRows(region.top, region.bottom - region.top, strip);
+                }
+                if (!read_inputs.Push(strip)) {
+                    return;
+                }
+            }
+        } catch (...) {
+            fail(std::current_exception());
+        }
+    });
+    std::thread write_thread([&] {
+        try {
+            Bitmap *strip = nullptr;
+            for (int32_t begin = 0; begin < output_height; begin += strip_height) {
+                if (!filtered_outputs.Pop(strip)) {
+                    return;
+                }
+                {
+                    Profiler::Span span("write rows");
+                    for (int32_t i = 0; i < std::min(strip_height, output_height - begin); ++i) {
+                        writer.WriteRow(strip->GetRow(i));
+                    }
+                }
+                free_outputs.Push(strip);
+            }
+            writer.Flush();
+        } catch (...) {
+            fail(std::current_exception());
+        }
+    });
+
+    try {
+        Bitmap *input_strip = nullptr;
+        Bitmap *output_strip = nullptr;
+        for (int32_t begin = 0; begin < output_height; begin += strip_height) {
+            if (!read_inputs.Pop(input_strip) || !free_outputs.Pop(output_strip)) {
+                break;
+            }
+            int32_t end = std::min(output_height, begin + strip_height);
+            Region region = chain.GetInputRegion(begin, end);
+            {
+                Profiler::Span span("filter rows");
+                RowBands(end - begin, pool_).Run([&](int32_t band_begin, int32_t band_end) {
+                    std::vector<std::unique_ptr<RowSource>> stages = Pipeline::BuildStages(
+                            std::make_unique<StripRowSource>(input_strip, region.top, input_height, region.right),
+                            chain.GetFilters());
+                    RowSource *stage = stages.back().get();
+                    for (int32_t i = band_begin; i < band_end; ++i) {
+                        std::memcpy(output_strip->GetRow(i), stage->GetRow(begin + i), row_size);
+                    }
+                });
+            }
+            free_inputs.Push(input_strip);
+            filtered_outputs.Push(output_strip);
+        }
+    } catch (...) {
+        fail(std::current_exception());
+    }
+    read_thread.join();
+    write_thread.join();
+    if (error != nullptr) {
+        std::rethrow_exception(error);
+    }
+}
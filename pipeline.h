@@ -0,0 +1,310 @@
+#pragma once
+
+#include "bmp_io.h"
+#include "filter.h"
+#include "result_cache.h"
+#include "thread_pool.h"
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A stage of a row-streaming filter chain. Rows must be requested in non-decreasing order;
+// the returned pointer stays valid until the next call.
+class RowSource {
+public:
+    virtual ~RowSource() = default;
+
+    virtual int32_t GetWidth() const = 0;
+
+    virtual int32_t GetHeight() const = 0;
+
+    virtual const Color *GetRow(int32_t i) = 0;
+
+    // Forgets the rows the stage holds, so that rows can be requested from the first one again,
+    // e.g. after the input changed under it. Stages that hold no rows have nothing to forget.
+    virtual void Reset() {
+    }
+};
+
+// The first `width` columns of a bitmap, all of them by default. Rows of other formats than Bgr
+// are converted one at a time.
+class BitmapRowSource : public RowSource {
+public:
+    explicit BitmapRowSource(const Bitmap *bitmap, int32_t width = -1);
+
+    // Reads `bitmap` from now on; it must have the height of the previous one and at least the width read.
+    void SetBitmap(const Bitmap *bitmap);
+
+    int32_t GetWidth() const override;
+    int32_t GetHeight() const override;
+    const Color *GetRow(int32_t i) override;
+
+private:
+    const Bitmap *bitmap_;
+    int32_t width_;
+    std::vector<Color> row_;
+};
+
+// Rows [first, first + count) of a taller image, held in the first rows of `strip`; the first
+// `width` columns of them, all of them by default.
+class StripRowSource : public RowSource {
+public:
+    StripRowSource(const Bitmap *strip, int32_t first, int32_t height, int32_t width = -1)
+            : strip_(strip), first_(first), height_(height), width_(width < 0 ? strip->GetWidth() : width) {
+    }
+
+    int32_t GetWidth() const override;
+    int32_t GetHeight() const override;
+    const Color *GetRow(int32_t i) override;
+
+private:
+    const Bitmap *strip_;
+    int32_t first_;
+    int32_t height_;
+    int32_t width_;
+};
+
+// Passes on the rows and columns a crop keeps; the crop must already be fitted to the source.
+// A source narrower than the crop, see LazyChain, keeps its width.
+class CropStage : public RowSource {
+public:
+    CropStage(RowSource *source, const Crop *crop);
+
+    int32_t GetWidth() const override;
+    int32_t GetHeight() const override;
+    const Color *GetRow(int32_t i) override;
+
+private:
+    RowSource *source_;
+    const Crop *crop_;
+    int32_t offset_;
+};
+
+// Runs a run of consecutive pixel filters, compiled into one set of lookup tables, over one row buffer.
+class PixelStage : public RowSource {
+public:
+    PixelStage(RowSource *source, const std::vector<const PixelFilter *> &filters);
+
+    int32_t GetWidth() const override;
+    int32_t GetHeight() const override;
+    const Color *GetRow(int32_t i) override;
+
+private:
+    RowSource *source_;
+    point::Lut lut_;
+    std::vector<Color> row_;
+};
+
+// Keeps the last 2 * radius + 1 prepared input rows in a ring and produces one output row at a time.
+class WindowStage : public RowSource {
+public:
+    WindowStage(RowSource *source, const NeighbourhoodFilter *filter);
+
+    int32_t GetWidth() const override;
+    int32_t GetHeight() const override;
+    const Color *GetRow(int32_t i) override;
+    void Reset() override;
+
+private:
+    Color *Slot(int32_t i);
+
+    RowSource *source_;
+    const NeighbourhoodFilter *filter_;
+    int32_t radius_;
+    int32_t capacity_;
+    int32_t loaded_begin_ = 0;
+    int32_t loaded_end_ = 0;
+    std::vector<Color> ring_;
+    std::vector<const Color *> rows_;
+    std::vector<Color> scratch_;
+    std::vector<Color> row_;
+};
+
+// A run of streamable filters and crops prepared for an input of a given size, evaluated lazily
+// from the back: Filter::GetInputRegion maps the part of the output that is asked for to the part
+// of the input it depends on, so only those rows and columns are read and filtered. Crops are
+// replaced by copies fitted to the size they see.
+//
+// Rows are pulled on demand through the stages. Columns are cut at the source: crops keep the
+// first columns, so the chain runs on the first GetInputRegion().right input columns only. Every
+// filter then computes some wrong columns at the cut, but no more than its radius of them, and
+// those are exactly the columns the output does not depend on; the output is identical to
+// applying the filters one after another to the whole image.
+class LazyChain {
+public:
+    LazyChain(const std::vector<Filter *> &filters, int32_t height, int32_t width);
+
+    LazyChain(const LazyChain &) = delete;
+
+    LazyChain &operator=(const LazyChain &) = delete;
+
+    // The filters with the crops fitted; valid as long as the chain.
+    const std::vector<Filter *> &GetFilters() const;
+
+    // Size of the output.
+    int32_t GetHeight() const;
+
+    int32_t GetWidth() const;
+
+    // Sets the output size in the headers of the input.
+    void UpdateSize(BitmapFileHeader &file_header, BitmapInfoHeader &info_header) const;
+
+    // Sum of the radii of the neighbourhood filters.
+    int32_t GetRadius() const;
+
+    // The input region that output rows [begin, end), all columns, depend on.
+    Region GetInputRegion(int32_t begin, int32_t end) const;
+
+    // Stacks the stages of the chain on top of `bitmap`, cut to the columns the output needs.
+    std::vector<std::unique_ptr<RowSource>> BuildStages(const Bitmap *bitmap) const;
+
+    // Points stages built by BuildStages at `bitmap`, an input of the same size, and resets them.
+    static void Rebind(std::vector<std::unique_ptr<RowSource>> &stages, const Bitmap *bitmap);
+
+private:
+    std::vector<Filter *> filters_;
+    std::deque<Crop> crops_;
+    // Input size of every filter.
+    std::vector<int32_t> heights_;
+    std::vector<int32_t> widths_;
+    int32_t height_;
+    int32_t width_;
+    int32_t radius_ = 0;
+};
+
+// Splits a filter chain into segments: runs of pixel and neighbourhood filters are fused and
+// evaluated in a single pass over the rows, every other filter is applied to the whole image.
+// A crop after such a run joins it, so that the run is evaluated as a LazyChain over the pixels
+// the crop keeps only; any other crop becomes a view. With a cache, a fused segment ends after its
+// first neighbourhood filter and the crops following it, so that the result of every costly filter
+// is stored on its own.
+// With a pool, fused segments run as independent row bands; each band builds its own stages,
+// which pull the halo rows they need from upstream. Output is identical to applying the
+// filters one after another on a single thread.
+// Every fused segment keeps its LazyChain and the stages of its bands for the next run on an input
+// of the same size, so that a pipeline applied again and again builds them once. A run that finds
+// them in use by another thread builds its own.
+class Pipeline {
+public:
+    explicit Pipeline(const std::vector<Filter *> &filters, ThreadPool *pool = nullptr,
+                      ResultCache *cache = nullptr);
+
+    // Always returns a new Bgr bitmap, the input, in any format, is left untouched.
+    Bitmap *Apply(const Bitmap *bitmap) const;
+
+    // Same result as Apply, but free to overwrite `bitmap` and allocating no image buffer in the
+    // steady state: runs of pixel filters and filters with ApplyInPlace work on the current
+    // buffer, other fused segments alternate between it and one spare buffer of the same size,
+    // and crops become views into the current buffer. Returns `bitmap` or a new bitmap that may
+    // share its pixels; the caller owns both. Run again on an input of the same size, under a
+    // BufferPool::Scope that got the buffers of the last result back, it allocates no image buffer
+    // and on the heap only the bitmaps it returns or views into.
+    // The result may be in another format: from a filter that makes the image grey on, as long as
+    // the filters keep it grey, fused segments write Gray bitmaps, a third of the size. Filters
+    // that work on the whole image get a Bgr copy. `bitmap` may be in any format.
+    // With a cache, the result of the longest cached prefix of filters is loaded instead of being
+    // computed, and the result of every segment computed after it is stored. A prefix ending inside
+    // a fused segment splits it, the rest of it is evaluated as a segment of its own. Only the
+    // prefix up to the first filter with an empty key is cached.
+    Bitmap *ApplyInPlace(Bitmap *bitmap) const;
+
+    // Same result as Apply, written into `result`, which must have the output size and may be in any
+    // format and share no rows with `bitmap`. A fused last segment writes its rows straight into it.
+    void ApplyTo(const Bitmap *bitmap, Bitmap *result) const;
+
+    // Whether the filter can be evaluated a row at a time from a bounded window of input rows.
+    static bool IsStreamable(const Filter *filter);
+
+    // Stacks stages for the filters on top of `source`; crops become CropStage.
+    static std::vector<std::unique_ptr<RowSource>> BuildStages(std::unique_ptr<RowSource> source,
+                                                               const std::vector<Filter *> &filters);
+
+private:
+    // The LazyChain of a fused segment for an input of the given size and the stages of its row
+    // bands, built as the bands first need them.
+    struct Prepared {
+        int32_t height = -1;
+        int32_t width = -1;
+        std::unique_ptr<LazyChain> chain;
+        std::vector<std::vector<std::unique_ptr<RowSource>>> bands;
+    };
+
+    struct Segment {
+        Segment(std::vector<Filter *> filters, bool streamable, std::string name, size_t first)
+                : filters(std::move(filters)), streamable(streamable), name(std::move(name)), first(first) {
+        }
+
+        std::vector<Filter *> filters;
+        bool streamable;
+        // Names of the filters joined by '+', as reported by the profiler.
+        std::string name;
+        // Index of the first filter in the chain.
+        size_t first;
+        // Of the last run, guarded by prepared_mutex_.
+        mutable Prepared prepared;
+    };
+
+    static bool IsPixelwise(const Segment &segment);
+
+    static bool IsCrop(const Segment &segment);
+
+    // The filters of `segment` from the chain index `first` on, as a segment of their own.
+    static Segment Tail(const Segment &segment, size_t first);
+
+    // A new Bgr bitmap with the result of the segment.
+    Bitmap *ApplySegment(const Segment &segment, const Bitmap *bitmap) const;
+
+    // Whether the output of the filters is grey, given whether their input is.
+    static bool IsGrayAfter(const std::vector<Filter *> &filters, bool gray);
+
+    // Cache keys of the results of filters 0..k applied to `bitmap`, for every k up to the first
+    // filter without a key.
+    std::vector<std::string> CacheKeys(const Bitmap *bitmap) const;
+
+    // The LazyChain of a fused segment for `bitmap`. It is the one kept in the segment, rebuilt if
+    // the input size changed, if `lock` can take prepared_mutex_; otherwise a new one in `local`.
+    const LazyChain &Prepare(const Segment &segment, const Bitmap *bitmap, std::unique_lock<std::mutex> &lock,
+                             std::optional<LazyChain> &local) const;
+
+    // `result` must have the output size of the chain and must not share rows with `bitmap`. Takes
+    // the stages of the bands from `prepared` and keeps them there, or builds them for this run only
+    // without.
+    void ApplyStreamable(const Bitmap *bitmap, Bitmap *result, const LazyChain &chain, Prepared *prepared) const;
+
+    void ApplyPixelwise(Bitmap *bitmap, const std::vector<Filter *> &filters) const;
+
+    std::vector<Segment> segments_;
+    ThreadPool *pool_;
+    ResultCache *cache_;
+    mutable std::mutex prepared_mutex_;
+    // With a cache, the keys of the filters up to the first one with an empty key.
+    std::vector<std::string> keys_;
+};
+
+// Out-of-core evaluation of a chain of streamable filters and crops. The output is produced in
+// strips of rows: for each strip only the input rows it depends on (the strip widened by the
+// filter radii, shifted by the crops) are read, pushed through the stages band by band and the
+// finished rows are written out. Reading, filtering and writing run as three stages on their own
+// threads, the filters on the calling one and its pool, handing strips over through SpscQueues:
+// the next strip is read and the previous one written while one is filtered. Memory stays
+// proportional to the strip height plus the filter radii, whatever the image height. Output is
+// identical to Pipeline.
+class StreamingPipeline {
+public:
+    static constexpr int32_t kMinStripHeight = 256;
+    // Input and output strips each; one is worked on while the stage next to it fills or drains the other.
+    static constexpr int32_t kStripsInFlight = 2;
+
+    explicit StreamingPipeline(const std::vector<Filter *> &filters, ThreadPool *pool = nullptr);
+
+    // The output is written in `format`; the input may be in any.
+    void Run(BmpRowReader &reader, std::ostream &outstream, PixelFormat format = PixelFormat::Bgr) const;
+
+private:
+    std::vector<Filter *> filters_;
+    ThreadPool *pool_;
+};
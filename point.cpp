@@ -0,0 +1,92 @@
+#include "point.h"
+#include "kernels.h"
+#include <cstring>
+
+namespace point {
+
+Lut::Lut() {
+    for (int32_t channel = 0; channel < 3; ++channel) {
+        std::copy(kIdentity.begin(), kIdentity.end(), pre_.begin() + 256 * channel);
+        std::copy(kIdentity.begin(), kIdentity.end(), post_.begin() + 256 * channel);
+    }
+}
+
+void Lut::Map(const Table &table) {
+    Map(table, table, table);
+}
+
+void Lut::Map(const Table &blue, const Table &green, const Table &red) {
+    if (grey_) {
+        Compose(post_, blue, green, red);
+        post_kind_ = Classify(post_);
+    } else {
+        Compose(pre_, blue, green, red);
+        pre_kind_ = Classify(pre_);
+    }
+}
+
+void Lut::Grey() {
+    if (!grey_) {
+        grey_ = true;
+        return;
+    }
+    // Every channel is post(g) of the same grey g, so the new grey is a function of g alone.
+    Table grey;
+    for (int32_t value = 0; value < 256; ++value) {
+        grey[value] = kernels::GreyValue({post_[value], post_[256 + value], post_[512 + value]});
+    }
+    for (int32_t channel = 0; channel < 3; ++channel) {
+        std::copy(grey.begin(), grey.end(), post_.begin() + 256 * channel);
+    }
+    post_kind_ = Classify(post_);
+}
+
+void Lut::ApplyRow(const Color *src, Color *dst, int32_t width) const {
+    if (pre_kind_ != Kind::Identity) {
+        Apply(pre_, pre_kind_, src, dst, width);
+        src = dst;
+    }
+    if (grey_) {
+        GetKernels().grayscale(src, dst, width);
+        src = dst;
+        if (post_kind_ != Kind::Identity) {
+            Apply(post_, post_kind_, src, dst, width);
+        }
+    }
+    if (src != dst) {
+        std::memcpy(dst, src, static_cast<std::size_t>(width) * sizeof(Color));
+    }
+}
+
+void Lut::Compose(Tables &tables, const Table &blue, const Table &green, const Table &red) {
+    for (int32_t value = 0; value < 256; ++value) {
+        tables[value] = blue[tables[value]];
+        tables[256 + value] = green[tables[256 + value]];
+        tables[512 + value] = red[tables[512 + value]];
+    }
+}
+
+Lut::Kind Lut::Classify(const Tables &tables) {
+    auto all_channels = [&](const Table &table) {
+        for (int32_t channel = 0; channel < 3; ++channel) {
+            if (!std::equal(table.begin(), table.end(), tables.begin() + 256 * channel)) {
+                return false;
+            }
+        }
+        return true;
+    };
+    if (all_channels(kIdentity)) {
+        return Kind::Identity;
+    }
+    return all_channels(kInvert) ? Kind::Invert : Kind::Other;
+}
+
+void Lut::Apply(const Tables &tables, Kind kind, const Color *src, Color *dst, int32_t width) {
+    if (kind == Kind::Invert) {
+        GetKernels().negative(src, dst, width);
+    } else {
+        GetKernels().lookup(src, dst, width, tables.data());
+    }
+}
+
+}  // namespace point
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "bitmap.h"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+namespace point {
+
+// A map of one 8-bit channel onto itself.
+using Table = std::array<std::uint8_t, 256>;
+
+// Tabulates `function` over 0..255, clamping its results to 0..255. Usable in constant expressions
+// when `function` is.
+template <class Function>
+constexpr Table MakeTable(Function function) {
+    Table table = {};
+    for (int32_t value = 0; value < 256; ++value) {
+        table[value] = static_cast<std::uint8_t>(std::clamp<int32_t>(function(value), 0, 255));
+    }
+    return table;
+}
+
+constexpr Table kIdentity = MakeTable([](int32_t value) { return value; });
+constexpr Table kInvert = MakeTable([](int32_t value) { return 255 - value; });
+
+// A run of point filters compiled into lookup tables. Every channel goes through its `pre` table;
+// if the run contains a grayscale, the pixel then becomes its grey value and every channel goes
+// through its `post` table. Maps are composed into the tables as they are appended and a
+// grayscale after a grayscale folds into `post`, so applying the run costs at most two table
+// passes and one grey conversion per pixel, however many filters it has.
+class Lut {
+public:
+    Lut();
+
+    // Appends the same map for every channel.
+    void Map(const Table &table);
+
+    // Appends one map per channel.
+    void Map(const Table &blue, const Table &green, const Table &red);
+
+    // Appends Grayscale.
+    void Grey();
+
+    // src and dst may be the same row.
+    void ApplyRow(const Color *src, Color *dst, int32_t width) const;
+
+private:
+    // 256 entries per channel, blue first.
+    using Tables = std::array<std::uint8_t, 3 * 256>;
+
+    // Tables that need no lookups: identity is skipped, inversion uses the negative kernel.
+    enum class Kind { Identity, Invert, Other };
+
+    static void Compose(Tables &tables, const Table &blue, const Table &green, const Table &red);
+
+    static Kind Classify(const Tables &tables);
+
+    static void Apply(const Tables &tables, Kind kind, const Color *src, Color *dst, int32_t width);
+
+    Tables pre_;
+    Tables post_;
+    Kind pre_kind_ = Kind::Identity;
+    bool grey_ = false;
+    Kind post_kind_ = Kind::Identity;
+};
+
+}  // namespace point
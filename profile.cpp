@@ -0,0 +1,163 @@
+#include "profile.h"
+#include <atomic>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+
+namespace {
+
+std::atomic<Profiler *> active_profiler = nullptr;
+std::atomic<int> thread_count = 0;
+thread_local int thread_id = thread_count++;
+thread_local std::uint64_t allocated_bytes = 0;
+
+double ProcessCpuMicroseconds() {
+    timespec time;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+    return time.tv_sec * 1e6 + time.tv_nsec / 1e3;
+}
+
+double PeakRssMb() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("VmHWM:", 0) == 0) {
+            return std::strtod(line.c_str() + 6, nullptr) / 1024.0;
+        }
+    }
+    return 0;
+}
+
+void WriteJsonString(std::ostream &out, const std::string &value) {
+    out << '"';
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out << '\\';
+        }
+        out << c;
+    }
+    out << '"';
+}
+
+}  // namespace
+
+Profiler::Profiler(std::optional<Format> format, std::string trace_path)
+        : format_(format), trace_path_(std::move(trace_path)), origin_(std::chrono::steady_clock::now()) {
+}
+
+Profiler *Profiler::Active() {
+    return active_profiler.load(std::memory_order_relaxed);
+}
+
+void Profiler::SetActive(Profiler *profiler) {
+    active_profiler.store(profiler);
+}
+
+void Profiler::CountAllocation(std::size_t bytes) {
+    if (Active() != nullptr) {
+        allocated_bytes += bytes;
+    }
+}
+
+double Profiler::Microseconds(std::chrono::steady_clock::time_point time) const {
+    return std::chrono::duration<double, std::micro>(time - origin_).count();
+}
+
+void Profiler::Record(Event event) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    events_.push_back(std::move(event));
+}
+
+void Profiler::Finish(std::ostream &report) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (format_ == Format::Text) {
+        report << std::left << std::setw(28) << "stage" << std::right << std::setw(4) << "thr" << std::setw(11)
+               << "wall ms" << std::setw(11) << "cpu ms" << std::setw(12) << "alloc MB" << std::setw(10) << "peak MB"
+               << std::setw(10) << "MP/s" << '\n';
+    }
+    for (const Event &event : events_) {
+        if (!event.stage || !format_) {
+            continue;
+        }
+        double mp_per_s = event.pixels > 0 && event.wall_us > 0 ? event.pixels / event.wall_us : 0;
+        if (*format_ == Format::Text) {
+            report << std::left << std::setw(28) << event.name << std::right << std::setw(4) << event.thread
+                   << std::fixed << std::setprecision(2) << std::setw(11) << event.wall_us / 1e3 << std::setw(11)
+                   << event.cpu_us / 1e3 << std::setw(12) << event.allocated / 1048576.0 << std::setprecision(1)
+                   << std::setw(10) << event.peak_rss_mb << std::setw(10) << mp_per_s << '\n';
+        } else {
+            report << "{\"stage\": ";
+            WriteJsonString(report, event.name);
+            report << ", \"thread\": " << event.thread << std::fixed << std::setprecision(3)
+                   << ", \"start_ms\": " << event.start_us / 1e3 << ", \"wall_ms\": " << event.wall_us / 1e3
+                   << ", \"cpu_ms\": " << event.cpu_us / 1e3 << ", \"allocated_bytes\": " << event.allocated
+                   << ", \"peak_rss_mb\": " << event.peak_rss_mb << ", \"pixels\": " << event.pixels
+                   << ", \"mp_per_s\": " << mp_per_s << "}\n";
+        }
+    }
+    report << std::defaultfloat << std::flush;
+
+    if (trace_path_.empty()) {
+        return;
+    }
+    std::ofstream trace(trace_path_);
+    if (!trace) {
+        throw std::runtime_error("Could not open the trace file");
+    }
+    trace << "{\"traceEvents\": [" << std::fixed << std::setprecision(3);
+    for (std::size_t k = 0; k < events_.size(); ++k) {
+        const Event &event = events_[k];
+        trace << (k == 0 ? "\n" : ",\n") << "{\"name\": ";
+        WriteJsonString(trace, event.name);
+        trace << ", \"cat\": \"" << (event.stage ? "stage" : "span") << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+              << event.thread << ", \"ts\": " << event.start_us << ", \"dur\": " << event.wall_us;
+        if (event.stage) {
+            trace << ", \"args\": {\"cpu_ms\": " << event.cpu_us / 1e3 << ", \"allocated_bytes\": " << event.allocated
+                  << ", \"peak_rss_mb\": " << event.peak_rss_mb << ", \"pixels\": " << event.pixels << "}";
+        }
+        trace << "}";
+    }
+    trace << "\n]}\n";
+}
+
+Profiler::Stage::Stage(std::string_view name, std::int64_t pixels) : profiler_(Active()) {
+    if (profiler_ == nullptr) {
+        return;
+    }
+    name_ = name;
+    pixels_ = pixels;
+    allocated_start_ = allocated_bytes;
+    cpu_start_ = ProcessCpuMicroseconds();
+    start_ = std::chrono::steady_clock::now();
+}
+
+Profiler::Stage::~Stage() {
+    if (profiler_ == nullptr) {
+        return;
+    }
+    auto end = std::chrono::steady_clock::now();
+    double cpu_end = ProcessCpuMicroseconds();
+    profiler_->Record({std::move(name_), true, thread_id, profiler_->Microseconds(start_),
+                       std::chrono::duration<double, std::micro>(end - start_).count(), cpu_end - cpu_start_,
+                       allocated_bytes - allocated_start_, PeakRssMb(), pixels_});
+}
+
+void Profiler::Stage::SetPixels(std::int64_t pixels) {
+    pixels_ = pixels;
+}
+
+Profiler::Span::Span(const char *name) : profiler_(Active()), name_(name) {
+    if (profiler_ != nullptr) {
+        start_ = std::chrono::steady_clock::now();
+    }
+}
+
+Profiler::Span::~Span() {
+    if (profiler_ == nullptr) {
+        return;
+    }
+    auto end = std::chrono::steady_clock::now();
+    profiler_->Record({name_, false, thread_id, profiler_->Microseconds(start_),
+                       std::chrono::duration<double, std::micro>(end - start_).count(), 0, 0, 0, 0});
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Collects per-stage measurements of a run. Instrumentation points are Stage and Span objects
+// placed around the work; both only check Profiler::Active() when no profiler is installed,
+// so leaving them in costs a load and a branch.
+class Profiler {
+public:
+    enum class Format { Text, JsonLines };
+
+    // `format` selects the report printed by Finish; a non-empty `trace_path` also writes a
+    // Chrome trace (chrome://tracing, Perfetto) with every stage and span on its thread.
+    Profiler(std::optional<Format> format, std::string trace_path);
+
+    static Profiler *Active();
+
+    // Installs the profiler for all threads; pass nullptr to remove it.
+    static void SetActive(Profiler *profiler);
+
+    // Pixel buffers allocated on this thread count against the stages open on it.
+    static void CountAllocation(std::size_t bytes);
+
+    void Finish(std::ostream &report) const;
+
+    // Wall and CPU time (process-wide, so work handed to the pool counts), bytes of pixel
+    // buffers allocated on the thread, peak resident memory of the process so far, and pixel
+    // throughput of one stage.
+    class Stage {
+    public:
+        explicit Stage(std::string_view name, std::int64_t pixels = 0);
+
+        ~Stage();
+
+        Stage(const Stage &) = delete;
+
+        Stage &operator=(const Stage &) = delete;
+
+        void SetPixels(std::int64_t pixels);
+
+    private:
+        Profiler *profiler_;
+        std::string name_;
+        std::int64_t pixels_ = 0;
+        std::chrono::steady_clock::time_point start_;
+        double cpu_start_ = 0;
+        std::uint64_t allocated_start_ = 0;
+    };
+
+    // Timeline-only interval, e.g. one band of a parallel stage; shows up in the trace only.
+    class Span {
+    public:
+        explicit Span(const char *name);
+
+        ~Span();
+
+        Span(const Span &) = delete;
+
+        Span &operator=(const Span &) = delete;
+
+    private:
+        Profiler *profiler_;
+        const char *name_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+private:
+    struct Event {
+        std::string name;
+        bool stage;
+        int thread;
+        double start_us;
+        double wall_us;
+        double cpu_us;
+        std::uint64_t allocated;
+        double peak_rss_mb;
+        std::int64_t pixels;
+    };
+
+    void Record(Event event);
+
+    double Microseconds(std::chrono::steady_clock::time_point time) const;
+
+    std::optional<Format> format_;
+    std::string trace_path_;
+    std::chrono::steady_clock::time_point origin_;
+    mutable std::mutex mutex_;
+    std::vector<Event> events_;
+};
@@ -0,0 +1,97 @@
+#include "protocol.h"
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace protocol {
+
+namespace {
+
+// EAGAIN and EWOULDBLOCK, a timeout set on the socket running out, fail like any other error.
+bool ReadAll(int fd, char *data, std::size_t size) {
+    while (size > 0) {
+        ssize_t count = read(fd, data, size);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        data += count;
+        size -= count;
+    }
+    return true;
+}
+
+bool WriteAll(int fd, const char *data, std::size_t size) {
+    while (size > 0) {
+        ssize_t count = send(fd, data, size, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        data += count;
+        size -= count;
+    }
+    return true;
+}
+
+bool ReadField(int fd, std::string &field, std::uint64_t limit) {
+    unsigned char bytes[8];
+    if (!ReadAll(fd, reinterpret_cast<char *>(bytes), sizeof(bytes))) {
+        return false;
+    }
+    std::uint64_t size = 0;
+    for (int32_t k = 7; k >= 0; --k) {
+        size = size << 8 | bytes[k];
+    }
+    if (size > limit) {
+        return false;
+    }
+    field.resize(size);
+    return ReadAll(fd, field.data(), size);
+}
+
+bool WriteField(int fd, const std::string &field) {
+    unsigned char bytes[8];
+    std::uint64_t size = field.size();
+    for (int32_t k = 0; k < 8; ++k) {
+        bytes[k] = static_cast<unsigned char>(size >> (8 * k));
+    }
+    return WriteAll(fd, reinterpret_cast<const char *>(bytes), sizeof(bytes)) &&
+           WriteAll(fd, field.data(), field.size());
+}
+
+}  // namespace
+
+bool Read(int fd, Message &message) {
+    return ReadField(fd, message.text, kMaxTextSize) && ReadField(fd, message.data, kMaxDataSize);
+}
+
+bool Write(int fd, const Message &message) {
+    return WriteField(fd, message.text) && WriteField(fd, message.data);
+}
+
+int Connect(const std::string &path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+}  // namespace protocol
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Messages between the filter server and its clients. On the wire a message is its text and its
+// data, each preceded by its length as a little-endian 64-bit integer. A connection carries one
+// request and its response.
+//
+// Request text: the input and output paths and the filters, one command line argument per line,
+// e.g. "in.bmp\nout.bmp\n-blur\n2". An input path of "-" means the BMP is in the request data,
+// an output path of "-" asks for the BMP in the response data. "stats" and "shutdown" are
+// requests of their own.
+//
+// Response text: "ok", followed by a space and the output path or the statistics when there are
+// any, or "error " and the message.
+namespace protocol {
+
+constexpr std::uint64_t kMaxTextSize = std::uint64_t{1} << 20;
+constexpr std::uint64_t kMaxDataSize = std::uint64_t{1} << 34;
+
+struct Message {
+    std::string text;
+    std::string data;
+};
+
+// False if the peer closed the connection, a read failed or timed out, or a length exceeds its
+// limit.
+bool Read(int fd, Message &message);
+
+// False if a write failed or timed out.
+bool Write(int fd, const Message &message);
+
+// A connected Unix domain socket, or -1.
+int Connect(const std::string &path);
+
+}  // namespace protocol
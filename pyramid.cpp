@@ -0,0 +1,132 @@
+#include "pyramid.h"
+#include "filter.h"
+#include "kernels.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+// Left neighbour and weight of the right one, in 1/256, of every output position.
+struct Taps {
+    std::vector<int32_t> left;
+    std::vector<int32_t> right;
+    std::vector<std::uint16_t> weight;
+};
+
+Taps Interpolation(int32_t count, int32_t coarse_count, int32_t level) {
+    Taps taps;
+    for (int32_t x = 0; x < count; ++x) {
+        int32_t position = (((2 * x + 1) * 128) >> level) - 128;
+        int32_t left = position >> 8;
+        int32_t weight = position & 255;
+        if (left < 0) {
+            left = 0;
+            weight = 0;
+        }
+        if (left >= coarse_count - 1) {
+            left = coarse_count - 1;
+            weight = 0;
+        }
+        taps.left.push_back(left);
+        taps.right.push_back(std::min(left + 1, coarse_count - 1));
+        taps.weight.push_back(static_cast<std::uint16_t>(weight));
+    }
+    return taps;
+}
+
+void Stretch(const Color *src, const Taps &columns, std::uint8_t *dst, int32_t width) {
+    const auto *in = reinterpret_cast<const std::uint8_t *>(src);
+    for (int32_t x = 0; x < width; ++x) {
+        const std::uint8_t *left = in + 3 * columns.left[x];
+        const std::uint8_t *right = in + 3 * columns.right[x];
+        std::uint32_t weight = columns.weight[x];
+        for (int32_t c = 0; c < 3; ++c) {
+            dst[3 * x + c] = static_cast<std::uint8_t>((left[c] * (256 - weight) + right[c] * weight + 128) >> 8);
+        }
+    }
+}
+
+void Blend(const std::uint8_t *top, const std::uint8_t *bottom, std::uint16_t weight, std::uint8_t *dst,
+           std::size_t size) {
+    if (weight == 0) {
+        std::memcpy(dst, top, size);
+        return;
+    }
+    std::uint16_t keep = 256 - weight;
+    for (std::size_t k = 0; k < size; ++k) {
+        dst[k] = static_cast<std::uint8_t>((top[k] * keep + bottom[k] * weight + 128) >> 8);
+    }
+}
+
+}  // namespace
+
+Pyramid::Pyramid(const Bitmap *base, ThreadPool *pool) : base_(base), pool_(pool) {
+}
+
+const Bitmap *Pyramid::GetLevel(int32_t level) {
+    while (static_cast<int32_t>(levels_.size()) < level) {
+        levels_.emplace_back(Downsample(levels_.empty() ? base_ : levels_.back().get(), pool_));
+    }
+    return level == 0 ? base_ : levels_[level - 1].get();
+}
+
+Bitmap *Pyramid::Release(int32_t level) {
+    GetLevel(level);
+    return levels_[level - 1].release();
+}
+
+Bitmap *Pyramid::Downsample(const Bitmap *bitmap, ThreadPool *pool) {
+    int32_t height = bitmap->GetHeight();
+    int32_t width = bitmap->GetWidth();
+    BitmapFileHeader file_header = bitmap->GetFileHeader();
+    BitmapInfoHeader info_header = bitmap->GetInfoHeader();
+    Crop((width + 1) / 2, (height + 1) / 2).UpdateSize(file_header, info_header);
+    Bitmap *result = new Bitmap(file_header, info_header);
+    const Kernels &kernels = GetKernels();
+    RowBands(result->GetHeight(), pool).Run([&](int32_t begin, int32_t end) {
+        for (int32_t i = begin; i < end; ++i) {
+            const Color *top = bitmap->GetRow(2 * i);
+            const Color *bottom = bitmap->GetRow(std::min(2 * i + 1, height - 1));
+            Color *dst = result->GetRow(i);
+            // Rounding half up on every row would brighten each level by 1/8 on average.
+            int32_t rounding = 1 + i % 2;
+            kernels.downsample(top, bottom, dst, width / 2, rounding);
+            if (width % 2 != 0) {
+                const Color &upper = top[width - 1];
+                const Color &lower = bottom[width - 1];
+                dst[width / 2] = {static_cast<std::uint8_t>((2 * (upper.blue + lower.blue) + rounding) >> 2),
+                                  static_cast<std::uint8_t>((2 * (upper.green + lower.green) + rounding) >> 2),
+                                  static_cast<std::uint8_t>((2 * (upper.red + lower.red) + rounding) >> 2)};
+            }
+        }
+    });
+    return result;
+}
+
+void Pyramid::Upsample(const Bitmap *coarse, int32_t level, Bitmap *result, ThreadPool *pool) {
+    int32_t height = result->GetHeight();
+    int32_t width = result->GetWidth();
+    Taps rows = Interpolation(height, coarse->GetHeight(), level);
+    Taps columns = Interpolation(width, coarse->GetWidth(), level);
+    std::size_t size = static_cast<std::size_t>(width) * sizeof(Color);
+
+    // Coarse rows are stretched to the full width once per band and blended a full row at a time.
+    RowBands(height, pool).Run([&](int32_t begin, int32_t end) {
+        std::vector<std::uint8_t> stretched[2] = {std::vector<std::uint8_t>(size), std::vector<std::uint8_t>(size)};
+        int32_t loaded[2] = {-1, -1};
+        auto row = [&](int32_t index) {
+            int32_t slot = index % 2;
+            if (loaded[slot] != index) {
+                Stretch(coarse->GetRow(index), columns, stretched[slot].data(), width);
+                loaded[slot] = index;
+            }
+            return stretched[slot].data();
+        };
+        for (int32_t i = begin; i < end; ++i) {
+            const std::uint8_t *top = row(rows.left[i]);
+            const std::uint8_t *bottom = row(rows.right[i]);
+            Blend(top, bottom, rows.weight[i], reinterpret_cast<std::uint8_t *>(result->GetRow(i)), size);
+        }
+    });
+}
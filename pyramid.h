@@ -0,0 +1,37 @@
+#pragma once
+
+#include "bitmap.h"
+#include <memory>
+#include <vector>
+
+class ThreadPool;
+
+// An image at halving resolutions. Level k + 1 is level k with every 2 x 2 block averaged, odd
+// sizes rounded up by pairing the last row or column with itself, so a pixel of level k covers a
+// 2^k x 2^k block of the base. Levels are built on first use and kept until released.
+class Pyramid {
+public:
+    // Upsample works in 1/256 pixel steps, which are exact up to this level.
+    static constexpr int32_t kMaxLevel = 7;
+
+    explicit Pyramid(const Bitmap *base, ThreadPool *pool = nullptr);
+
+    // Level 0 is the base.
+    const Bitmap *GetLevel(int32_t level);
+
+    // Hands a level from 1 up over to the caller; the levels above it can no longer be built.
+    Bitmap *Release(int32_t level);
+
+    static Bitmap *Downsample(const Bitmap *bitmap, ThreadPool *pool = nullptr);
+
+    // Bilinear interpolation of `coarse`, the given level of an image the size of `result`, back to
+    // that size. Sample positions follow the blocks of Downsample: output pixel x reads coarse
+    // position (x + 0.5) / 2^level - 0.5, clamped to the edge pixels.
+    static void Upsample(const Bitmap *coarse, int32_t level, Bitmap *result, ThreadPool *pool = nullptr);
+
+private:
+    const Bitmap *base_;
+    ThreadPool *pool_;
+    // levels_[k - 1] holds level k.
+    std::vector<std::unique_ptr<Bitmap>> levels_;
+};
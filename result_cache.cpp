@@ -0,0 +1,251 @@
+#include "result_cache.h"
+#include "bmp_io.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace {
+
+// Bumped whenever the meaning of a key or the layout of an entry changes.
+constexpr char kFormat[] = "v2";
+
+constexpr std::uint64_t kPrime1 = 0x9E3779B185EBCA87ULL;
+constexpr std::uint64_t kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr std::uint64_t kPrime3 = 0x165667B19E3779F9ULL;
+
+std::uint64_t Rotate(std::uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+std::uint64_t Avalanche(std::uint64_t value) {
+    value ^= value >> 33;
+    value *= kPrime2;
+    value ^= value >> 29;
+    value *= kPrime3;
+    value ^= value >> 32;
+    return value;
+}
+
+// XXH64-style rounds over four independent lanes of 8-byte words, so that the multiplies of
+// neighbouring words overlap. Not cryptographic, but 128 bits of output keep accidental
+// collisions out of reach for a cache.
+class Hasher {
+public:
+    // Every call is hashed as one framed message: the tail is padded and the length mixed in.
+    void Update(const void *data, std::size_t size) {
+        const auto *bytes = static_cast<const std::uint8_t *>(data);
+        std::size_t k = 0;
+        for (; k + 32 <= size; k += 32) {
+            Block(bytes + k);
+        }
+        std::uint8_t tail[32] = {};
+        std::memcpy(tail, bytes + k, size - k);
+        Block(tail);
+        lanes_[0] = Round(lanes_[0], size);
+    }
+
+    std::string Finish() const {
+        std::uint64_t low = Avalanche(Rotate(lanes_[0], 1) + Rotate(lanes_[1], 7) + Rotate(lanes_[2], 12) +
+                                      Rotate(lanes_[3], 18));
+        std::uint64_t high = Avalanche(lanes_[0] ^ Rotate(lanes_[1], 29) ^ Rotate(lanes_[2], 41) ^
+                                       Rotate(lanes_[3], 53) ^ kPrime3);
+        static constexpr char kDigits[] = "0123456789abcdef";
+        std::string digest(32, '0');
+        for (int32_t k = 0; k < 16; ++k) {
+            digest[15 - k] = kDigits[(high >> (4 * k)) & 15];
+            digest[31 - k] = kDigits[(low >> (4 * k)) & 15];
+        }
+        return digest;
+    }
+
+private:
+    static std::uint64_t Round(std::uint64_t lane, std::uint64_t word) {
+        return Rotate(lane + word * kPrime2, 31) * kPrime1;
+    }
+
+    void Block(const std::uint8_t *block) {
+        for (int32_t lane = 0; lane < 4; ++lane) {
+            std::uint64_t word;
+            std::memcpy(&word, block + 8 * lane, sizeof(word));
+            lanes_[lane] = Round(lanes_[lane], word);
+        }
+    }
+
+    std::uint64_t lanes_[4] = {kPrime1 + kPrime2, kPrime2, 0, 0 - kPrime1};
+};
+
+// An entry is named after its key, 32 hex digits, so other files in the directory are never evicted.
+bool IsEntry(const std::filesystem::path &path) {
+    std::string name = path.filename().string();
+    return name.size() == 36 && name.compare(32, 4, ".bmp") == 0 &&
+           std::all_of(name.begin(), name.begin() + 32,
+                       [](unsigned char c) { return std::isdigit(c) || (c >= 'a' && c <= 'f'); });
+}
+
+}  // namespace
+
+ResultCache::ResultCache(std::string directory, std::uint64_t capacity)
+        : directory_(std::move(directory)), capacity_(capacity) {
+    std::error_code error;
+    std::filesystem::create_directories(directory_, error);
+    if (!std::filesystem::is_directory(directory_)) {
+        throw std::runtime_error("Could not create the cache directory");
+    }
+    std::lock_guard<std::mutex> lock(eviction_mutex_);
+    Evict();
+}
+
+std::string ResultCache::Digest(const Bitmap *bitmap) {
+    Hasher hasher;
+    PixelFormat format = bitmap->GetFormat();
+    std::int32_t size[3] = {bitmap->GetWidth(), bitmap->GetHeight(), static_cast<std::int32_t>(format)};
+    hasher.Update(size, sizeof(size));
+    for (std::int32_t i = 0; i < bitmap->GetHeight(); ++i) {
+        hasher.Update(bitmap->GetRow(i), static_cast<std::size_t>(bitmap->GetWidth()) * Bitmap::PixelSize(format));
+    }
+    return hasher.Finish();
+}
+
+std::string ResultCache::Key(const std::string &digest, const std::string &chain) {
+    Hasher hasher;
+    hasher.Update(kFormat, sizeof(kFormat));
+    hasher.Update(digest.data(), digest.size());
+    hasher.Update(chain.data(), chain.size());
+    return hasher.Finish();
+}
+
+std::pair<std::size_t, Bitmap *> ResultCache::LoadLast(const std::vector<std::string> &keys) {
+    for (std::size_t k = keys.size(); k-- > 0;) {
+        std::string path = PathOf(keys[k]);
+        std::error_code error;
+        if (!std::filesystem::is_regular_file(path, error)) {
+            continue;
+        }
+        // Another process may evict the entry in the meantime; that is a miss as well.
+        Bitmap *bitmap = nullptr;
+        try {
+            bitmap = BmpReader::Read(path.c_str());
+        } catch (const std::exception &) {
+        }
+        if (bitmap == nullptr) {
+            continue;
+        }
+        std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), error);
+        ++hits_;
+        return {k, bitmap};
+    }
+    ++misses_;
+    return {keys.size(), nullptr};
+}
+
+void ResultCache::Store(const std::string &key, const Bitmap *bitmap) {
+    PixelFormat format = bitmap->GetFormat();
+    std::uint64_t size = sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader) +
+                         (format == PixelFormat::Gray ? Bitmap::kPaletteSize : 0) +
+                         static_cast<std::uint64_t>(Bitmap::PaddedRowSize(bitmap->GetWidth(), format)) *
+                                 bitmap->GetHeight();
+    if (size > capacity_) {
+        return;
+    }
+    // Written under a unique name and renamed into place, so that readers never see a partial entry.
+    std::string path = PathOf(key);
+    std::string temporary = path + "." + std::to_string(getpid()) + "." + std::to_string(temporaries_++) + ".tmp";
+    std::ofstream outstream(temporary, std::ios::out | std::ios::binary);
+    if (outstream) {
+        BmpRowWriter writer(outstream, bitmap->GetFileHeader(), bitmap->GetInfoHeader());
+        writer.WriteRows(bitmap);
+        writer.Flush();
+        outstream.close();
+    }
+    std::error_code error;
+    if (!outstream) {
+        std::filesystem::remove(temporary, error);
+        return;
+    }
+    // An entry stored again under the same key is replaced.
+    std::uint64_t replaced = std::filesystem::file_size(path, error);
+    if (error) {
+        replaced = 0;
+    }
+    std::filesystem::rename(temporary, path, error);
+    if (error) {
+        std::filesystem::remove(temporary, error);
+        return;
+    }
+    ++stored_;
+    std::lock_guard<std::mutex> lock(eviction_mutex_);
+    total_ += size;
+    total_ -= std::min(replaced, total_);
+    if (total_ > capacity_) {
+        Evict();
+    }
+}
+
+std::size_t ResultCache::GetHits() const {
+    return hits_;
+}
+
+std::size_t ResultCache::GetMisses() const {
+    return misses_;
+}
+
+std::size_t ResultCache::GetStored() const {
+    return stored_;
+}
+
+std::size_t ResultCache::GetEvicted() const {
+    return evicted_;
+}
+
+void ResultCache::Report(std::ostream &report) const {
+    report << GetHits() << " hits, " << GetMisses() << " misses, " << GetStored() << " stored, " << GetEvicted()
+           << " evicted";
+}
+
+std::string ResultCache::PathOf(const std::string &key) const {
+    return (std::filesystem::path(directory_) / (key + ".bmp")).string();
+}
+
+void ResultCache::Evict() {
+    struct Entry {
+        std::filesystem::file_time_type time;
+        std::uint64_t size;
+        std::filesystem::path path;
+    };
+
+    std::vector<Entry> entries;
+    std::uint64_t total = 0;
+    std::error_code error;
+    for (std::filesystem::directory_iterator it(directory_, error), end; !error && it != end; it.increment(error)) {
+        if (!IsEntry(it->path())) {
+            continue;
+        }
+        std::error_code time_error;
+        std::error_code size_error;
+        Entry entry = {it->last_write_time(time_error), it->file_size(size_error), it->path()};
+        if (!time_error && !size_error) {
+            total += entry.size;
+            entries.push_back(std::move(entry));
+        }
+    }
+    total_ = total;
+    if (total <= capacity_) {
+        return;
+    }
+    std::uint64_t target = capacity_ / kLowWaterDenominator * kLowWaterNumerator;
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.time < b.time; });
+    for (const Entry &entry : entries) {
+        if (total <= target) {
+            break;
+        }
+        if (std::filesystem::remove(entry.path, error)) {
+            total -= entry.size;
+            ++evicted_;
+        }
+    }
+    total_ = total;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "bitmap.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Content-addressed store of filtered images on disk. An entry is keyed by a digest of the input
+// pixels and the keys of the filters applied to them (Filter::GetKey), and is saved as a plain BMP
+// named after its key. Once the entries grow past the capacity the least recently used ones are
+// removed, down to kLowWaterNumerator / kLowWaterDenominator of it; use is tracked through the file
+// modification time, which a hit refreshes, so the order survives between runs and holds for
+// several processes sharing the directory. Files not named like an entry are never touched.
+// The total size is kept as entries are stored, and the directory is only scanned again to evict,
+// which also picks up what other processes stored.
+class ResultCache {
+public:
+    static constexpr std::uint64_t kDefaultCapacity = std::uint64_t{1} << 30;
+    static constexpr std::uint64_t kLowWaterNumerator = 7;
+    static constexpr std::uint64_t kLowWaterDenominator = 8;
+
+    // Creates the directory if needed and evicts down to the capacity; throws std::runtime_error if
+    // the directory can not be created.
+    explicit ResultCache(std::string directory, std::uint64_t capacity = kDefaultCapacity);
+
+    ResultCache(const ResultCache &) = delete;
+
+    ResultCache &operator=(const ResultCache &) = delete;
+
+    // 128-bit digest of the size and pixels of an image, row padding excluded, as 32 hex digits.
+    static std::string Digest(const Bitmap *bitmap);
+
+    // Key of the filter chain described by `chain` applied to the image with digest `digest`.
+    static std::string Key(const std::string &digest, const std::string &chain);
+
+    // Looks `keys` up from the last one to the first and loads the first entry found. Returns the
+    // index of its key and the image, which the caller owns, or {keys.size(), nullptr}. Counts
+    // one hit or one miss.
+    std::pair<std::size_t, Bitmap *> LoadLast(const std::vector<std::string> &keys);
+
+    // Saves the image under `key`, then evicts entries if that takes them over the capacity. An image larger than
+    // the capacity is not saved. Failures to write are ignored, the cache only loses the entry.
+    void Store(const std::string &key, const Bitmap *bitmap);
+
+    std::size_t GetHits() const;
+
+    std::size_t GetMisses() const;
+
+    std::size_t GetStored() const;
+
+    std::size_t GetEvicted() const;
+
+    // "N hits, N misses, N stored, N evicted".
+    void Report(std::ostream &report) const;
+
+private:
+    std::string PathOf(const std::string &key) const;
+
+    // Rescans the entries into total_ and evicts the oldest if they are over the capacity. Must be
+    // called with eviction_mutex_ held.
+    void Evict();
+
+    std::string directory_;
+    std::uint64_t capacity_;
+    std::atomic<std::size_t> hits_ = 0;
+    std::atomic<std::size_t> misses_ = 0;
+    std::atomic<std::size_t> stored_ = 0;
+    std::atomic<std::size_t> evicted_ = 0;
+    std::atomic<std::size_t> temporaries_ = 0;
+    std::mutex eviction_mutex_;
+    // Size of the entries on disk, as far as this process knows.
+    std::uint64_t total_ = 0;
+};
@@ -0,0 +1,237 @@
+#include "server.h"
+#include "bmp_io.h"
+#include "controller.h"
+#include "pipeline.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+std::vector<std::string> SplitLines(const std::string &text) {
+    std::vector<std::string> lines;
+    std::istringstream stream(text);
+    std::string line;
+    while (std::getline(stream, line)) {
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+bool IsControlRequest(const std::string &text) {
+    return text == "stats" || text == "shutdown";
+}
+
+// Reads and writes on the socket fail with EAGAIN after `timeout` without progress.
+bool SetTimeouts(int fd, std::chrono::seconds timeout) {
+    timeval value = {};
+    value.tv_sec = static_cast<time_t>(timeout.count());
+    return setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &value, sizeof(value)) == 0 &&
+           setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &value, sizeof(value)) == 0;
+}
+
+}  // namespace
+
+Server::Server(std::string socket_path, std::size_t worker_count, ResultCache *cache)
+        : socket_path_(std::move(socket_path)), worker_count_(std::max<std::size_t>(worker_count, 1)), cache_(cache) {
+}
+
+void Server::Run() {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socket_path_.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("The socket path is too long");
+    }
+    std::memcpy(address.sun_path, socket_path_.c_str(), socket_path_.size() + 1);
+    listener_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener_ < 0) {
+        throw std::runtime_error("Could not create the socket");
+    }
+    unlink(socket_path_.c_str());
+    if (bind(listener_, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0 ||
+        listen(listener_, SOMAXCONN) != 0) {
+        close(listener_);
+        throw std::runtime_error("Could not listen on the socket");
+    }
+
+    std::vector<std::thread> workers;
+    for (std::size_t k = 0; k < worker_count_; ++k) {
+        workers.emplace_back(&Server::WorkerLoop, this);
+    }
+    while (true) {
+        int fd = accept(listener_, nullptr, nullptr);
+        int error = errno;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+                break;
+            }
+            if (fd >= 0) {
+                queue_.push_back({fd, Clock::now()});
+                ready_.notify_one();
+                continue;
+            }
+        }
+        if (error == EINTR || error == ECONNABORTED) {
+            continue;
+        }
+        std::cerr << "accept: " << std::strerror(error) << std::endl;
+        if (error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM) {
+            // Out of descriptors or memory for now; requests that finish give some back.
+            std::this_thread::sleep_for(kAcceptBackoff);
+            continue;
+        }
+        // The listener itself is broken: stop taking requests and finish the queued ones.
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        ready_.notify_all();
+        break;
+    }
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    close(listener_);
+    unlink(socket_path_.c_str());
+}
+
+void Server::WorkerLoop() {
+    BufferPool::Scope scope(&buffers_);
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            ready_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return;
+            }
+            job = queue_.front();
+            queue_.pop_front();
+            ++active_;
+        }
+        Handle(job);
+        std::lock_guard<std::mutex> lock(mutex_);
+        --active_;
+    }
+}
+
+void Server::Handle(const Job &job) {
+    protocol::Message request;
+    protocol::Message response;
+    bool succeeded = false;
+    if (!SetTimeouts(job.fd, kIoTimeout) || !protocol::Read(job.fd, request)) {
+        response.text = "error could not read the request";
+    } else {
+        try {
+            response = Process(request);
+            succeeded = true;
+        } catch (const std::exception &e) {
+            response.text = std::string("error ") + e.what();
+        }
+    }
+    protocol::Write(job.fd, response);
+    close(job.fd);
+    if (IsControlRequest(request.text)) {
+        return;
+    }
+
+    double milliseconds = std::chrono::duration<double, std::milli>(Clock::now() - job.accepted).count();
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++(succeeded ? served_ : failed_);
+    if (latencies_.size() < kLatencyWindow) {
+        latencies_.push_back(milliseconds);
+    } else {
+        latencies_[next_latency_] = milliseconds;
+        next_latency_ = (next_latency_ + 1) % kLatencyWindow;
+    }
+}
+
+protocol::Message Server::Process(protocol::Message &request) {
+    if (request.text == "stats") {
+        return {"ok " + Stats(), ""};
+    }
+    if (request.text == "shutdown") {
+        Stop();
+        return {"ok", ""};
+    }
+    std::vector<std::string> args = SplitLines(request.text);
+    if (args.size() < 2) {
+        throw MyException("not enough parameters entered");
+    }
+    std::vector<char *> argv;
+    for (std::string &arg : args) {
+        argv.push_back(arg.data());
+    }
+    std::vector<std::unique_ptr<Filter>> owned_filters =
+            Controller::ParseFilters(static_cast<int>(argv.size()) - 2, argv.data() + 2);
+    std::vector<Filter *> filters;
+    for (const std::unique_ptr<Filter> &filter : owned_filters) {
+        filters.push_back(filter.get());
+    }
+
+    const std::string &input = args[0];
+    const std::string &output = args[1];
+    std::error_code error;
+    if (input != "-" && output != "-" && std::filesystem::equivalent(input, output, error)) {
+        throw MyException("the output file is the input file");
+    }
+    std::unique_ptr<Bitmap> bitmap(input == "-" ? BmpReader::FromMemory(std::move(request.data))
+                                                : BmpReader::Read(input.c_str()));
+    if (bitmap == nullptr) {
+        throw std::runtime_error("Could not read the input file");
+    }
+    Bitmap *image = filters.empty() ? bitmap.get() : Pipeline(filters, nullptr, cache_).ApplyInPlace(bitmap.get());
+    std::unique_ptr<Bitmap> filtered(image != bitmap.get() ? image : nullptr);
+    BitmapFileHeader file_header = image->GetFileHeader();
+    BitmapInfoHeader info_header = image->GetInfoHeader();
+    Bitmap::SetFormat(file_header, info_header, PixelFormat::Bgr);
+
+    if (output == "-") {
+        std::ostringstream outstream;
+        BmpRowWriter writer(outstream, file_header, info_header);
+        writer.WriteRows(image);
+        writer.Flush();
+        return {"ok", std::move(outstream).str()};
+    }
+    // Other requests may be reading the output, mapped.
+    OutputFile outfile(output);
+    BmpRowWriter writer(outfile.GetStream(), file_header, info_header);
+    writer.WriteRows(image);
+    writer.Flush();
+    outfile.Commit();
+    return {"ok " + output, ""};
+}
+
+std::string Server::Stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<double> sorted = latencies_;
+    std::sort(sorted.begin(), sorted.end());
+    auto percentile = [&](std::size_t percent) {
+        return sorted.empty() ? 0.0 : sorted[std::min(sorted.size() - 1, sorted.size() * percent / 100)];
+    };
+    std::ostringstream stats;
+    stats << std::fixed << std::setprecision(3) << "{\"workers\":" << worker_count_ << ",\"queued\":" << queue_.size()
+          << ",\"active\":" << active_ << ",\"served\":" << served_ << ",\"failed\":" << failed_
+          << ",\"latency_ms\":{\"p50\":" << percentile(50) << ",\"p95\":" << percentile(95)
+          << ",\"p99\":" << percentile(99) << ",\"max\":" << (sorted.empty() ? 0.0 : sorted.back()) << "}}";
+    return stats.str();
+}
+
+void Server::Stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    // Wakes the accept loop; new connections are refused from here on.
+    shutdown(listener_, SHUT_RDWR);
+    ready_.notify_all();
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "buffer_pool.h"
+#include "protocol.h"
+#include "result_cache.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Long-running filter service on a Unix domain socket, speaking the protocol of protocol.h.
+// Accepted connections wait in a queue for one of a fixed set of workers, which stay up for the
+// lifetime of the server; a worker parses the chain with Controller::ParseFilters and runs it
+// inline, with pixel buffers recycled through a BufferPool, so a warm server neither starts
+// threads nor allocates image buffers per request.
+class Server {
+public:
+    // Latency percentiles cover this many of the latest requests.
+    static constexpr std::size_t kLatencyWindow = 1024;
+    // Pause before accepting again when the process runs out of descriptors or memory.
+    static constexpr std::chrono::milliseconds kAcceptBackoff{100};
+    // Longest wait for a client to send or take any bytes of a message before its connection is
+    // dropped, so that stalled clients can not hold the workers.
+    static constexpr std::chrono::seconds kIoTimeout{30};
+
+    Server(std::string socket_path, std::size_t worker_count, ResultCache *cache = nullptr);
+
+    Server(const Server &) = delete;
+
+    Server &operator=(const Server &) = delete;
+
+    // Serves requests until a shutdown request, then finishes the queued ones. Throws
+    // std::runtime_error if the socket can not be set up.
+    void Run();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Job {
+        int fd;
+        Clock::time_point accepted;
+    };
+
+    void WorkerLoop();
+
+    void Handle(const Job &job);
+
+    protocol::Message Process(protocol::Message &request);
+
+    // Queue depth, counts and latency percentiles as one JSON object.
+    std::string Stats() const;
+
+    void Stop();
+
+    std::string socket_path_;
+    std::size_t worker_count_;
+    ResultCache *cache_;
+    BufferPool buffers_;
+    int listener_ = -1;
+
+    mutable std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<Job> queue_;
+    bool stopping_ = false;
+    std::size_t active_ = 0;
+    std::size_t served_ = 0;
+    std::size_t failed_ = 0;
+    // The latest kLatencyWindow latencies in milliseconds, from accepting the connection to
+    // sending the response; a ring once full.
+    std::vector<double> latencies_;
+    std::size_t next_latency_ = 0;
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Bounded ring buffer between exactly one producer thread and one consumer thread. Push and Pop
+// take no lock: each side owns one index and publishes it with a release store. A side that has
+// to wait sleeps on a counter that every Push, Pop and Close bumps, so it never misses a change.
+// Close wakes both sides; Push then fails, and Pop fails once the queue is drained.
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(std::size_t capacity) : slots_(capacity + 1) {
+    }
+
+    SpscQueue(const SpscQueue &) = delete;
+
+    SpscQueue &operator=(const SpscQueue &) = delete;
+
+    // Waits while the queue is full; false if it is closed.
+    bool Push(T value) {
+        std::size_t tail = tail_.load(std::memory_order_relaxed);
+        std::size_t next = (tail + 1) % slots_.size();
+        while (true) {
+            std::uint32_t seen = changes_.load(std::memory_order_acquire);
+            if (closed_.load(std::memory_order_acquire)) {
+                return false;
+            }
+            if (next != head_.load(std::memory_order_acquire)) {
+                break;
+            }
+            changes_.wait(seen, std::memory_order_acquire);
+        }
+        slots_[tail] = std::move(value);
+        tail_.store(next, std::memory_order_release);
+        Signal();
+        return true;
+    }
+
+    // Waits while the queue is empty; false if it is closed and empty.
+    bool Pop(T &value) {
+        std::size_t head = head_.load(std::memory_order_relaxed);
+        while (true) {
+            std::uint32_t seen = changes_.load(std::memory_order_acquire);
+            if (head != tail_.load(std::memory_order_acquire)) {
+                break;
+            }
+            if (closed_.load(std::memory_order_acquire)) {
+                return false;
+            }
+            changes_.wait(seen, std::memory_order_acquire);
+        }
+        value = std::move(slots_[head]);
+        head_.store((head + 1) % slots_.size(), std::memory_order_release);
+        Signal();
+        return true;
+    }
+
+    // May be called from any thread, also more than once.
+    void Close() {
+        closed_.store(true, std::memory_order_release);
+        Signal();
+    }
+
+private:
+    void Signal() {
+        changes_.fetch_add(1, std::memory_order_acq_rel);
+        changes_.notify_all();
+    }
+
+    std::vector<T> slots_;
+    // The consumer owns head_, the producer tail_; the queue is empty when they are equal.
+    std::atomic<std::size_t> head_ = 0;
+    std::atomic<std::size_t> tail_ = 0;
+    std::atomic<std::uint32_t> changes_ = 0;
+    std::atomic<bool> closed_ = false;
+};
@@ -0,0 +1,331 @@
+#pragma once
+
+#include "convolution.h"
+#include "filter.h"
+#include "kernels.h"
+#include "point.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Stages of a StaticPipeline. They share one interface, resolved at compile time instead of through
+// virtual calls: GetHeight() and GetWidth() of the output and Write(i, dst), which writes output row
+// i into dst, for rows i in non-decreasing order. Stages with kDirect set also have Row(i), row i
+// where it already lies in memory, valid for any i as long as the stage; the stage after them reads
+// it in place instead of having it copied. Every stage holds the one before it by value, so the
+// whole chain is a single type and every row passes from one row kernel to the next without
+// copies in between: a run of point filters is one point::Lut that reads its input where it lies,
+// and a convolution loads its window straight from the stage before it and writes its output row
+// straight into the destination.
+namespace static_pipeline {
+
+class Source {
+public:
+    static constexpr bool kDirect = true;
+
+    explicit Source(const Bitmap *bitmap) : bitmap_(bitmap) {
+    }
+
+    int32_t GetHeight() const {
+        return bitmap_->GetHeight();
+    }
+
+    int32_t GetWidth() const {
+        return bitmap_->GetWidth();
+    }
+
+    const Color *Row(int32_t i) const {
+        return bitmap_->GetRow(i);
+    }
+
+    void Write(int32_t i, Color *dst) {
+        std::memcpy(dst, Row(i), static_cast<std::size_t>(GetWidth()) * sizeof(Color));
+    }
+
+private:
+    const Bitmap *bitmap_;
+};
+
+// The crop fitted to its input, as in Pipeline: the last rows and the first columns are kept.
+template <typename Upstream>
+class CropStage {
+public:
+    static constexpr bool kDirect = Upstream::kDirect;
+
+    CropStage(Upstream upstream, const Crop &crop) : upstream_(std::move(upstream)) {
+        Crop fitted = crop.Fit(upstream_.GetHeight(), upstream_.GetWidth());
+        height_ = fitted.GetHeight();
+        width_ = fitted.GetWidth();
+        offset_ = upstream_.GetHeight() - height_;
+        if constexpr (!kDirect) {
+            row_.resize(upstream_.GetWidth());
+        }
+    }
+
+    int32_t GetHeight() const {
+        return height_;
+    }
+
+    int32_t GetWidth() const {
+        return width_;
+    }
+
+    const Color *Row(int32_t i) const requires kDirect {
+        return upstream_.Row(i + offset_);
+    }
+
+    void Write(int32_t i, Color *dst) {
+        const Color *src = nullptr;
+        if constexpr (kDirect) {
+            src = Row(i);
+        } else {
+            upstream_.Write(i + offset_, row_.data());
+            src = row_.data();
+        }
+        std::memcpy(dst, src, static_cast<std::size_t>(width_) * sizeof(Color));
+    }
+
+private:
+    Upstream upstream_;
+    int32_t height_;
+    int32_t width_;
+    int32_t offset_;
+    // The full upstream row of an upstream that is not direct.
+    std::vector<Color> row_;
+};
+
+// A run of consecutive point filters, compiled into one point::Lut as they are stacked.
+template <typename Upstream>
+class LutStage {
+public:
+    static constexpr bool kDirect = false;
+
+    explicit LutStage(Upstream upstream) : upstream_(std::move(upstream)) {
+    }
+
+    void Append(const PixelFilter &filter) {
+        filter.Compile(lut_);
+    }
+
+    // Appends the grey conversion EdgeDetection prepares its rows with.
+    void AppendGrey() {
+        lut_.Grey();
+    }
+
+    int32_t GetHeight() const {
+        return upstream_.GetHeight();
+    }
+
+    int32_t GetWidth() const {
+        return upstream_.GetWidth();
+    }
+
+    void Write(int32_t i, Color *dst) {
+        if constexpr (Upstream::kDirect) {
+            lut_.ApplyRow(upstream_.Row(i), dst, GetWidth());
+        } else {
+            upstream_.Write(i, dst);
+            lut_.ApplyRow(dst, dst, GetWidth());
+        }
+    }
+
+private:
+    Upstream upstream_;
+    point::Lut lut_;
+};
+
+template <typename Stage>
+constexpr bool kIsLutStage = false;
+
+template <typename Upstream>
+constexpr bool kIsLutStage<LutStage<Upstream>> = true;
+
+// A windowed Convolution, Sharpening and EdgeDetection among them, through the same convolve row
+// kernel as the filter itself. Prepared input rows enter a ring of 2 * radius + 1; with a direct
+// upstream and nothing to prepare the window points at the upstream rows instead. With `grey` the
+// rows are prepared as EdgeDetection does, by the grey conversion.
+template <typename Upstream>
+class WindowStage {
+public:
+    static constexpr bool kDirect = false;
+
+    WindowStage(Upstream upstream, const Convolution &filter, bool grey)
+            : upstream_(std::move(upstream)),
+              taps_(filter.GetKernel().GetTaps()),
+              radius_(taps_.size / 2),
+              grey_(grey),
+              height_(upstream_.GetHeight()),
+              width_(upstream_.GetWidth()),
+              rows_(taps_.size),
+              sums_(6 * static_cast<std::size_t>(width_)) {
+        if (taps_.border == convolution::Border::Wrap) {
+            throw std::invalid_argument("StaticPipeline has no wrapped convolution, it needs the whole image");
+        }
+        if (grey_) {
+            grey_lut_.Grey();
+        }
+        if (!InPlace()) {
+            ring_.resize(static_cast<std::size_t>(taps_.size) * width_);
+        }
+    }
+
+    int32_t GetHeight() const {
+        return height_;
+    }
+
+    int32_t GetWidth() const {
+        return width_;
+    }
+
+    void Write(int32_t i, Color *dst) {
+        if (InPlace()) {
+            if constexpr (Upstream::kDirect) {
+                for (int32_t k = 0; k < taps_.size; ++k) {
+                    rows_[k] = upstream_.Row(MapRow(i - radius_ + k));
+                }
+            }
+        } else {
+            int32_t first = std::max(0, i - radius_);
+            int32_t last = std::min(height_ - 1, i + radius_);
+            for (next_ = std::max(next_, first); next_ <= last; ++next_) {
+                Load(next_, Slot(next_));
+            }
+            for (int32_t k = 0; k < taps_.size; ++k) {
+                rows_[k] = Slot(MapRow(i - radius_ + k));
+            }
+        }
+        GetKernels().convolve(rows_.data(), taps_, dst, width_, sums_.data());
+    }
+
+private:
+    // Whether the window reads the upstream rows where they lie.
+    bool InPlace() const {
+        return Upstream::kDirect && !grey_;
+    }
+
+    int32_t MapRow(int32_t i) const {
+        return convolution::BorderIndex(taps_.border, i, height_);
+    }
+
+    Color *Slot(int32_t i) {
+        return ring_.data() + static_cast<std::size_t>(i % taps_.size) * width_;
+    }
+
+    void Load(int32_t i, Color *dst) {
+        if constexpr (Upstream::kDirect) {
+            grey_lut_.ApplyRow(upstream_.Row(i), dst, width_);
+        } else {
+            upstream_.Write(i, dst);
+            if (grey_) {
+                grey_lut_.ApplyRow(dst, dst, width_);
+            }
+        }
+    }
+
+    Upstream upstream_;
+    convolution::Taps taps_;
+    int32_t radius_;
+    bool grey_;
+    point::Lut grey_lut_;
+    int32_t height_;
+    int32_t width_;
+    // Next upstream row to load; row r sits in slot r % taps_.size.
+    int32_t next_ = 0;
+    std::vector<Color> ring_;
+    std::vector<const Color *> rows_;
+    std::vector<float> sums_;
+};
+
+template <typename F>
+constexpr bool kUnsupported = false;
+
+template <typename Upstream>
+Upstream Stack(Upstream upstream) {
+    return upstream;
+}
+
+template <typename Upstream, typename F, typename... Rest>
+auto Stack(Upstream upstream, const F &filter, const Rest &...rest) {
+    if constexpr (std::is_base_of_v<PixelFilter, F>) {
+        if constexpr (kIsLutStage<Upstream>) {
+            upstream.Append(filter);
+            return Stack(std::move(upstream), rest...);
+        } else {
+            LutStage<Upstream> stage(std::move(upstream));
+            stage.Append(filter);
+            return Stack(std::move(stage), rest...);
+        }
+    } else if constexpr (std::is_base_of_v<EdgeDetection, F>) {
+        if (filter.GetAdaptiveRadius() != 0) {
+            throw std::invalid_argument("StaticPipeline has no adaptive edge detection, it needs the whole image");
+        }
+        // A run of point filters before it takes the grey conversion over.
+        if constexpr (kIsLutStage<Upstream>) {
+            upstream.AppendGrey();
+            return Stack(WindowStage<Upstream>(std::move(upstream), filter, false), rest...);
+        } else {
+            return Stack(WindowStage<Upstream>(std::move(upstream), filter, true), rest...);
+        }
+    } else if constexpr (std::is_base_of_v<Convolution, F>) {
+        return Stack(WindowStage<Upstream>(std::move(upstream), filter, false), rest...);
+    } else if constexpr (std::is_same_v<Crop, F>) {
+        return Stack(CropStage<Upstream>(std::move(upstream), filter), rest...);
+    } else {
+        static_assert(kUnsupported<F>, "StaticPipeline has no stage for this filter");
+    }
+}
+
+}  // namespace static_pipeline
+
+// A filter chain fixed at compile time, e.g. StaticPipeline<Crop, Grayscale, Sharpening>, for code
+// that embeds the filters and knows its chain when it is built. The filters are composed as types
+// into one loop over the output rows that calls the same row kernels as Pipeline, with no virtual
+// calls, no row copies between stages and the last stage writing into the result; output is
+// identical to Pipeline. Crop, every point filter and the windowed Convolution filters, Sharpening
+// and EdgeDetection among them, are supported; any other filter fails to compile, and a wrapped
+// Convolution or an adaptive EdgeDetection throws std::invalid_argument.
+template <typename... Filters>
+class StaticPipeline {
+public:
+    explicit StaticPipeline(Filters... filters) : filters_(std::move(filters)...) {
+    }
+
+    // Always returns a new Bgr bitmap; the input, in any format, is left untouched. With a pool
+    // the rows are split into bands, each with stages of its own.
+    Bitmap *Apply(const Bitmap *bitmap, ThreadPool *pool = nullptr) const {
+        std::unique_ptr<Bitmap> converted;
+        if (bitmap->GetFormat() != PixelFormat::Bgr) {
+            converted.reset(bitmap->Convert(PixelFormat::Bgr));
+            bitmap = converted.get();
+        }
+        auto chain = Build(bitmap);
+        BitmapFileHeader file_header = bitmap->GetFileHeader();
+        BitmapInfoHeader info_header = bitmap->GetInfoHeader();
+        Crop(chain.GetWidth(), chain.GetHeight()).UpdateSize(file_header, info_header);
+        auto *result = new Bitmap(file_header, info_header);
+        RowBands(chain.GetHeight(), pool).Run([&](int32_t begin, int32_t end) {
+            auto band = Build(bitmap);
+            for (int32_t i = begin; i < end; ++i) {
+                band.Write(i, result->GetRow(i));
+            }
+        });
+        return result;
+    }
+
+private:
+    auto Build(const Bitmap *bitmap) const {
+        return std::apply(
+                [bitmap](const Filters &...filters) {
+                    return static_pipeline::Stack(static_pipeline::Source(bitmap), filters...);
+                },
+                filters_);
+    }
+
+    std::tuple<Filters...> filters_;
+};
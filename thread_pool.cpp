@@ -0,0 +1,166 @@
+#include "thread_pool.h"
+#include "profile.h"
+#include <algorithm>
+
+namespace {
+thread_local bool inside_pool_task = false;
+}
+
+ThreadPool::ThreadPool(std::size_t thread_count) {
+    thread_count = std::max<std::size_t>(thread_count, 1);
+    for (std::size_t i = 0; i < thread_count; ++i) {
+        queues_.push_back(std::make_unique<Queue>());
+    }
+    for (std::size_t i = 1; i < thread_count; ++i) {
+        workers_.emplace_back(&ThreadPool::WorkerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread &worker : workers_) {
+        worker.join();
+    }
+}
+
+std::size_t ThreadPool::GetThreadCount() const {
+    return queues_.size();
+}
+
+void ThreadPool::ParallelFor(std::size_t count, const std::function<void(std::size_t)> &task) {
+    if (count == 0) {
+        return;
+    }
+    if (workers_.empty() || inside_pool_task || count == 1) {
+        for (std::size_t k = 0; k < count; ++k) {
+            task(k);
+        }
+        return;
+    }
+
+    std::lock_guard<std::mutex> run_lock(run_mutex_);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        task_ = &task;
+        pending_ = count;
+        error_ = nullptr;
+    }
+    for (std::size_t k = 0; k < count; ++k) {
+        Queue &queue = *queues_[k % queues_.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(k);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++generation_;
+    }
+    wake_.notify_all();
+
+    inside_pool_task = true;
+    RunTasks(0);
+    inside_pool_task = false;
+
+    std::exception_ptr error;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return pending_ == 0; });
+        task_ = nullptr;
+        error = error_;
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void ThreadPool::WorkerLoop(std::size_t id) {
+    inside_pool_task = true;
+    std::size_t seen_generation = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [&] { return stop_ || generation_ != seen_generation; });
+            if (stop_) {
+                return;
+            }
+            seen_generation = generation_;
+        }
+        RunTasks(id);
+    }
+}
+
+void ThreadPool::RunTasks(std::size_t id) {
+    std::size_t task;
+    while (PopTask(id, task)) {
+        try {
+            (*task_)(task);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!error_) {
+                error_ = std::current_exception();
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (--pending_ == 0) {
+            done_.notify_all();
+        }
+    }
+}
+
+bool ThreadPool::PopTask(std::size_t id, std::size_t &task) {
+    {
+        Queue &own = *queues_[id];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = own.tasks.back();
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for (std::size_t k = 1; k < queues_.size(); ++k) {
+        Queue &victim = *queues_[(id + k) % queues_.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+RowBands::RowBands(std::int32_t height, ThreadPool *pool) : height_(height), pool_(pool), count_(1) {
+    if (pool_ != nullptr && height_ > 0) {
+        std::size_t max_count = (height_ + kMinBandHeight - 1) / kMinBandHeight;
+        count_ = std::min(pool_->GetThreadCount() * kBandsPerThread, max_count);
+        count_ = std::max<std::size_t>(count_, 1);
+    }
+}
+
+std::size_t RowBands::GetCount() const {
+    return count_;
+}
+
+void RowBands::Run(const std::function<void(std::int32_t begin, std::int32_t end)> &task) const {
+    RunIndexed([&task](std::size_t, std::int32_t begin, std::int32_t end) { task(begin, end); });
+}
+
+void RowBands::RunIndexed(
+        const std::function<void(std::size_t band, std::int32_t begin, std::int32_t end)> &task) const {
+    if (pool_ == nullptr || count_ == 1) {
+        task(0, 0, height_);
+        return;
+    }
+    // Two pointers, which std::function holds without allocating.
+    pool_->ParallelFor(count_, [this, &task](std::size_t k) {
+        Profiler::Span span("band");
+        task(k, GetBegin(k), GetBegin(k + 1));
+    });
+}
+
+std::int32_t RowBands::GetBegin(std::size_t band) const {
+    return static_cast<std::int32_t>(static_cast<std::int64_t>(height_) * band / count_);
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of workers with one task deque each. Tasks of a ParallelFor are dealt round-robin;
+// a worker pops its own deque from the back and steals from the front of the others when idle.
+// The calling thread works as worker 0, so a pool of one thread runs everything inline.
+class ThreadPool {
+public:
+    explicit ThreadPool(std::size_t thread_count);
+
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    std::size_t GetThreadCount() const;
+
+    // Runs task(k) for every k in [0, count) and waits for all of them. The first exception
+    // thrown by a task is rethrown here. Nested calls from inside a task run inline.
+    void ParallelFor(std::size_t count, const std::function<void(std::size_t)> &task);
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::size_t> tasks;
+    };
+
+    void WorkerLoop(std::size_t id);
+
+    void RunTasks(std::size_t id);
+
+    bool PopTask(std::size_t id, std::size_t &task);
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+
+    std::mutex run_mutex_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    const std::function<void(std::size_t)> *task_ = nullptr;
+    std::size_t generation_ = 0;
+    std::size_t pending_ = 0;
+    std::exception_ptr error_;
+    bool stop_ = false;
+};
+
+// Splits rows [0, height) into bands, a few per thread so that idle workers have something to steal.
+// Without a pool the whole range is a single band.
+class RowBands {
+public:
+    static constexpr std::int32_t kMinBandHeight = 16;
+    static constexpr std::size_t kBandsPerThread = 4;
+
+    RowBands(std::int32_t height, ThreadPool *pool);
+
+    std::size_t GetCount() const;
+
+    void Run(const std::function<void(std::int32_t begin, std::int32_t end)> &task) const;
+
+    // Same, also passing the index of the band, from 0 to GetCount() - 1.
+    void RunIndexed(const std::function<void(std::size_t band, std::int32_t begin, std::int32_t end)> &task) const;
+
+private:
+    std::int32_t GetBegin(std::size_t band) const;
+
+    std::int32_t height_;
+    ThreadPool *pool_;
+    std::size_t count_;
+};
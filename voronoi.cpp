@@ -0,0 +1,117 @@
+#include "voronoi.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+
+namespace voronoi {
+namespace {
+
+constexpr std::int32_t kMinCellSize = 8;
+constexpr std::int32_t kMaxCellSize = 256;
+// Average number of seeds per cell.
+constexpr double kSeedsPerCell = 2.0;
+
+std::int64_t Square(std::int64_t value) {
+    return value * value;
+}
+
+}  // namespace
+
+std::vector<Point> DrawPoints(std::uint32_t count, std::uint32_t seed, std::int32_t height, std::int32_t width) {
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<> height_distribution(0, height - 1);
+    std::uniform_int_distribution<> width_distribution(0, width - 1);
+    std::vector<Point> points(count);
+    for (Point &point : points) {
+        point = {height_distribution(rng), width_distribution(rng)};
+    }
+    return points;
+}
+
+SeedGrid::SeedGrid(const std::vector<Point> &points, std::uint32_t first, std::int32_t height, std::int32_t width)
+        : points_(points), height_(height), width_(width) {
+    std::size_t count = points.size() > first ? points.size() - first : 0;
+    double area = static_cast<double>(height) * width;
+    auto cell_size =
+            static_cast<std::int32_t>(std::lround(std::sqrt(area * kSeedsPerCell / std::max<std::size_t>(count, 1))));
+    cell_size_ = std::clamp(cell_size, kMinCellSize, kMaxCellSize);
+    rows_ = (height + cell_size_ - 1) / cell_size_;
+    columns_ = (width + cell_size_ - 1) / cell_size_;
+
+    // Counting sort of the seeds by cell; every bucket keeps them in index order.
+    std::size_t cells = static_cast<std::size_t>(rows_) * columns_;
+    auto cell_of = [&](const Point &point) {
+        return static_cast<std::size_t>(point.first / cell_size_) * columns_ + point.second / cell_size_;
+    };
+    bucket_begin_.assign(cells + 1, 0);
+    for (std::size_t i = first; i < points.size(); ++i) {
+        ++bucket_begin_[cell_of(points[i]) + 1];
+    }
+    for (std::size_t c = 0; c < cells; ++c) {
+        bucket_begin_[c + 1] += bucket_begin_[c];
+    }
+    bucket_seeds_.resize(count);
+    std::vector<std::uint32_t> fill(bucket_begin_.begin(), bucket_begin_.end() - 1);
+    for (std::size_t i = first; i < points.size(); ++i) {
+        bucket_seeds_[fill[cell_of(points[i])]++] = static_cast<std::uint32_t>(i);
+    }
+}
+
+void SeedGrid::Candidates(std::int32_t row, std::int32_t column, std::vector<std::uint32_t> &candidates) const {
+    std::int32_t top = row * cell_size_;
+    std::int32_t bottom = std::min(height_, top + cell_size_) - 1;
+    std::int32_t left = column * cell_size_;
+    std::int32_t right = std::min(width_, left + cell_size_) - 1;
+
+    auto min_distance = [&](const Point &point) {
+        std::int64_t dy = std::max({0, top - point.first, point.first - bottom});
+        std::int64_t dx = std::max({0, left - point.second, point.second - right});
+        return Square(dy) + Square(dx);
+    };
+    auto max_distance = [&](const Point &point) {
+        std::int64_t dy = std::max(point.first - top, bottom - point.first);
+        std::int64_t dx = std::max(point.second - left, right - point.second);
+        return Square(dy) + Square(dx);
+    };
+    // Calls visit(seed) for every seed in the cells at Chebyshev distance `ring` from the tile.
+    auto for_ring = [&](std::int32_t ring, auto &&visit) {
+        for (std::int32_t r = std::max(0, row - ring); r <= std::min(rows_ - 1, row + ring); ++r) {
+            bool edge_row = r == row - ring || r == row + ring;
+            std::int32_t step = edge_row ? 1 : 2 * ring;
+            for (std::int32_t c = column - ring; c <= column + ring; c += step) {
+                if (c < 0 || c >= columns_) {
+                    continue;
+                }
+                std::size_t cell = static_cast<std::size_t>(r) * columns_ + c;
+                for (std::uint32_t k = bucket_begin_[cell]; k < bucket_begin_[cell + 1]; ++k) {
+                    visit(bucket_seeds_[k]);
+                }
+            }
+        }
+    };
+
+    // Widen the search ring by ring until no seed outside it can come closer than the best bound.
+    // A seed `ring` cells away is at least (ring - 1) * cell_size + 1 pixels away in one axis.
+    std::int64_t bound = std::numeric_limits<std::int64_t>::max();
+    std::int32_t last_ring = std::max(rows_, columns_);
+    std::int32_t ring = 0;
+    for (; ring <= last_ring; ++ring) {
+        if (ring > 0 && Square(static_cast<std::int64_t>(ring - 1) * cell_size_ + 1) > bound) {
+            break;
+        }
+        for_ring(ring, [&](std::uint32_t seed) { bound = std::min(bound, max_distance(points_[seed])); });
+    }
+
+    candidates.clear();
+    for (std::int32_t r = 0; r < ring; ++r) {
+        for_ring(r, [&](std::uint32_t seed) {
+            if (min_distance(points_[seed]) <= bound) {
+                candidates.push_back(seed);
+            }
+        });
+    }
+    std::sort(candidates.begin(), candidates.end());
+}
+
+}  // namespace voronoi
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace voronoi {
+
+// Seed coordinates as (row, column).
+using Point = std::pair<std::int32_t, std::int32_t>;
+
+// `count` points drawn uniformly over the image from std::mt19937 seeded with `seed`.
+std::vector<Point> DrawPoints(std::uint32_t count, std::uint32_t seed, std::int32_t height, std::int32_t width);
+
+// Uniform grid over the image whose cells double as buckets of seeds and as tiles of pixels.
+// For a tile it yields every seed that can be the nearest one to at least one of its pixels:
+// a seed farther from the whole tile than some other seed is from its farthest corner never wins,
+// not even a tie. Scanning the candidates of a tile in index order therefore picks exactly what
+// a scan over all seeds would.
+class SeedGrid {
+public:
+    // Seeds before `first` are not indexed and never returned as candidates.
+    SeedGrid(const std::vector<Point> &points, std::uint32_t first, std::int32_t height, std::int32_t width);
+
+    std::int32_t GetCellSize() const {
+        return cell_size_;
+    }
+
+    std::int32_t GetRows() const {
+        return rows_;
+    }
+
+    std::int32_t GetColumns() const {
+        return columns_;
+    }
+
+    // Candidates of the tile in ascending index order.
+    void Candidates(std::int32_t row, std::int32_t column, std::vector<std::uint32_t> &candidates) const;
+
+private:
+    const std::vector<Point> &points_;
+    std::int32_t height_;
+    std::int32_t width_;
+    std::int32_t cell_size_;
+    std::int32_t rows_;
+    std::int32_t columns_;
+    // Seeds of cell c are bucket_seeds_[bucket_begin_[c], bucket_begin_[c + 1]).
+    std::vector<std::uint32_t> bucket_begin_;
+    std::vector<std::uint32_t> bucket_seeds_;
+};
+
+}  // namespace voronoi